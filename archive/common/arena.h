@@ -0,0 +1,243 @@
+#ifndef ADE_COMMON_ARENA_H
+#define ADE_COMMON_ARENA_H
+
+/*
+ * region allocator for book nodes.
+ *
+ * a book allocates a list node and a hash node per order and frees
+ * them in random order all day. from the global heap those nodes end
+ * up scattered over the whole address space, so a random cancel is a
+ * dTLB miss as often as a cache miss. a Region instead maps big chunks
+ * up front and hands out nodes from them:
+ *
+ *   - nodes, anything up to MAX_NODE bytes, come from a free list per
+ *     16 byte size class, so a freed order node is the next one reused
+ *     and the working set stays packed in the chunks already mapped
+ *   - bigger blocks (hash bucket arrays) are rounded up to a power of
+ *     two and come from a free list per power, so the array a table
+ *     drops when it rehashes goes to the next table that grows to that
+ *     size instead of staying lost until the region goes. a table
+ *     grown from empty leaves less behind than it ends up holding,
+ *     reserve() up front leaves nothing
+ *   - only types aligned past 16 bytes are bumped off the chunk and
+ *     never given back
+ *
+ * chunks are 2MB aligned so they can be backed by huge pages: explicit
+ * ones through MAP_HUGETLB (needs vm.nr_hugepages reserved, falls back
+ * when there are none) or transparent ones through madvise. 512 times
+ * fewer pages means the TLB covers 512 times more book.
+ *
+ * Allocator<T> plugs a region into the standard containers, the region
+ * has to outlive them:
+ *
+ *   arena::Region region(1 << 30, arena::Pages::huge);
+ *   std::list<Order, arena::Allocator<Order>> orders{arena::Allocator<Order>(region)};
+ *
+ * not thread safe, one region per book/thread
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+#include <sys/mman.h>
+
+namespace arena {
+
+  enum class Pages {
+    normal,
+    // madvise(MADV_HUGEPAGE), the kernel backs what it can
+    transparent,
+    // MAP_HUGETLB, transparent if none are reserved
+    huge
+  };
+
+  class Region {
+  public:
+    static constexpr size_t HUGE_PAGE = 2 << 20;
+    // nodes up to this size come from the free lists
+    static constexpr size_t MAX_NODE = 512;
+
+    explicit Region(size_t chunk_bytes = 64 << 20, Pages pages = Pages::transparent)
+      :chunk_bytes_(round_up(chunk_bytes, HUGE_PAGE))
+      ,pages_(pages) {}
+
+    Region(const Region &) = delete;
+    Region & operator=(const Region &) = delete;
+
+    ~Region() {
+      for (auto & chunk : chunks_) ::munmap(chunk.p, chunk.bytes);
+    }
+
+    // bump allocation, only released with the region
+    void * allocate(size_t bytes, size_t align = alignof(std::max_align_t)) {
+      auto p = reinterpret_cast<char *>(round_up(reinterpret_cast<uintptr_t>(next_), align));
+      if (!next_ || p + bytes > end_) {
+        grow(bytes + align);
+        p = reinterpret_cast<char *>(round_up(reinterpret_cast<uintptr_t>(next_), align));
+      }
+      next_ = p + bytes;
+      return p;
+    }
+
+    void * allocate_node(size_t bytes) {
+      assert(bytes <= MAX_NODE);
+      auto & head = free_[size_class(bytes)];
+      if (head) {
+        auto p = head;
+        head = head->next;
+        return p;
+      }
+      return allocate((size_class(bytes) + 1) * CLASS, CLASS);
+    }
+
+    void deallocate_node(void * p, size_t bytes) {
+      auto & head = free_[size_class(bytes)];
+      head = new (p) FreeNode {head};
+    }
+
+    // a node or a power of two block, 16 byte aligned
+    void * allocate_block(size_t bytes) {
+      if (bytes <= MAX_NODE) return allocate_node(bytes);
+      auto & head = blocks_[block_class(bytes)];
+      if (head) {
+        auto p = head;
+        head = head->next;
+        return p;
+      }
+      return allocate(size_t(1) << block_class(bytes), CLASS);
+    }
+
+    void deallocate_block(void * p, size_t bytes) {
+      if (bytes <= MAX_NODE) return deallocate_node(p, bytes);
+      auto & head = blocks_[block_class(bytes)];
+      head = new (p) FreeNode {head};
+    }
+
+    size_t mapped() const {
+      size_t res = 0;
+      for (auto & chunk : chunks_) res += chunk.bytes;
+      return res;
+    }
+
+    // chunks that got explicit huge pages
+    size_t huge_chunks() const {
+      size_t res = 0;
+      for (auto & chunk : chunks_) res += chunk.huge;
+      return res;
+    }
+
+  private:
+    static constexpr size_t CLASS = 16;
+
+    struct FreeNode {
+      FreeNode * next;
+    };
+
+    struct Chunk {
+      void * p;
+      size_t bytes;
+      bool huge;
+    };
+
+    static size_t round_up(size_t n, size_t align) {
+      return (n + align - 1) / align * align;
+    }
+
+    static size_t size_class(size_t bytes) {
+      return (bytes + CLASS - 1) / CLASS - 1;
+    }
+
+    // log2 of bytes rounded up to a power of two
+    static size_t block_class(size_t bytes) {
+      size_t res = 0;
+      while ((size_t(1) << res) < bytes) res++;
+      return res;
+    }
+
+    void grow(size_t bytes) {
+      size_t size = round_up(std::max(bytes, chunk_bytes_), HUGE_PAGE);
+      void * p = MAP_FAILED;
+      bool huge = false;
+#ifdef MAP_HUGETLB
+      if (pages_ == Pages::huge) {
+        p = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        huge = p != MAP_FAILED;
+      }
+#endif
+      if (p == MAP_FAILED) p = map_aligned(size);
+      if (p == MAP_FAILED) throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+      if (!huge && pages_ != Pages::normal) ::madvise(p, size, MADV_HUGEPAGE);
+#endif
+      chunks_.push_back(Chunk {p, size, huge});
+      next_ = static_cast<char *>(p);
+      end_ = next_ + size;
+    }
+
+    // over maps by a huge page and trims both ends so the chunk starts
+    // on a 2MB boundary, which transparent huge pages need
+    static void * map_aligned(size_t size) {
+      void * p = ::mmap(nullptr, size + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) return p;
+      auto begin = reinterpret_cast<uintptr_t>(p);
+      auto aligned = round_up(begin, HUGE_PAGE);
+      if (aligned > begin) ::munmap(p, aligned - begin);
+      auto tail = aligned + size;
+      auto end = begin + size + HUGE_PAGE;
+      if (end > tail) ::munmap(reinterpret_cast<void *>(tail), end - tail);
+      return reinterpret_cast<void *>(aligned);
+    }
+
+    const size_t chunk_bytes_;
+    const Pages pages_;
+    std::vector<Chunk> chunks_;
+    char * next_ = nullptr;
+    char * end_ = nullptr;
+    FreeNode * free_[MAX_NODE / CLASS] = {};
+    FreeNode * blocks_[64] = {};
+  };
+
+  template <typename T>
+  class Allocator {
+  public:
+    using value_type = T;
+
+    explicit Allocator(Region & region)
+      :region_(&region) {}
+
+    template <typename U>
+    Allocator(const Allocator<U> & rhs)
+      :region_(rhs.region()) {}
+
+    T * allocate(size_t n) {
+      if (alignof(T) <= 16) return static_cast<T *>(region_->allocate_block(n * sizeof(T)));
+      return static_cast<T *>(region_->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T * p, size_t n) {
+      if (alignof(T) <= 16) region_->deallocate_block(p, n * sizeof(T));
+    }
+
+    Region * region() const {
+      return region_;
+    }
+
+    template <typename U>
+    bool operator== (const Allocator<U> & rhs) const {
+      return region_ == rhs.region();
+    }
+
+    template <typename U>
+    bool operator!= (const Allocator<U> & rhs) const {
+      return region_ != rhs.region();
+    }
+
+  private:
+    Region * region_;
+  };
+}
+
+#endif
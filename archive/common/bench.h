@@ -0,0 +1,394 @@
+#ifndef ADE_COMMON_BENCH_H
+#define ADE_COMMON_BENCH_H
+
+/*
+ * small microbenchmark harness, time_it from to/perfect_forward.cpp
+ * grown up.
+ *
+ * run() is for code that takes nanoseconds a call: it warms up, doubles
+ * the iteration count until one sample takes long enough for the clock
+ * to be accurate, then takes a number of samples and reports per call
+ * percentiles over them. each() is for calls that differ from each
+ * other, like the n-th add on a growing book: it times every call on
+ * its own with rdtsc and reports the percentiles over all of them, so
+ * the tail is the tail of real calls.
+ *
+ * do_not_optimize() and clobber() keep the compiler from deleting work
+ * whose result isn't used or hoisting it out of the timed loop:
+ *
+ *   bench::Suite suite(argc, argv);   // --csv/--json, --filter=, --samples=
+ *   suite.run("parse_price", [&]() {
+ *     bench::do_not_optimize(price::parse(p, out));
+ *   });
+ *   suite.each("book_add", n, [&](size_t i) { book.add(ids[i], ...); });
+ *   return suite.report();
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#ifdef __linux__
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace bench {
+
+  template <typename T>
+  inline void do_not_optimize(const T & value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+  }
+
+  template <typename T>
+  inline void do_not_optimize(T & value) {
+    asm volatile("" : "+r,m"(value) : : "memory");
+  }
+
+  // every store before this is done, every load after it is redone
+  inline void clobber() {
+    asm volatile("" : : : "memory");
+  }
+
+  // nanoseconds of one call, the original time_it on steady_clock
+  template <typename Func, typename... Params>
+  double time_it(Func && func, Params &&... params) {
+    auto before = std::chrono::steady_clock::now();
+    std::forward<Func>(func)(std::forward<Params>(params)...);
+    auto after = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(after - before).count();
+  }
+
+  // the same in seconds, for whole runs
+  template <typename Func, typename... Params>
+  double seconds(Func && func, Params &&... params) {
+    return time_it(std::forward<Func>(func), std::forward<Params>(params)...) / 1e9;
+  }
+
+  /*
+   * time stamp counter, a few ns to read against ~20 for steady_clock.
+   * ticks are converted with a rate measured once against steady_clock,
+   * which assumes an invariant tsc (every x86 of the last decade).
+   * elsewhere ticks are steady_clock nanoseconds
+   */
+  struct Tsc {
+    static uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+      return __rdtsc();
+#else
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    static double ns_per_tick() {
+      static const double rate = calibrate();
+      return rate;
+    }
+
+  private:
+    static double calibrate() {
+#if defined(__x86_64__) || defined(__i386__)
+      auto begin = std::chrono::steady_clock::now();
+      uint64_t start = now();
+      while (std::chrono::steady_clock::now() - begin < std::chrono::milliseconds(20));
+      uint64_t ticks = now() - start;
+      auto end = std::chrono::steady_clock::now();
+      return std::chrono::duration<double, std::nano>(end - begin).count() / ticks;
+#else
+      return 1.0;
+#endif
+    }
+  };
+
+  /*
+   * a hardware event counted for this thread in user space through
+   * perf_event_open, e.g. dTLB misses around a timed section. valid()
+   * is false wherever the kernel, the cpu or the container won't give
+   * us the counter (perf_event_paranoid > 2, no PMU in the vm, ...)
+   */
+  class Counter {
+  public:
+    Counter(uint32_t type, uint64_t config) {
+#ifdef __linux__
+      perf_event_attr attr;
+      memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = type;
+      attr.config = config;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      fd_ = int(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+    }
+
+    static Counter dtlb_load_misses() {
+#ifdef __linux__
+      return Counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+#else
+      return Counter(0, 0);
+#endif
+    }
+
+    Counter(Counter && rhs)
+      :fd_(rhs.fd_) {
+      rhs.fd_ = -1;
+    }
+
+    Counter(const Counter &) = delete;
+    Counter & operator=(const Counter &) = delete;
+
+    ~Counter() {
+#ifdef __linux__
+      if (fd_ >= 0) close(fd_);
+#endif
+    }
+
+    bool valid() const {
+      return fd_ >= 0;
+    }
+
+    void start() {
+#ifdef __linux__
+      if (fd_ < 0) return;
+      ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+
+    // events since start(), 0 if not valid
+    uint64_t stop() {
+      uint64_t count = 0;
+#ifdef __linux__
+      if (fd_ < 0) return 0;
+      ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(fd_, &count, sizeof(count)) != sizeof(count)) count = 0;
+#endif
+      return count;
+    }
+
+  private:
+    int fd_ = -1;
+  };
+
+  // nearest rank percentiles over per call nanoseconds
+  struct Stats {
+    size_t count = 0;
+    double mean = 0;
+    double min = 0;
+    double p50 = 0;
+    double p90 = 0;
+    double p99 = 0;
+    double p999 = 0;
+    double max = 0;
+
+    static Stats of(std::vector<double> samples) {
+      Stats s;
+      if (samples.empty()) return s;
+      std::sort(samples.begin(), samples.end());
+      auto rank = [&samples](double p) {
+        return samples[std::min(samples.size() - 1, size_t(p * samples.size()))];
+      };
+      double sum = 0;
+      for (auto v : samples) sum += v;
+      s.count = samples.size();
+      s.mean = sum / samples.size();
+      s.min = samples.front();
+      s.p50 = rank(0.5);
+      s.p90 = rank(0.9);
+      s.p99 = rank(0.99);
+      s.p999 = rank(0.999);
+      s.max = samples.back();
+      return s;
+    }
+  };
+
+  struct Result {
+    std::string name;
+    // calls per sample, 1 for each()
+    uint64_t iterations = 0;
+    Stats ns;
+  };
+
+  struct Options {
+    size_t samples = 30;
+    // a sample is grown to at least this long
+    double sample_ns = 1e6;
+    double warmup_ns = 1e7;
+  };
+
+  template <typename Func>
+  Result run(const std::string & name, Func && func, const Options & options = Options()) {
+    auto batch = [&func](uint64_t iterations) {
+      return time_it([&]() {
+        for (uint64_t i = 0; i < iterations; i++) {
+          func();
+          clobber();
+        }
+      });
+    };
+
+    double warm = 0;
+    while (warm < options.warmup_ns) warm += batch(1);
+
+    uint64_t iterations = 1;
+    while (batch(iterations) < options.sample_ns && iterations < (uint64_t(1) << 40)) iterations *= 2;
+
+    std::vector<double> samples;
+    samples.reserve(options.samples);
+    for (size_t s = 0; s < options.samples; s++) samples.push_back(batch(iterations) / iterations);
+    return Result {name, iterations, Stats::of(std::move(samples))};
+  }
+
+  /*
+   * times func(0) .. func(n-1) one call each. the cost of reading the
+   * counter twice is measured up front and taken off every call
+   */
+  template <typename Func>
+  Result each(const std::string & name, size_t n, Func && func) {
+    uint64_t overhead = ~uint64_t(0);
+    for (int i = 0; i < 1000; i++) {
+      uint64_t begin = Tsc::now();
+      clobber();
+      uint64_t end = Tsc::now();
+      overhead = std::min(overhead, end - begin);
+    }
+
+    std::vector<double> samples;
+    samples.reserve(n);
+    double rate = Tsc::ns_per_tick();
+    for (size_t i = 0; i < n; i++) {
+      uint64_t begin = Tsc::now();
+      func(i);
+      clobber();
+      uint64_t end = Tsc::now();
+      uint64_t ticks = end - begin;
+      samples.push_back((ticks > overhead ? ticks - overhead : 0) * rate);
+    }
+    return Result {name, 1, Stats::of(std::move(samples))};
+  }
+
+  /*
+   * collects results and prints them at the end, as csv (the default)
+   * or json. takes its own flags off the command line and leaves the
+   * rest to the program in args():
+   *
+   *   --json | --csv
+   *   --filter=text   only run benchmarks whose name contains text
+   *   --samples=n     samples per run()
+   *   --sample-ms=t   minimum length of one run() sample
+   */
+  class Suite {
+  public:
+    Suite() = default;
+
+    Suite(int argc, char * argv[]) {
+      for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--json") {
+          json_ = true;
+        } else if (arg == "--csv") {
+          json_ = false;
+        } else if (arg.compare(0, 9, "--filter=") == 0) {
+          filter_ = arg.substr(9);
+        } else if (arg.compare(0, 10, "--samples=") == 0) {
+          options_.samples = std::max(size_t(1), (size_t) std::stoul(arg.substr(10)));
+        } else if (arg.compare(0, 12, "--sample-ms=") == 0) {
+          options_.sample_ns = std::stod(arg.substr(12)) * 1e6;
+        } else {
+          args_.push_back(arg);
+        }
+      }
+    }
+
+    const std::vector<std::string> & args() const {
+      return args_;
+    }
+
+    // positional argument i, or value if there are fewer
+    std::string arg(size_t i, const std::string & value) const {
+      return i < args_.size() ? args_[i] : value;
+    }
+
+    bool selected(const std::string & name) const {
+      return name.find(filter_) != std::string::npos;
+    }
+
+    template <typename Func>
+    void run(const std::string & name, Func && func) {
+      if (selected(name)) results_.push_back(bench::run(name, std::forward<Func>(func), options_));
+    }
+
+    template <typename Func>
+    void each(const std::string & name, size_t n, Func && func) {
+      if (selected(name)) results_.push_back(bench::each(name, n, std::forward<Func>(func)));
+    }
+
+    // a result measured by the caller
+    void record(Result result) {
+      if (selected(result.name)) results_.push_back(std::move(result));
+    }
+
+    // the result recorded under name, null if --filter skipped it
+    const Result * find(const std::string & name) const {
+      for (auto & r : results_) if (r.name == name) return &r;
+      return nullptr;
+    }
+
+    // a plain value reported alongside, e.g. a message count or checksum
+    void note(const std::string & key, const std::string & value) {
+      notes_.emplace_back(key, value);
+    }
+
+    int report(std::ostream & out = std::cout) const {
+      if (json_) {
+        out << "{\"notes\":{";
+        for (size_t i = 0; i < notes_.size(); i++) {
+          out << (i ? "," : "") << "\"" << notes_[i].first << "\":\"" << notes_[i].second << "\"";
+        }
+        out << "},\"results\":[";
+        for (size_t i = 0; i < results_.size(); i++) {
+          auto & r = results_[i];
+          out << (i ? "," : "") << "{\"name\":\"" << r.name << "\",\"iterations\":" << r.iterations
+              << ",\"samples\":" << r.ns.count << ",\"mean_ns\":" << r.ns.mean
+              << ",\"min_ns\":" << r.ns.min << ",\"p50_ns\":" << r.ns.p50
+              << ",\"p90_ns\":" << r.ns.p90 << ",\"p99_ns\":" << r.ns.p99
+              << ",\"p999_ns\":" << r.ns.p999 << ",\"max_ns\":" << r.ns.max << "}";
+        }
+        out << "]}" << std::endl;
+      } else {
+        for (auto & note : notes_) out << note.first << "," << note.second << std::endl;
+        out << "name,iterations,samples,mean_ns,min_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns" << std::endl;
+        for (auto & r : results_) {
+          out << r.name << "," << r.iterations << "," << r.ns.count << "," << r.ns.mean
+              << "," << r.ns.min << "," << r.ns.p50 << "," << r.ns.p90 << "," << r.ns.p99
+              << "," << r.ns.p999 << "," << r.ns.max << std::endl;
+        }
+      }
+      return 0;
+    }
+
+  private:
+    bool json_ = false;
+    std::string filter_;
+    Options options_;
+    std::vector<std::string> args_;
+    std::vector<Result> results_;
+    std::vector<std::pair<std::string, std::string>> notes_;
+  };
+}
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef ADE_COMMON_BITMAP_H
+#define ADE_COMMON_BITMAP_H
+
+/*
+ * dynamic bitmap over 64 bit words, meant as a flag index over dense
+ * slots, e.g. one Bitmap per order state (live, partially filled, IOC,
+ * hidden) indexed by order slot instead of a bool per order struct.
+ *
+ * single bits are the usual shift and mask. the bulk operations work a
+ * word at a time: count() is one popcnt per word, find_next() skips
+ * zero words and finds the bit with tzcnt, and the and/or/xor/and_not
+ * combinators run 4 words per AVX2 instruction when built with -mavx2
+ * (plain word loops otherwise). count_and()/find_next_and() answer
+ * "how many / which are live and not hidden" without building the
+ * combined bitmap.
+ *
+ * bits past size() are kept zero so counts and scans never see them
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+#include <assert.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace bits {
+
+  class Bitmap {
+  public:
+    static constexpr size_t npos = size_t(-1);
+
+    explicit Bitmap(size_t size = 0, bool value = false) {
+      resize(size, value);
+    }
+
+    size_t size() const {
+      return size_;
+    }
+
+    void resize(size_t size, bool value = false) {
+      size_t old = size_;
+      if (value && old % 64) words_[old / 64] |= ~uint64_t(0) << (old % 64);
+      words_.resize((size + 63) / 64, value ? ~uint64_t(0) : 0);
+      size_ = size;
+      clear_tail();
+    }
+
+    bool test(size_t i) const {
+      assert(i < size_);
+      return words_[i / 64] >> (i % 64) & 1;
+    }
+
+    void set(size_t i) {
+      assert(i < size_);
+      words_[i / 64] |= uint64_t(1) << (i % 64);
+    }
+
+    void reset(size_t i) {
+      assert(i < size_);
+      words_[i / 64] &= ~(uint64_t(1) << (i % 64));
+    }
+
+    void flip(size_t i) {
+      assert(i < size_);
+      words_[i / 64] ^= uint64_t(1) << (i % 64);
+    }
+
+    void assign(size_t i, bool value) {
+      value ? set(i) : reset(i);
+    }
+
+    void clear() {
+      std::fill(words_.begin(), words_.end(), 0);
+    }
+
+    size_t count() const {
+      size_t n = 0;
+      for (auto w : words_) n += __builtin_popcountll(w);
+      return n;
+    }
+
+    bool any() const {
+      for (auto w : words_) {
+        if (w) return true;
+      }
+      return false;
+    }
+
+    // first set bit at or after i, npos if none
+    size_t find_next(size_t i) const {
+      if (i >= size_) return npos;
+      size_t k = i / 64;
+      uint64_t w = words_[k] & (~uint64_t(0) << (i % 64));
+      while (!w) {
+        if (++k == words_.size()) return npos;
+        w = words_[k];
+      }
+      return k * 64 + __builtin_ctzll(w);
+    }
+
+    size_t find_first() const {
+      return find_next(0);
+    }
+
+    // first bit at or after i set in both
+    size_t find_next_and(const Bitmap & rhs, size_t i) const {
+      assert(rhs.size_ == size_);
+      if (i >= size_) return npos;
+      size_t k = i / 64;
+      uint64_t w = words_[k] & rhs.words_[k] & (~uint64_t(0) << (i % 64));
+      while (!w) {
+        if (++k == words_.size()) return npos;
+        w = words_[k] & rhs.words_[k];
+      }
+      return k * 64 + __builtin_ctzll(w);
+    }
+
+    // bits set in both
+    size_t count_and(const Bitmap & rhs) const {
+      assert(rhs.size_ == size_);
+      size_t n = 0;
+      for (size_t k = 0; k < words_.size(); k++) n += __builtin_popcountll(words_[k] & rhs.words_[k]);
+      return n;
+    }
+
+    // bits set here and not in rhs
+    size_t count_and_not(const Bitmap & rhs) const {
+      assert(rhs.size_ == size_);
+      size_t n = 0;
+      for (size_t k = 0; k < words_.size(); k++) n += __builtin_popcountll(words_[k] & ~rhs.words_[k]);
+      return n;
+    }
+
+    Bitmap & operator&= (const Bitmap & rhs) {
+      combine<Op::And>(rhs);
+      return *this;
+    }
+
+    Bitmap & operator|= (const Bitmap & rhs) {
+      combine<Op::Or>(rhs);
+      return *this;
+    }
+
+    Bitmap & operator^= (const Bitmap & rhs) {
+      combine<Op::Xor>(rhs);
+      return *this;
+    }
+
+    // clears every bit set in rhs
+    Bitmap & and_not(const Bitmap & rhs) {
+      combine<Op::AndNot>(rhs);
+      return *this;
+    }
+
+    bool operator== (const Bitmap & rhs) const {
+      return size_ == rhs.size_ && words_ == rhs.words_;
+    }
+
+    const std::vector<uint64_t> & words() const {
+      return words_;
+    }
+
+  private:
+    enum class Op {And, Or, Xor, AndNot};
+
+    template <Op O>
+    static uint64_t apply(uint64_t a, uint64_t b) {
+      if constexpr (O == Op::And) return a & b;
+      else if constexpr (O == Op::Or) return a | b;
+      else if constexpr (O == Op::Xor) return a ^ b;
+      else return a & ~b;
+    }
+
+#ifdef __AVX2__
+    template <Op O>
+    static __m256i apply(__m256i a, __m256i b) {
+      if constexpr (O == Op::And) return _mm256_and_si256(a, b);
+      else if constexpr (O == Op::Or) return _mm256_or_si256(a, b);
+      else if constexpr (O == Op::Xor) return _mm256_xor_si256(a, b);
+      else return _mm256_andnot_si256(b, a);
+    }
+#endif
+
+    template <Op O>
+    void combine(const Bitmap & rhs) {
+      assert(rhs.size_ == size_);
+      size_t k = 0;
+#ifdef __AVX2__
+      for (; k + 4 <= words_.size(); k += 4) {
+        auto a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&words_[k]));
+        auto b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(&rhs.words_[k]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(&words_[k]), apply<O>(a, b));
+      }
+#endif
+      for (; k < words_.size(); k++) words_[k] = apply<O>(words_[k], rhs.words_[k]);
+    }
+
+    void clear_tail() {
+      if (size_ % 64) words_.back() &= ~(~uint64_t(0) << (size_ % 64));
+    }
+
+    std::vector<uint64_t> words_;
+    size_t size_ = 0;
+  };
+}
+
+#endif
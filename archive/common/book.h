@@ -0,0 +1,311 @@
+#ifndef ADE_COMMON_BOOK_H
+#define ADE_COMMON_BOOK_H
+
+/*
+ * price level book shared by the order book programs, templated on what
+ * an order id, a price, a share count and a side are:
+ *
+ *   struct Traits {
+ *     using OrderId = int;
+ *     using Price = uint64_t;
+ *     using Shares = uint32_t;
+ *     using Side = char;
+ *     static bool is_buy(Side s) { return s == 'B'; }
+ *   };
+ *
+ *   book::Book<Traits> b;
+ *   b.add({1, 'B', 45200000, 100});
+ *   b.level_of_bid(0);   // {45200000, 100}
+ *
+ * Level is one price: its orders in time priority and their total.
+ * Book keeps a sorted map of levels per side plus an id -> (level, order)
+ * index, so cancel, modify and execute by id are one hash probe and
+ * never walk a level. every change to a level goes to the Listener, the
+ * hook a program hangs level 2 publication on; the default one does
+ * nothing and compiles away.
+ *
+ * the order type is a parameter too, anything with order_id, side,
+ * price and shares members will do. so is the allocator every level,
+ * queue node and index node comes from, e.g. arena::Allocator to keep
+ * them out of the global heap
+ */
+
+#include <cassert>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+namespace book {
+
+  template <typename Traits>
+  struct Order {
+    typename Traits::OrderId order_id;
+    typename Traits::Side side;
+    typename Traits::Price price = 0;
+    typename Traits::Shares shares = 0;
+
+    Order(typename Traits::OrderId order_id, typename Traits::Side side,
+          typename Traits::Price price, typename Traits::Shares shares)
+      :order_id(order_id)
+      ,side(side)
+      ,price(price)
+      ,shares(shares) {}
+
+    bool done() const {
+      return shares == 0;
+    }
+  };
+
+  enum class LevelAction: char
+  {
+    Add = 'A',
+    Change = 'C',
+    Delete = 'D'
+  };
+
+  template <typename Alloc, typename T>
+  using Rebind = typename std::allocator_traits<Alloc>::template rebind_alloc<T>;
+
+  template <typename Order, typename Alloc = std::allocator<Order>>
+  class Level {
+  public:
+    using Shares = decltype(std::declval<Order>().shares);
+    using OrderList = std::list<Order, Rebind<Alloc, Order>>;
+    // stays valid until the order is removed
+    using Handle = typename OrderList::iterator;
+
+    Shares total_shares = 0;
+
+    explicit Level(const Alloc & alloc = Alloc())
+      :orders_(alloc) {}
+
+    Handle add(const Order & order) {
+      orders_.push_back(order);
+      total_shares += order.shares;
+      return std::prev(orders_.end());
+    }
+
+    void modify(Handle p, Shares new_shares) {
+      total_shares -= p->shares;
+      p->shares = new_shares;
+      total_shares += new_shares;
+    }
+
+    // takes shares off an order, e.g. a fill or a partial cancel
+    void reduce(Handle p, Shares shares) {
+      assert(p->shares >= shares);
+      p->shares -= shares;
+      total_shares -= shares;
+    }
+
+    void remove(Handle p) {
+      total_shares -= p->shares;
+      orders_.erase(p);
+    }
+
+    Handle front() {
+      return orders_.begin();
+    }
+
+    bool empty() const {
+      return orders_.empty();
+    }
+
+    // orders in time priority
+    const OrderList & orders() const {
+      return orders_;
+    }
+
+  private:
+    OrderList orders_;
+  };
+
+  struct NoListener {
+    template <typename Side, typename Price, typename Shares>
+    void operator()(Side, LevelAction, Price, Shares) const {}
+  };
+
+  template <typename Traits, typename OrderT = Order<Traits>, typename Listener = NoListener,
+            typename Alloc = std::allocator<OrderT>>
+  class Book {
+  public:
+    using OrderId = typename Traits::OrderId;
+    using Price = typename Traits::Price;
+    using Shares = typename Traits::Shares;
+    using Side = typename Traits::Side;
+    using Order = OrderT;
+    using PriceLevel = Level<Order, Alloc>;
+    using LevelInfo = std::pair<Price, Shares>;
+    using AskSide = std::map<Price, PriceLevel, std::less<Price>,
+          Rebind<Alloc, std::pair<const Price, PriceLevel>>>;
+    using BidSide = std::map<Price, PriceLevel, std::greater<Price>,
+          Rebind<Alloc, std::pair<const Price, PriceLevel>>>;
+
+    explicit Book(Listener listener = Listener(), const Alloc & alloc = Alloc())
+      :ask_levels_(alloc)
+      ,bid_levels_(alloc)
+      ,locations_(0, std::hash<OrderId>(), std::equal_to<OrderId>(), alloc)
+      ,listener_(listener)
+      ,alloc_(alloc) {}
+
+    // an order without shares or with an id already in the book is
+    // ignored
+    bool add(const Order & order) {
+      if (order.done()) return false;
+      auto p = locations_.emplace(order.order_id, Location());
+      if (!p.second) return false;
+      auto & location = p.first->second;
+      if (Traits::is_buy(order.side)) {
+        location.bid_level = add_to(bid_levels_, order, location.order);
+      } else {
+        location.ask_level = add_to(ask_levels_, order, location.order);
+      }
+      return true;
+    }
+
+    // sets what an order has left in place, it keeps its time priority.
+    // 0 removes it, the shares it already has change nothing
+    bool modify(const OrderId & order_id, Shares new_shares) {
+      if (new_shares == 0) return remove(order_id);
+      auto p = locations_.find(order_id);
+      if (p == locations_.end()) return false;
+      auto & location = p->second;
+      if (location.order->shares == new_shares) return true;
+      if (Traits::is_buy(location.order->side)) {
+        modify_in(location.bid_level, location.order, new_shares);
+      } else {
+        modify_in(location.ask_level, location.order, new_shares);
+      }
+      return true;
+    }
+
+    // takes shares off an order, executed or cancelled, and removes it
+    // once nothing is left
+    bool reduce(const OrderId & order_id, Shares shares) {
+      auto p = locations_.find(order_id);
+      if (p == locations_.end()) return false;
+      auto left = p->second.order->shares;
+      return modify(order_id, left > shares ? left - shares : 0);
+    }
+
+    bool remove(const OrderId & order_id) {
+      auto p = locations_.find(order_id);
+      if (p == locations_.end()) return false;
+      auto & location = p->second;
+      if (Traits::is_buy(location.order->side)) {
+        remove_from(bid_levels_, location.bid_level, location.order);
+      } else {
+        remove_from(ask_levels_, location.ask_level, location.order);
+      }
+      locations_.erase(p);
+      return true;
+    }
+
+    bool exists(const OrderId & order_id) const {
+      return locations_.count(order_id);
+    }
+
+    // nullptr if not in the book
+    const Order * find(const OrderId & order_id) const {
+      auto p = locations_.find(order_id);
+      return p == locations_.end() ? nullptr : &*p->second.order;
+    }
+
+    size_t size() const {
+      return locations_.size();
+    }
+
+    void reserve(size_t orders) {
+      locations_.reserve(orders);
+    }
+
+    void clear() {
+      ask_levels_.clear();
+      bid_levels_.clear();
+      locations_.clear();
+    }
+
+    // index starts with 0, an empty level is the lowest (bid) or the
+    // highest (ask) price with no shares
+    LevelInfo level_of_bid(size_t index) const {
+      if (index >= bid_levels_.size()) return LevelInfo(std::numeric_limits<Price>::min(), 0);
+      auto p = std::next(bid_levels_.begin(), index);
+      return LevelInfo(p->first, p->second.total_shares);
+    }
+
+    LevelInfo level_of_ask(size_t index) const {
+      if (index >= ask_levels_.size()) return LevelInfo(std::numeric_limits<Price>::max(), 0);
+      auto p = std::next(ask_levels_.begin(), index);
+      return LevelInfo(p->first, p->second.total_shares);
+    }
+
+    size_t depth_of_bid() const {
+      return bid_levels_.size();
+    }
+
+    size_t depth_of_ask() const {
+      return ask_levels_.size();
+    }
+
+    // best first
+    const BidSide & bids() const {
+      return bid_levels_;
+    }
+
+    const AskSide & asks() const {
+      return ask_levels_;
+    }
+
+  private:
+    // direct handles to an order and its level, the level iterator
+    // matching the order's side is the one set
+    struct Location {
+      typename AskSide::iterator ask_level;
+      typename BidSide::iterator bid_level;
+      typename PriceLevel::Handle order;
+    };
+
+    template <typename Levels>
+    typename Levels::iterator add_to(Levels & levels, const Order & order, typename PriceLevel::Handle & handle) {
+      auto level = levels.emplace(order.price, PriceLevel(alloc_)).first;
+      auto action = level->second.empty() ? LevelAction::Add : LevelAction::Change;
+      handle = level->second.add(order);
+      listener_(order.side, action, level->first, level->second.total_shares);
+      return level;
+    }
+
+    template <typename LevelIterator>
+    void modify_in(LevelIterator level, typename PriceLevel::Handle order, Shares new_shares) {
+      level->second.modify(order, new_shares);
+      listener_(order->side, LevelAction::Change, level->first, level->second.total_shares);
+    }
+
+    template <typename Levels>
+    void remove_from(Levels & levels, typename Levels::iterator level, typename PriceLevel::Handle order) {
+      auto side = order->side;
+      level->second.remove(order);
+      if (level->second.empty()) {
+        auto price = level->first;
+        levels.erase(level);
+        listener_(side, LevelAction::Delete, price, Shares(0));
+      } else {
+        listener_(side, LevelAction::Change, level->first, level->second.total_shares);
+      }
+    }
+
+    AskSide ask_levels_;
+    BidSide bid_levels_;
+    std::unordered_map<OrderId, Location, std::hash<OrderId>, std::equal_to<OrderId>,
+      Rebind<Alloc, std::pair<const OrderId, Location>>> locations_;
+    Listener listener_;
+    Alloc alloc_;
+  };
+}
+
+#endif
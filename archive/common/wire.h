@@ -0,0 +1,193 @@
+#ifndef ADE_COMMON_WIRE_H
+#define ADE_COMMON_WIRE_H
+
+/*
+ * typed views over fixed layout messages in raw byte buffers.
+ *
+ * a field is a type carrying its offset and length, and reads itself
+ * out of a message with memcpy (binary) or a fixed length loop (ascii)
+ * instead of casting the buffer to a struct, which is undefined as
+ * soon as the buffer isn't a live object of that struct (see
+ * packed.cpp). with offsets and lengths known at compile time a binary
+ * load is a single mov, plus a bswap for the other endianness.
+ *
+ * Layout lists the fields of one message so its shape can be checked
+ * against the wire spec with static_assert:
+ *
+ *   namespace add {
+ *     using OrderIdField = wire::Base36<9, 12, uint64_t>;
+ *     using SharesField = wire::Decimal<22, 6, uint32_t>;
+ *     ...
+ *     using Message = wire::Layout<45, TimestampField, TypeField, OrderIdField, ...>;
+ *     static_assert(Message::tiles(), "add order doesn't match the spec");
+ *   }
+ *
+ *   auto shares = add::SharesField::get(msg);
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <type_traits>
+
+namespace wire {
+
+  enum class Endian {
+    little,
+    big,
+    native = __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? little : big
+  };
+
+  template <typename T>
+  constexpr T byteswap(T v) {
+    static_assert(std::is_integral<T>::value, "integers only");
+    if constexpr (sizeof(T) == 1) {
+      return v;
+    } else if constexpr (sizeof(T) == 2) {
+      return T(__builtin_bswap16(uint16_t(v)));
+    } else if constexpr (sizeof(T) == 4) {
+      return T(__builtin_bswap32(uint32_t(v)));
+    } else {
+      static_assert(sizeof(T) == 8, "1, 2, 4 or 8 bytes");
+      return T(__builtin_bswap64(uint64_t(v)));
+    }
+  }
+
+  // binary integer
+  template <size_t Offset, typename T, Endian E = Endian::little>
+  struct Int {
+    using type = T;
+    static constexpr size_t OFFSET = Offset;
+    static constexpr size_t LENGTH = sizeof(T);
+
+    static T get(const char * msg) {
+      T v;
+      memcpy(&v, msg + Offset, sizeof(v));
+      return E == Endian::native ? v : byteswap(v);
+    }
+
+    static void put(char * msg, T v) {
+      v = E == Endian::native ? v : byteswap(v);
+      memcpy(msg + Offset, &v, sizeof(v));
+    }
+  };
+
+  // single ascii character, e.g. a message type or side
+  template <size_t Offset>
+  struct Char {
+    using type = char;
+    static constexpr size_t OFFSET = Offset;
+    static constexpr size_t LENGTH = 1;
+
+    static char get(const char * msg) {
+      return msg[Offset];
+    }
+  };
+
+  // zero padded ascii digits
+  template <size_t Offset, size_t Length, typename T = uint32_t>
+  struct Decimal {
+    using type = T;
+    static constexpr size_t OFFSET = Offset;
+    static constexpr size_t LENGTH = Length;
+
+    static T get(const char * msg) {
+      T res = 0;
+      for (size_t i = 0; i < Length; i++) {
+        res = res * 10 + (msg[Offset + i] - '0');
+      }
+      return res;
+    }
+  };
+
+  // zero padded base 36, digits then upper case letters
+  template <size_t Offset, size_t Length, typename T = uint64_t>
+  struct Base36 {
+    using type = T;
+    static constexpr size_t OFFSET = Offset;
+    static constexpr size_t LENGTH = Length;
+
+    static T get(const char * msg) {
+      T res = 0;
+      for (size_t i = 0; i < Length; i++) {
+        char c = msg[Offset + i];
+        res = res * 36 + (c >= 'A' ? (c - 'A' + 10) : (c - '0'));
+      }
+      return res;
+    }
+  };
+
+  // space padded ascii text, the padding is dropped
+  template <size_t Offset, size_t Length>
+  struct Text {
+    using type = std::string_view;
+    static constexpr size_t OFFSET = Offset;
+    static constexpr size_t LENGTH = Length;
+
+    static std::string_view get(const char * msg) {
+      size_t n = 0;
+      while (n < Length && msg[Offset + n] != ' ') n++;
+      return std::string_view(msg + Offset, n);
+    }
+  };
+
+  // bytes the layout doesn't interpret, to keep tiles() honest
+  template <size_t Offset, size_t Length>
+  struct Skip {
+    static constexpr size_t OFFSET = Offset;
+    static constexpr size_t LENGTH = Length;
+  };
+
+  template <size_t Size, typename... Fields>
+  struct Layout {
+    static constexpr size_t SIZE = Size;
+
+    // every field ends inside the message
+    static constexpr bool fits() {
+      return ((Fields::OFFSET + Fields::LENGTH <= Size) && ...);
+    }
+
+    // no byte belongs to two fields
+    static constexpr bool disjoint() {
+      return fits() && max_cover() <= 1;
+    }
+
+    // every byte belongs to exactly one field, i.e. the fields are the
+    // whole spec with no gap and no overlap
+    static constexpr bool tiles() {
+      return fits() && max_cover() == 1 && min_cover() == 1;
+    }
+
+  private:
+    struct Cover {
+      unsigned count[Size > 0 ? Size : 1] = {};
+    };
+
+    static constexpr Cover cover() {
+      Cover c;
+      size_t offsets[] = {Fields::OFFSET...};
+      size_t lengths[] = {Fields::LENGTH...};
+      for (size_t f = 0; f < sizeof...(Fields); f++) {
+        for (size_t i = offsets[f]; i < offsets[f] + lengths[f] && i < Size; i++) c.count[i]++;
+      }
+      return c;
+    }
+
+    static constexpr unsigned max_cover() {
+      auto c = cover();
+      unsigned res = 0;
+      for (size_t i = 0; i < Size; i++) res = c.count[i] > res ? c.count[i] : res;
+      return res;
+    }
+
+    static constexpr unsigned min_cover() {
+      auto c = cover();
+      unsigned res = Size ? c.count[0] : 0;
+      for (size_t i = 0; i < Size; i++) res = c.count[i] < res ? c.count[i] : res;
+      return res;
+    }
+  };
+}
+
+#endif
@@ -2,6 +2,13 @@
 #include <assert.h>
 #include <queue>
 #include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <random>
+#include <string>
+#include "../common/bench.h"
 
 using namespace std;
 
@@ -47,7 +54,9 @@ int bfs(int i, int j, const vector<vector<int>> & grid, vector<vector<int>> & vi
   const vector<pair<int,int>> deltas = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}};
   int m = grid.size(), n = grid[0].size();
   queue<pair<int, int>> q;
+  // marked when queued, so a cell is queued once
   q.emplace(i, j);
+  visited[i][j] = 1;
 
 
   int area = 0;
@@ -55,17 +64,13 @@ int bfs(int i, int j, const vector<vector<int>> & grid, vector<vector<int>> & vi
     auto p = q.front(); q.pop();
 
     auto i = p.first, j = p.second;
-
-    if (!visited[i][j]) {
-      visited[i][j] = 1;
-      area += 1;
-
-    }
+    area += 1;
 
 
     for (auto d : deltas) {
       auto x = d.first + i, y = d.second + j;
       if (x < 0 || x >= m || y < 0 || y >=n || !grid[x][y] || visited[x][y]) continue;
+      visited[x][y] = 1;
       q.emplace(x, y);
     }
   }
@@ -147,6 +152,243 @@ int max_areas_dfs(const vector<vector<int>> & grid) {
 }
 
 
+/*
+ * flat row major grids for large rasters. Grid keeps a byte per cell,
+ * BitGrid a bit per cell. row() hands the labeler one row of 0/1
+ * bytes, BitGrid unpacks into scratch for that
+ */
+struct Grid {
+  size_t rows = 0, cols = 0;
+  vector<uint8_t> cells;
+
+  Grid(size_t rows, size_t cols): rows(rows), cols(cols), cells(rows * cols, 0) {}
+
+  Grid(const vector<vector<int>> & grid)
+    :Grid(grid.size(), grid.empty() ? 0 : grid[0].size()) {
+    for (size_t i = 0; i < rows; i++) {
+      for (size_t j = 0; j < cols; j++) set(i, j, grid[i][j]);
+    }
+  }
+
+  void set(size_t i, size_t j, bool v) {
+    cells[i * cols + j] = v;
+  }
+
+  const uint8_t * row(size_t i, uint8_t *) const {
+    return cells.data() + i * cols;
+  }
+};
+
+struct BitGrid {
+  size_t rows = 0, cols = 0, words_per_row = 0;
+  vector<uint64_t> bits;
+
+  BitGrid(size_t rows, size_t cols)
+    :rows(rows), cols(cols), words_per_row((cols + 63) / 64), bits(rows * words_per_row, 0) {}
+
+  void set(size_t i, size_t j, bool v) {
+    auto & w = bits[i * words_per_row + j / 64];
+    uint64_t mask = uint64_t(1) << (j % 64);
+    w = v ? w | mask : w & ~mask;
+  }
+
+  // empty words are cleared in one go, which is most of a sparse raster
+  const uint8_t * row(size_t i, uint8_t * scratch) const {
+    const uint64_t * w = bits.data() + i * words_per_row;
+    for (size_t k = 0; k < words_per_row; k++) {
+      size_t begin = k * 64, end = min(cols, begin + 64);
+      if (!w[k]) {
+        memset(scratch + begin, 0, end - begin);
+        continue;
+      }
+      for (size_t j = begin; j < end; j++) scratch[j] = (w[k] >> (j - begin)) & 1;
+    }
+    return scratch;
+  }
+};
+
+struct Islands {
+  size_t count = 0;
+  size_t max_area = 0;
+};
+
+/*
+ * two pass union-find labeling, 4-connected. the first pass walks the
+ * rows keeping labels for just the previous and current row, gives
+ * every run a provisional label, counts cells per label and records
+ * equivalences in the union-find table. the second pass runs over that
+ * table instead of the grid, folding areas into the roots. memory is
+ * two rows plus the table, and there is no recursion
+ */
+class IslandLabeler {
+public:
+  using Label = uint32_t;
+
+  // labels rows [first, last) of grid
+  template <typename G>
+  void label(const G & grid, size_t first, size_t last) {
+    size_t cols = grid.cols;
+    vector<uint8_t> scratch(cols);
+    vector<Label> prev(cols, 0), cur(cols, 0);
+    parent_.assign(1, 0);
+    area_.assign(1, 0);
+    for (size_t i = first; i < last; i++) {
+      const uint8_t * row = grid.row(i, scratch.data());
+      for (size_t j = 0; j < cols; j++) {
+        if (!row[j]) {
+          cur[j] = 0;
+          continue;
+        }
+        Label up = prev[j], left = j ? cur[j - 1] : 0;
+        Label l = up ? up : left;
+        if (!l) {
+          l = parent_.size();
+          parent_.push_back(l);
+          area_.push_back(0);
+        } else if (up && left && up != left) {
+          unite(up, left);
+        }
+        cur[j] = l;
+        area_[l]++;
+      }
+      if (i == first) first_row_ = cur;
+      swap(prev, cur);
+    }
+    last_row_ = last > first ? prev : vector<Label>(cols, 0);
+    if (last == first) first_row_ = last_row_;
+  }
+
+  // second pass, over the table
+  Islands islands() {
+    Islands res;
+    for (Label l = parent_.size() - 1; l > 0; l--) {
+      Label root = find(l);
+      if (root != l) area_[root] += area_[l];
+    }
+    for (Label l = 1; l < parent_.size(); l++) {
+      if (parent_[l] == l) {
+        res.count++;
+        res.max_area = max<size_t>(res.max_area, area_[l]);
+      }
+    }
+    return res;
+  }
+
+  /*
+   * labels horizontal bands of rows on their own threads, then appends
+   * the band tables into one, shifting labels, joins labels that meet
+   * across each band border and runs the second pass on the result
+   */
+  template <typename G>
+  static Islands label_tiled(const G & grid, size_t threads) {
+    threads = max<size_t>(1, min(threads, grid.rows));
+    vector<IslandLabeler> bands(threads);
+    vector<thread> workers;
+    for (size_t t = 0; t < threads; t++) {
+      workers.emplace_back([&grid, &bands, t, threads]() {
+        bands[t].label(grid, grid.rows * t / threads, grid.rows * (t + 1) / threads);
+      });
+    }
+    for (auto & w : workers) w.join();
+
+    IslandLabeler merged;
+    merged.parent_.assign(1, 0);
+    merged.area_.assign(1, 0);
+    const vector<Label> * above = nullptr;
+    Label above_offset = 0;
+    for (auto & band : bands) {
+      Label offset = merged.parent_.size() - 1;
+      for (Label l = 1; l < band.parent_.size(); l++) {
+        merged.parent_.push_back(band.parent_[l] + offset);
+        merged.area_.push_back(band.area_[l]);
+      }
+      if (above) {
+        for (size_t j = 0; j < grid.cols; j++) {
+          Label up = (*above)[j], down = band.first_row_[j];
+          if (up && down) merged.unite(up + above_offset, down + offset);
+        }
+      }
+      above = &band.last_row_;
+      above_offset = offset;
+    }
+    return merged.islands();
+  }
+
+private:
+  // path halving
+  Label find(Label l) {
+    while (parent_[l] != l) {
+      parent_[l] = parent_[parent_[l]];
+      l = parent_[l];
+    }
+    return l;
+  }
+
+  // the smaller label becomes the root so roots stay ahead of their
+  // members, which the reverse walk in islands() relies on
+  void unite(Label a, Label b) {
+    a = find(a);
+    b = find(b);
+    if (a == b) return;
+    if (a < b) parent_[b] = a;
+    else parent_[a] = b;
+  }
+
+  vector<Label> parent_;
+  vector<Label> area_;
+  vector<Label> first_row_, last_row_;
+};
+
+template <typename G>
+Islands label_islands(const G & grid) {
+  IslandLabeler labeler;
+  labeler.label(grid, 0, grid.rows);
+  return labeler.islands();
+}
+
+
+// random n x n raster, density of 1s
+template <typename G>
+G random_grid(size_t n, double density) {
+  G grid(n, n);
+  mt19937_64 rng(42);
+  uint64_t threshold = density * double(rng.max());
+  for (size_t i = 0; i < n; i++) {
+    for (size_t j = 0; j < n; j++) grid.set(i, j, rng() < threshold);
+  }
+  return grid;
+}
+
+using bench::seconds;
+
+void run_benchmarks(size_t n, double density, size_t threads) {
+  Islands flat, packed, tiled;
+  auto grid = random_grid<Grid>(n, density);
+  auto bit_grid = random_grid<BitGrid>(n, density);
+  cout << "size," << n << "x" << n << endl
+       << "density," << density << endl
+       << "flat_s," << seconds([&]() { flat = label_islands(grid); }) << endl
+       << "bit_packed_s," << seconds([&]() { packed = label_islands(bit_grid); }) << endl
+       << "tiled_" << threads << "_threads_s," << seconds([&]() { tiled = IslandLabeler::label_tiled(grid, threads); }) << endl
+       << "islands," << flat.count << endl
+       << "max_area," << flat.max_area << endl
+       << "results_match," << (flat.count == packed.count && flat.count == tiled.count
+                               && flat.max_area == packed.max_area && flat.max_area == tiled.max_area) << endl;
+  // the nested vector bfs needs 8 bytes a cell, only compared on
+  // small grids
+  if (n <= 2000) {
+    vector<vector<int>> nested(n, vector<int>(n));
+    for (size_t i = 0; i < n; i++) {
+      for (size_t j = 0; j < n; j++) nested[i][j] = grid.cells[i * n + j];
+    }
+    int count = 0, area = 0;
+    cout << "nested_bfs_s," << seconds([&]() { count = num_of_islands_bfs(nested); area = max_areas(nested); }) << endl
+         << "nested_matches," << (size_t(count) == flat.count && size_t(area) == flat.max_area) << endl;
+  }
+}
+
+
+// ./a.out [bench [n [density [threads]]]]
 int main(int argc, char *argv[])
 {
   assert(0 == num_of_islands({}));
@@ -167,6 +409,28 @@ int main(int argc, char *argv[])
   assert(4 == max_areas({{1, 1, 0, 0, 0}, {1, 1, 0, 0, 0}, {0, 0, 0, 1, 1}, {0, 0, 0, 0, 1}}));
   assert(4 == max_areas_dfs({{1, 1, 0, 0, 0}, {1, 1, 0, 0, 0}, {0, 0, 0, 1, 1}, {0, 0, 0, 0, 1}}));
 
+  {
+    // u shape joins two runs in the last row, the band border cuts it
+    vector<vector<int>> u = {{1, 0, 1, 0, 1}, {1, 0, 1, 0, 0}, {1, 1, 1, 0, 1}, {0, 0, 0, 0, 1}};
+    auto islands = label_islands(Grid(u));
+    assert(3 == islands.count && 7 == islands.max_area);
+    for (size_t threads = 1; threads <= 4; threads++) {
+      auto tiled = IslandLabeler::label_tiled(Grid(u), threads);
+      assert(3 == tiled.count && 7 == tiled.max_area);
+    }
+    BitGrid bits(4, 5);
+    for (size_t i = 0; i < 4; i++) {
+      for (size_t j = 0; j < 5; j++) bits.set(i, j, u[i][j]);
+    }
+    auto packed = label_islands(bits);
+    assert(3 == packed.count && 7 == packed.max_area);
+    assert(0 == label_islands(Grid(0, 0)).count);
+  }
+
+  if (argc > 1 && string(argv[1]) == "bench") {
+    run_benchmarks(argc > 2 ? stoul(argv[2]) : 10000, argc > 3 ? stod(argv[3]) : 0.5, argc > 4 ? stoul(argv[4]) : 4);
+  }
+
 
   return 0;
 }
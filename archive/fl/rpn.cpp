@@ -9,6 +9,13 @@
 #include <unordered_map>
 #include <stack>
 #include <vector>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <random>
+#include <cstdint>
+#include <assert.h>
+#include "../common/bench.h"
 
 using Operands = std::stack<int>;
 
@@ -23,15 +30,16 @@ public:
   }
 
   int eval(const std::vector<std::string> & notations) {
+     Operands stack;
      for (auto & n : notations) {
        if (n.size() == 1 && is_supported(n[0])) {
-         operators_[n[0]](this->stack_);
+         operators_[n[0]](stack);
        } else {
-         stack_.push(stoi(n));
+         stack.push(stoi(n));
        }
      }
 
-     return stack_.top();
+     return stack.top();
   }
 
 
@@ -42,7 +50,6 @@ private:
   }
 
   std::unordered_map<char, RPNOperator> operators_;
-  std::stack<int> stack_;
 };
 
 
@@ -68,6 +75,205 @@ struct MultiplyOperator {
 };
 
 
+/*
+ * compiled form for formulas evaluated over and over with different
+ * inputs. compile() resolves every token once: numbers become
+ * constants, names become variable slots and + - * become opcodes, and
+ * checks the stack depth so eval can run on a fixed local stack with
+ * one switch per instruction and no allocation.
+ *
+ * only the built in operators compile, the std::function ones
+ * registered on RPNProcessor stay with RPNProcessor
+ */
+class RPNProgram
+{
+public:
+  static constexpr size_t MAX_STACK = 32;
+  // inputs evaluated together per instruction in the vectorized mode
+  static constexpr size_t LANES = 64;
+
+  enum class OpCode: uint8_t
+  {
+    Const,
+    Load,
+    Add,
+    Sub,
+    Mul
+  };
+
+  struct Instruction {
+    OpCode op;
+    // constant value or variable slot
+    int arg;
+  };
+
+  // variables lists the names in slot order, throws std::invalid_argument
+  // on unknown names, numbers that aren't ints and on formulas that
+  // don't leave exactly one value
+  static RPNProgram compile(const std::vector<std::string> & notations,
+                            const std::vector<std::string> & variables = {}) {
+    RPNProgram program;
+    program.slots_ = variables.size();
+    size_t depth = 0;
+    for (auto & n : notations) {
+      Instruction ins;
+      if (n.size() == 1 && (n[0] == '+' || n[0] == '-' || n[0] == '*')) {
+        if (depth < 2) throw std::invalid_argument("missing operand for " + n);
+        ins = {n[0] == '+' ? OpCode::Add : n[0] == '-' ? OpCode::Sub : OpCode::Mul, 0};
+        depth--;
+      } else {
+        auto slot = std::find(begin(variables), end(variables), n);
+        if (slot != end(variables)) {
+          ins = {OpCode::Load, int(slot - begin(variables))};
+        } else {
+          size_t pos = 0;
+          int value = 0;
+          try {
+            value = stoi(n, &pos);
+          } catch (const std::logic_error &) {
+            // not a number at all, or one out of int range
+            pos = 0;
+          }
+          if (pos == 0 || pos != n.size()) throw std::invalid_argument("bad token " + n);
+          ins = {OpCode::Const, value};
+        }
+        if (++depth > MAX_STACK) throw std::invalid_argument("stack deeper than MAX_STACK");
+      }
+      program.code_.push_back(ins);
+    }
+    if (depth != 1) throw std::invalid_argument("formula leaves " + std::to_string(depth) + " values");
+    return program;
+  }
+
+  // vars[slot] for every variable slot
+  int eval(const int * vars) const {
+    int stack[MAX_STACK];
+    int * top = stack;
+    for (auto & ins : code_) {
+      switch (ins.op) {
+        case OpCode::Const: *top++ = ins.arg; break;
+        case OpCode::Load: *top++ = vars[ins.arg]; break;
+        case OpCode::Add: top--; top[-1] += *top; break;
+        case OpCode::Sub: top--; top[-1] -= *top; break;
+        case OpCode::Mul: top--; top[-1] *= *top; break;
+      }
+    }
+    return stack[0];
+  }
+
+  int eval(const std::vector<int> & vars) const {
+    assert(vars.size() >= slots_);
+    return eval(vars.data());
+  }
+
+  // vectorized: columns[slot][i] is variable slot of input i, out[i]
+  // gets the result. each instruction runs over LANES inputs at a
+  // time, so dispatch is paid once per block and the inner loops are
+  // plain array arithmetic the compiler vectorizes
+  void eval(const int * const * columns, size_t n, int * out) const {
+    int stack[MAX_STACK][LANES];
+    for (size_t base = 0; base < n; base += LANES) {
+      size_t lanes = std::min(LANES, n - base);
+      size_t top = 0;
+      for (auto & ins : code_) {
+        switch (ins.op) {
+          case OpCode::Const:
+            std::fill(stack[top], stack[top] + lanes, ins.arg);
+            top++;
+            break;
+          case OpCode::Load:
+            std::copy(columns[ins.arg] + base, columns[ins.arg] + base + lanes, stack[top]);
+            top++;
+            break;
+          case OpCode::Add:
+            top--;
+            for (size_t i = 0; i < lanes; i++) stack[top - 1][i] += stack[top][i];
+            break;
+          case OpCode::Sub:
+            top--;
+            for (size_t i = 0; i < lanes; i++) stack[top - 1][i] -= stack[top][i];
+            break;
+          case OpCode::Mul:
+            top--;
+            for (size_t i = 0; i < lanes; i++) stack[top - 1][i] *= stack[top][i];
+            break;
+        }
+      }
+      std::copy(stack[0], stack[0] + lanes, out + base);
+    }
+  }
+
+  size_t slots() const {
+    return slots_;
+  }
+
+  const std::vector<Instruction> & code() const {
+    return code_;
+  }
+
+private:
+  std::vector<Instruction> code_;
+  size_t slots_ = 0;
+};
+
+
+/*
+ * one formula over n random inputs: interpreted (operands substituted
+ * as strings, the only way RPNProcessor takes inputs), compiled one
+ * input at a time, and compiled over columns
+ */
+void run_benchmarks(size_t n)
+{
+  std::vector<std::string> formula = {"a", "b", "+", "c", "*", "d", "-", "2", "*"};
+  std::vector<std::string> variables = {"a", "b", "c", "d"};
+
+  std::mt19937 rng(42);
+  std::vector<std::vector<int>> columns(variables.size(), std::vector<int>(n));
+  for (auto & column : columns) {
+    for (auto & v : column) v = rng() % 1000;
+  }
+
+  RPNProcessor processor;
+  processor.register_operator('+', AddOperator());
+  processor.register_operator('*', MultiplyOperator());
+  processor.register_operator('-', [](Operands & s) {
+    auto y = s.top(); s.pop();
+    s.top() -= y;
+  });
+  auto program = RPNProgram::compile(formula, variables);
+
+  std::vector<int> interpreted(n), compiled(n), vectorized(n);
+  double interpreted_ns = bench::time_it([&]() {
+    std::vector<std::string> notations = formula;
+    for (size_t i = 0; i < n; i++) {
+      for (size_t k = 0; k < formula.size(); k++) {
+        auto slot = std::find(begin(variables), end(variables), formula[k]);
+        if (slot != end(variables)) notations[k] = std::to_string(columns[slot - begin(variables)][i]);
+      }
+      interpreted[i] = processor.eval(notations);
+    }
+  }) / n;
+  double compiled_ns = bench::time_it([&]() {
+    int vars[4];
+    for (size_t i = 0; i < n; i++) {
+      for (size_t k = 0; k < 4; k++) vars[k] = columns[k][i];
+      compiled[i] = program.eval(vars);
+    }
+  }) / n;
+  double vectorized_ns = bench::time_it([&]() {
+    const int * cols[] = {columns[0].data(), columns[1].data(), columns[2].data(), columns[3].data()};
+    program.eval(cols, n, vectorized.data());
+  }) / n;
+
+  std::cout << "inputs," << n << std::endl
+            << "interpreted_ns," << interpreted_ns << std::endl
+            << "compiled_ns," << compiled_ns << std::endl
+            << "vectorized_ns," << vectorized_ns << std::endl
+            << "results_match," << (interpreted == compiled && compiled == vectorized) << std::endl;
+}
+
+
+// ./a.out [bench [inputs]]
 int main(int argc, char *argv[])
 {
 
@@ -79,5 +285,33 @@ int main(int argc, char *argv[])
 
   std::cout << res << std::endl;
 
+  auto program = RPNProgram::compile({"x", "1", "+", "y", "*"}, {"x", "y"});
+  assert(res == program.eval({2, 3}));
+  int xs[] = {2, 0, -1};
+  int ys[] = {3, 5, 7};
+  const int * columns[] = {xs, ys};
+  int out[3];
+  program.eval(columns, 3, out);
+  assert(9 == out[0] && 5 == out[1] && 0 == out[2]);
+
+  auto rejects = [](const std::vector<std::string> & notations) {
+    try {
+      RPNProgram::compile(notations, {"x"});
+    } catch (const std::invalid_argument &) {
+      return true;
+    }
+    return false;
+  };
+  assert(rejects({"x", "z", "+"}));
+  assert(rejects({"x", "99999999999", "+"}));
+  assert(rejects({"x", "1x", "+"}));
+  assert(rejects({"x", "+"}));
+  assert(!rejects({"x", "-1", "+"}));
+  (void) rejects;
+
+  if (argc > 1 && std::string(argv[1]) == "bench") {
+    run_benchmarks(argc > 2 ? std::stoul(argv[2]) : 1000000);
+  }
+
   return 0;
 }
@@ -1,8 +1,112 @@
 #include <iostream>
 #include <bitset>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <string>
+#include <assert.h>
+#include "../common/bitmap.h"
+#include "../common/bench.h"
 
 using namespace std;
 
+/*
+ * order state as one bitmap per flag, indexed by order slot, instead of
+ * a bool per flag inside every order. a question about one flag then
+ * touches 1 bit per order instead of a whole order struct, and questions
+ * across flags are word wide ands
+ */
+struct OrderFlags {
+  bits::Bitmap live;
+  bits::Bitmap partial;
+  bits::Bitmap ioc;
+  bits::Bitmap hidden;
+
+  explicit OrderFlags(size_t slots)
+    :live(slots), partial(slots), ioc(slots), hidden(slots) {}
+
+  void add(size_t slot, bool is_ioc, bool is_hidden) {
+    live.set(slot);
+    partial.reset(slot);
+    ioc.assign(slot, is_ioc);
+    hidden.assign(slot, is_hidden);
+  }
+
+  void fill(size_t slot, bool done) {
+    if (done) {
+      live.reset(slot);
+      partial.reset(slot);
+    } else {
+      partial.set(slot);
+    }
+  }
+
+  // end of the matching pass, whatever IOC is left is cancelled
+  void expire_ioc() {
+    live.and_not(ioc);
+    partial.and_not(ioc);
+    ioc.clear();
+  }
+
+  size_t displayed() const {
+    return live.count_and_not(hidden);
+  }
+
+  size_t next_live(size_t slot) const {
+    return live.find_next(slot);
+  }
+};
+
+
+/*
+ * the same flags kept as vector<bool>, which packs bits too but only
+ * exposes them one at a time
+ */
+void run_benchmarks(size_t orders) {
+  mt19937_64 rng(7);
+  bits::Bitmap live(orders), hidden(orders);
+  vector<bool> live_v(orders), hidden_v(orders);
+  for (size_t i = 0; i < orders; i++) {
+    // sparse live set, the common state of a book after a busy day
+    bool l = rng() % 16 == 0;
+    bool h = rng() % 4 == 0;
+    live.assign(i, l);
+    hidden.assign(i, h);
+    live_v[i] = l;
+    hidden_v[i] = h;
+  }
+
+  size_t a = 0, b = 0;
+  // ns per order slot
+  cout << "op,bitmap_ns,vector_bool_ns" << endl;
+
+  double t1 = bench::time_it([&]() { a = live.count(); });
+  double t2 = bench::time_it([&]() { b = 0; for (size_t i = 0; i < orders; i++) b += live_v[i]; });
+  assert(a == b);
+  cout << "count," << t1 / orders << "," << t2 / orders << endl;
+
+  t1 = bench::time_it([&]() {
+    a = 0;
+    for (size_t i = live.find_first(); i != bits::Bitmap::npos; i = live.find_next(i + 1)) a += i;
+  });
+  t2 = bench::time_it([&]() {
+    b = 0;
+    for (size_t i = 0; i < orders; i++) if (live_v[i]) b += i;
+  });
+  assert(a == b);
+  cout << "iterate_live," << t1 / orders << "," << t2 / orders << endl;
+
+  t1 = bench::time_it([&]() { a = live.count_and_not(hidden); });
+  t2 = bench::time_it([&]() { b = 0; for (size_t i = 0; i < orders; i++) b += live_v[i] && !hidden_v[i]; });
+  assert(a == b);
+  cout << "count_live_displayed," << t1 / orders << "," << t2 / orders << endl;
+
+  t1 = bench::time_it([&]() { live.and_not(hidden); });
+  t2 = bench::time_it([&]() { for (size_t i = 0; i < orders; i++) if (hidden_v[i]) live_v[i] = false; });
+  assert(live.count() == size_t(count(live_v.begin(), live_v.end(), true)));
+  cout << "and_not," << t1 / orders << "," << t2 / orders << endl;
+}
+
 int main(int argc, char *argv[])
 {
   int a = 0b0110110;
@@ -56,10 +160,48 @@ int main(int argc, char *argv[])
   cout << bitset<8>(b) << endl;
 
 
-
-
-
-
+  cout << "same operations on a bitmap of any length" << endl;
+
+  bits::Bitmap m(130);
+  m.set(3);
+  m.set(64);
+  m.set(129);
+  m.reset(3);
+  m.flip(70);
+  assert(m.test(64) && m.test(70) && !m.test(3));
+  assert(3 == m.count());
+  assert(64 == m.find_first());
+  assert(129 == m.find_next(71));
+  assert(bits::Bitmap::npos == m.find_next(130));
+
+  bits::Bitmap n(130, true);
+  assert(130 == n.count());
+  n.and_not(m);
+  assert(127 == n.count());
+  assert(0 == m.count_and(n));
+  n |= m;
+  assert(bits::Bitmap(130, true) == n);
+  n.resize(200, true);
+  assert(200 == n.count());
+
+  OrderFlags flags(1000);
+  flags.add(10, false, false);
+  flags.add(20, true, false);
+  flags.add(30, false, true);
+  flags.add(999, true, true);
+  assert(2 == flags.displayed());
+  flags.fill(10, false);
+  assert(flags.partial.test(10));
+  flags.fill(30, true);
+  assert(999 == flags.next_live(21));
+  flags.expire_ioc();
+  assert(1 == flags.live.count());
+  assert(10 == flags.next_live(0));
+  assert(bits::Bitmap::npos == flags.next_live(11));
+
+  if (argc > 1 && string(argv[1]) == "bench") {
+    run_benchmarks(argc > 2 ? stoul(argv[2]) : 10000000);
+  }
 
   return 0;
 }
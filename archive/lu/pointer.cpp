@@ -1,8 +1,20 @@
 #include <iostream>
 #include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <string>
+#include <utility>
+#include <type_traits>
+#include <assert.h>
+#include "../common/bench.h"
 
 using namespace std;
 
+/*
+ * reference version, a mutex around every count change
+ */
 template<typename T>
 struct ControlBlock {
   int ref_count = 0;
@@ -21,27 +33,28 @@ private:
 };
 
 template <typename T>
-class Simple_SP {
+class Mutex_SP {
 public:
 
-  Simple_SP()
+  Mutex_SP()
   {
     control_block_ = new ControlBlock<T>();
     control_block_->incre();
   }
 
-  Simple_SP(T *t) {
+  Mutex_SP(T *t) {
     control_block_ = new ControlBlock<T>();
     p_ = t;
     control_block_->incre();
   }
 
-  Simple_SP(const Simple_SP<T> & rhs)
-    :control_block_(rhs.control_block_){
+  Mutex_SP(const Mutex_SP<T> & rhs)
+    :p_(rhs.p_)
+    ,control_block_(rhs.control_block_){
     control_block_->incre();
   }
 
-  Simple_SP<T> &operator=(const Simple_SP<T> & rhs) {
+  Mutex_SP<T> &operator=(const Mutex_SP<T> & rhs) {
     if (this != &rhs) {
       this->release_();
       control_block_ = rhs.control_block_;
@@ -61,7 +74,7 @@ public:
   }
 
 
-  ~Simple_SP() {
+  ~Mutex_SP() {
     this->release_();
   }
 
@@ -80,6 +93,291 @@ private:
 };
 
 
+/*
+ * lock free counts. strong refs collectively hold one weak ref, so the
+ * block outlives the object until the last weak ref is gone.
+ *
+ * increments are relaxed: a new ref is always made from an existing one,
+ * which already keeps the count above zero. decrements are release so
+ * every write through a ref happens before the count drops, and whoever
+ * takes it to zero does an acquire fence before destroying, so it sees
+ * all of them
+ */
+struct AtomicControlBlock {
+  atomic<long> strong{1};
+  atomic<long> weak{1};
+
+  virtual ~AtomicControlBlock() = default;
+
+  void incre() {
+    strong.fetch_add(1, memory_order_relaxed);
+  }
+
+  void decre() {
+    if (strong.fetch_sub(1, memory_order_release) == 1) {
+      atomic_thread_fence(memory_order_acquire);
+      destroy();
+      weak_decre();
+    }
+  }
+
+  // weak to strong, fails once the object is gone
+  bool try_incre() {
+    long n = strong.load(memory_order_relaxed);
+    while (n != 0) {
+      if (strong.compare_exchange_weak(n, n + 1, memory_order_acq_rel, memory_order_relaxed)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void weak_incre() {
+    weak.fetch_add(1, memory_order_relaxed);
+  }
+
+  void weak_decre() {
+    if (weak.fetch_sub(1, memory_order_release) == 1) {
+      atomic_thread_fence(memory_order_acquire);
+      delete this;
+    }
+  }
+
+  // destroys the object, not the block
+  virtual void destroy() = 0;
+};
+
+// object allocated separately, Simple_SP<T>(new T)
+template <typename T>
+struct PointerControlBlock: AtomicControlBlock {
+  T *p;
+
+  explicit PointerControlBlock(T *p): p(p) {}
+
+  void destroy() override {
+    delete p;
+  }
+};
+
+// object and counts in one allocation, make_simple<T>(...)
+template <typename T>
+struct InplaceControlBlock: AtomicControlBlock {
+  typename aligned_storage<sizeof(T), alignof(T)>::type storage;
+
+  template <typename... Args>
+  explicit InplaceControlBlock(Args &&... args) {
+    new (&storage) T(forward<Args>(args)...);
+  }
+
+  T * get() {
+    return reinterpret_cast<T *>(&storage);
+  }
+
+  void destroy() override {
+    get()->~T();
+  }
+};
+
+template <typename T> class Simple_WP;
+
+template <typename T>
+class Simple_SP {
+public:
+
+  Simple_SP() = default;
+
+  explicit Simple_SP(T *t)
+    :p_(t)
+    ,control_block_(t ? new PointerControlBlock<T>(t) : nullptr) {}
+
+  Simple_SP(const Simple_SP<T> & rhs)
+    :p_(rhs.p_)
+    ,control_block_(rhs.control_block_) {
+    if (control_block_) control_block_->incre();
+  }
+
+  Simple_SP(Simple_SP<T> && rhs) noexcept
+    :p_(rhs.p_)
+    ,control_block_(rhs.control_block_) {
+    rhs.p_ = nullptr;
+    rhs.control_block_ = nullptr;
+  }
+
+  // copy and swap, covers self assignment
+  Simple_SP<T> &operator=(Simple_SP<T> rhs) noexcept {
+    swap(p_, rhs.p_);
+    swap(control_block_, rhs.control_block_);
+    return *this;
+  }
+
+  ~Simple_SP() {
+    if (control_block_) control_block_->decre();
+  }
+
+  T & operator*() const {
+    return *p_;
+  }
+
+  T * operator->() const {
+    return p_;
+  }
+
+  T * get() const {
+    return p_;
+  }
+
+  explicit operator bool() const {
+    return p_ != nullptr;
+  }
+
+  long use_count() const {
+    return control_block_ ? control_block_->strong.load(memory_order_relaxed) : 0;
+  }
+
+  void reset() {
+    *this = Simple_SP<T>();
+  }
+
+private:
+  template <typename U, typename... Args>
+  friend Simple_SP<U> make_simple(Args &&... args);
+  friend class Simple_WP<T>;
+
+  // takes over a count already held
+  Simple_SP(T *p, AtomicControlBlock *control_block)
+    :p_(p)
+    ,control_block_(control_block) {}
+
+  T *p_ = nullptr;
+  AtomicControlBlock *control_block_ = nullptr;
+};
+
+template <typename T, typename... Args>
+Simple_SP<T> make_simple(Args &&... args) {
+  auto control_block = new InplaceControlBlock<T>(forward<Args>(args)...);
+  return Simple_SP<T>(control_block->get(), control_block);
+}
+
+template <typename T>
+class Simple_WP {
+public:
+
+  Simple_WP() = default;
+
+  Simple_WP(const Simple_SP<T> & sp)
+    :p_(sp.p_)
+    ,control_block_(sp.control_block_) {
+    if (control_block_) control_block_->weak_incre();
+  }
+
+  Simple_WP(const Simple_WP<T> & rhs)
+    :p_(rhs.p_)
+    ,control_block_(rhs.control_block_) {
+    if (control_block_) control_block_->weak_incre();
+  }
+
+  Simple_WP<T> &operator=(Simple_WP<T> rhs) noexcept {
+    swap(p_, rhs.p_);
+    swap(control_block_, rhs.control_block_);
+    return *this;
+  }
+
+  ~Simple_WP() {
+    if (control_block_) control_block_->weak_decre();
+  }
+
+  bool expired() const {
+    return !control_block_ || control_block_->strong.load(memory_order_acquire) == 0;
+  }
+
+  // empty once the object is gone
+  Simple_SP<T> lock() const {
+    if (control_block_ && control_block_->try_incre()) {
+      return Simple_SP<T>(p_, control_block_);
+    }
+    return Simple_SP<T>();
+  }
+
+private:
+  T *p_ = nullptr;
+  AtomicControlBlock *control_block_ = nullptr;
+};
+
+
+/*
+ * intrusive variant, the count lives in the object itself so there is
+ * no control block at all and a raw pointer can be turned back into a
+ * ref. no weak refs
+ */
+template <typename Derived>
+class RefCounted {
+public:
+  void add_ref() const {
+    ref_count_.fetch_add(1, memory_order_relaxed);
+  }
+
+  void release() const {
+    if (ref_count_.fetch_sub(1, memory_order_release) == 1) {
+      atomic_thread_fence(memory_order_acquire);
+      delete static_cast<const Derived *>(this);
+    }
+  }
+
+  long ref_count() const {
+    return ref_count_.load(memory_order_relaxed);
+  }
+
+private:
+  mutable atomic<long> ref_count_{0};
+};
+
+template <typename T>
+class Intrusive_SP {
+public:
+
+  Intrusive_SP() = default;
+
+  explicit Intrusive_SP(T *t)
+    :p_(t) {
+    if (p_) p_->add_ref();
+  }
+
+  Intrusive_SP(const Intrusive_SP<T> & rhs)
+    :p_(rhs.p_) {
+    if (p_) p_->add_ref();
+  }
+
+  Intrusive_SP(Intrusive_SP<T> && rhs) noexcept
+    :p_(rhs.p_) {
+    rhs.p_ = nullptr;
+  }
+
+  Intrusive_SP<T> &operator=(Intrusive_SP<T> rhs) noexcept {
+    swap(p_, rhs.p_);
+    return *this;
+  }
+
+  ~Intrusive_SP() {
+    if (p_) p_->release();
+  }
+
+  T & operator*() const {
+    return *p_;
+  }
+
+  T * operator->() const {
+    return p_;
+  }
+
+  T * get() const {
+    return p_;
+  }
+
+private:
+  T *p_ = nullptr;
+};
+
+
 
 struct Test{
   Test() {
@@ -95,13 +393,91 @@ struct Test{
   }
 
 };
+
+struct Handle: RefCounted<Handle> {
+  long value = 0;
+};
+
+
+/*
+ * threads copy one shared pointer and destroy the copy in a loop, so
+ * they all hit the same count, the worst case for a handle shared
+ * between threads
+ */
+template <typename Ptr>
+double bench_copy(const Ptr & shared, int threads, long copies) {
+  atomic<bool> go{false};
+  vector<thread> workers;
+  for (int i = 0; i < threads; i++) {
+    workers.emplace_back([&]() {
+      while (!go.load(memory_order_acquire));
+      for (long n = 0; n < copies; n++) {
+        Ptr copy = shared;
+        asm volatile("" : : "r"(&copy) : "memory");
+      }
+    });
+  }
+  return bench::time_it([&]() {
+    go.store(true, memory_order_release);
+    for (auto & w : workers) w.join();
+  }) / copies;
+}
+
+void run_benchmarks(long copies) {
+  Mutex_SP<long> mutex_sp(new long(1));
+  Simple_SP<long> simple_sp = make_simple<long>(1);
+  shared_ptr<long> std_sp = make_shared<long>(1);
+  Intrusive_SP<Handle> intrusive_sp(new Handle());
+
+  // ns per copy + destroy, per thread
+  cout << "threads,mutex_ns,simple_sp_ns,shared_ptr_ns,intrusive_ns" << endl;
+  for (int threads : {1, 2, 4, 8}) {
+    cout << threads
+         << "," << bench_copy(mutex_sp, threads, copies)
+         << "," << bench_copy(simple_sp, threads, copies)
+         << "," << bench_copy(std_sp, threads, copies)
+         << "," << bench_copy(intrusive_sp, threads, copies) << endl;
+  }
+}
+
+
+// g++ -O3 -std=c++17 -pthread pointer.cpp
+// ./a.out [bench [copies]]
 int main(int argc, char *argv[])
 {
-  Simple_SP<Test> sp (new Test());
-  sp->execute();
-  Simple_SP<Test> sp1 = sp;
+  {
+    Simple_SP<Test> sp (new Test());
+    sp->execute();
+    Simple_SP<Test> sp1 = sp;
+    assert(2 == sp.use_count());
+  }
+
+  {
+    Simple_WP<Test> wp;
+    {
+      auto sp = make_simple<Test>();
+      wp = sp;
+      assert(!wp.expired());
+      auto locked = wp.lock();
+      assert(locked.get() == sp.get());
+      assert(2 == sp.use_count());
+    }
+    assert(wp.expired());
+    assert(!wp.lock());
+  }
 
+  {
+    Intrusive_SP<Handle> h(new Handle());
+    Intrusive_SP<Handle> h1 = h;
+    assert(2 == h->ref_count());
+    // a raw pointer can be adopted again
+    Intrusive_SP<Handle> h2(h1.get());
+    assert(3 == h->ref_count());
+  }
+
+  if (argc > 1 && string(argv[1]) == "bench") {
+    run_benchmarks(argc > 2 ? stol(argv[2]) : 1000000);
+  }
 
   return 0;
 }
-
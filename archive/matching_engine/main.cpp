@@ -2,6 +2,10 @@
 #include <gtest/gtest.h>
 #endif
 
+#ifdef __BENCHMARK__
+#include "../common/bench.h"
+#endif
+
 
 #include <set>
 #include <functional>
@@ -19,6 +23,14 @@
 #include <iterator>
 #include <chrono>
 #include <list>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <random>
+
+#include "../common/book.h"
 
 
 
@@ -38,9 +50,23 @@ enum class Side: char
 enum class OrderType: char
 {
   GFD = 'G',
-  IOC = 'I'
+  IOC = 'I',
+  // no price limit, whatever doesn't fill is dropped
+  MKT = 'M',
+  // fills completely right away or not at all
+  FOK = 'F',
+  // stop market, price is the stop price which the last trade
+  // has to reach (buy: at or above, sell: at or below)
+  STOP = 'S'
 };
 
+// GFD is the only type left resting in the book
+constexpr bool
+rests(OrderType t)
+{
+  return t == OrderType::GFD;
+}
+
 constexpr bool
 is_buy(Side s)
 {
@@ -95,53 +121,63 @@ TEST (SimpleOrder, basic)
 
 using OnTradeHandler = std::function<void(const SimpleOrder &, const SimpleOrder &, Shares)>;
 
-struct PriceLevel {
-  int total_shares = 0;
+// the price the incoming side of a trade is reported at, a market
+// order has none of its own and takes the resting order's
+inline Price reported_price(const SimpleOrder & resting, const SimpleOrder & incoming) {
+  return incoming.order_type == OrderType::MKT ? resting.price : incoming.price;
+}
 
-  using OrderList = std::list<SimpleOrder>;
-  using OrderMap = std::unordered_map<OrderId, OrderList::iterator>;
+// the shared level queue (common/book.h) plus an order id index,
+// since DepthBook finds orders by (side, price) and then id
+struct PriceLevel: book::Level<SimpleOrder> {
+  using OrderMap = std::unordered_map<OrderId, Handle>;
   using DoneOrders = std::vector<OrderId>;
 
   void add_order(SimpleOrder order) {
-    orders_.push_back(order);
-    orders_map_[order.order_id] = std::prev(end(orders_));
-    this->total_shares += order.shares;
+    orders_map_[order.order_id] = this->add(order);
   }
 
   void cancel_order(OrderId order_id) {
-    if (this->orders_map_.count(order_id)) {
-      auto p = this->orders_map_[order_id];
-      this->total_shares -= p->shares;
-      this->orders_.erase(p);
-      this->orders_map_.erase(order_id);
+    auto p = this->orders_map_.find(order_id);
+    if (p != end(this->orders_map_)) {
+      this->remove(p->second);
+      this->orders_map_.erase(p);
     }
   }
 
-  bool empty() const {
-    return this->orders_.empty();
+  // shrinks a resting order in place so it keeps its time priority,
+  // false unless new_shares is below what the order has left. 0 is
+  // false too, that is a cancel and the order has to leave the level
+  bool reduce_order(const OrderId & order_id, Shares new_shares) {
+    auto p = this->orders_map_.find(order_id);
+    if (p == end(this->orders_map_) || new_shares == 0 || new_shares >= p->second->shares) return false;
+    this->modify(p->second, new_shares);
+    return true;
+  }
+
+  void reserve(size_t orders) {
+    this->orders_map_.reserve(orders);
   }
 
   DoneOrders match(SimpleOrder &order, OnTradeHandler & on_trade) {
     DoneOrders done_orders;
-    while (!orders_.empty() && !order.done()) {
-      auto to_match = orders_.front();
-      assert (order.side != to_match.side);
-      auto quantity = std::min(order.shares, to_match.shares);
+    while (!this->empty() && !order.done()) {
+      auto to_match = this->front();
+      assert (order.side != to_match->side);
+      auto quantity = std::min(order.shares, to_match->shares);
       order.execute(quantity);
-      to_match.execute(quantity);
-      on_trade(to_match, order, quantity);
-      this->total_shares -= quantity;
-      if (to_match.done()) {
-        done_orders.push_back(to_match.order_id);
-        this->orders_map_.erase(to_match.order_id);
-        orders_.pop_front();
+      this->reduce(to_match, quantity);
+      on_trade(*to_match, order, quantity);
+      if (to_match->done()) {
+        done_orders.push_back(to_match->order_id);
+        this->orders_map_.erase(to_match->order_id);
+        this->remove(to_match);
       }
     }
     return done_orders;
   }
 
 private:
-  OrderList orders_;
   OrderMap orders_map_;
 };
 
@@ -154,34 +190,125 @@ TEST (PriceLevel, basic)
 }
 #endif
 
+/*
+ * little endian binary encoding shared by the journal and the snapshots
+ */
+namespace binary {
+  template <typename T>
+  void put(std::string & buf, T value) {
+    buf.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+
+  inline void put(std::string & buf, const std::string & s) {
+    put<uint16_t>(buf, s.size());
+    buf.append(s);
+  }
+
+  struct Reader {
+    const char * p;
+    const char * end;
+
+    template <typename T>
+    bool get(T & value) {
+      if (size_t(end - p) < sizeof(value)) return false;
+      memcpy(&value, p, sizeof(value));
+      p += sizeof(value);
+      return true;
+    }
+
+    bool get(std::string & s) {
+      uint16_t size;
+      if (!get(size) || size_t(end - p) < size) return false;
+      s.assign(p, size);
+      p += size;
+      return true;
+    }
+
+    bool done() const {
+      return p == end;
+    }
+  };
+
+  inline bool read_file(const std::string & path, std::string & buf) {
+    std::ifstream ifs(path, std::ios::binary);
+    if (!ifs) return false;
+    buf.assign(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    return true;
+  }
+}
+
 class DepthBook {
 public:
   using LevelInfo = std::pair<Price, Shares>;
   using DoneOrders = std::vector<OrderId>;
 
+  // best bid and offer, an empty side as in level_of_bid/level_of_ask
+  struct BBO {
+    LevelInfo bid = {std::numeric_limits<Price>::min(), 0};
+    LevelInfo ask = {std::numeric_limits<Price>::max(), 0};
+
+    bool operator== (const BBO & rhs) const {
+      return bid == rhs.bid && ask == rhs.ask;
+    }
+
+    bool operator!= (const BBO & rhs) const {
+      return !(*this == rhs);
+    }
+  };
+
+  using OnBboHandler = std::function<void(const BBO &)>;
+
   DepthBook(OnTradeHandler handler)
     :on_trade_handler_(handler) {}
 
 
+  // called after a command that moved the best bid or offer, with
+  // where it ended up. a command that moves it and puts it back, or
+  // only touches deeper levels, doesn't call it
+  void on_bbo(OnBboHandler handler) {
+    this->on_bbo_handler_ = handler;
+  }
+
+  // holds the BBO callback back until the matching end_conflation(),
+  // which calls it at most once, if the BBO differs from the last one
+  // published. pairs nest
+  void begin_conflation() {
+    this->conflating_++;
+  }
+
+  void end_conflation() {
+    assert(this->conflating_ > 0);
+    if (--this->conflating_ == 0) this->publish_bbo();
+  }
+
+  // kept up to date by every change, so reading it is free
+  const BBO & bbo() const {
+    return this->bbo_;
+  }
+
   void add_order(OrderId order_id, Side side, OrderType order_type, Price price, Shares shares) {
     if (order_id.empty()) return;
+    Conflation conflation(*this);
     SimpleOrder order = {order_id, order_type, side, price, shares};
-    auto done_orders = this->match(order);
-    this->cleanup_done_orders(done_orders);
-    if (!order.done() && order.order_type != OrderType::IOC) {
-      if (is_buy(side))
-        bid_levels_[price].add_order(order);
-      else
-        ask_levels_[price].add_order(order);
-      this->order_to_price_level_map_[order_id] = std::make_pair(order.side, order.price);
+    if (order_type == OrderType::STOP) {
+      this->add_stop(order);
+    } else {
+      this->execute(order);
     }
+    this->trigger_stops();
   }
 
+  // a pure size reduction at the same side and price is amended in
+  // place and keeps its queue position, anything else is cancel/replace
   void modify_order(OrderId order_id, Side side, Price price, Shares shares) {
-    if (this->exists(order_id)) {
-      this->cancel_order(order_id);
-      this->add_order(order_id, side, OrderType::GFD, price, shares);
+    auto p = this->order_to_price_level_map_.find(order_id);
+    if (p == end(this->order_to_price_level_map_)) return;
+    Conflation conflation(*this);
+    if (p->second.first == side && p->second.second == price && this->reduce_order(order_id, side, price, shares)) {
+      return;
     }
+    this->cancel_order(order_id);
+    this->add_order(order_id, side, OrderType::GFD, price, shares);
   }
 
   bool exists(OrderId order_id) {
@@ -190,6 +317,7 @@ public:
 
   void cancel_order(OrderId order_id) {
     if (this->exists(order_id)) {
+      Conflation conflation(*this);
       auto v = this->order_to_price_level_map_[order_id];
       auto side = v.first;
       auto price = v.second;
@@ -199,6 +327,7 @@ public:
           if (this->bid_levels_[price].empty()) {
             this->bid_levels_.erase(price);
           }
+          this->touch_bid(price);
 
         }
       } else {
@@ -207,39 +336,50 @@ public:
           if (this->ask_levels_[price].empty()) {
             this->ask_levels_.erase(price);
           }
+          this->touch_ask(price);
 
         }
       }
       this->order_to_price_level_map_.erase(order_id);
+    } else {
+      this->cancel_stop(order_id);
     }
   }
 
 
   // returns done order ids as a result of matching
   DoneOrders match(SimpleOrder &order) {
+    Conflation conflation(*this);
     DoneOrders done_orders;
     while (is_crossing_with(order) && !order.done()) {
       if (is_buy(order.side)) {
         auto p = begin(this->ask_levels_);
         auto removed = p->second.match(order, this->on_trade_handler_);
+        this->last_trade_price_ = p->first;
         done_orders.insert(done_orders.end(), removed.begin(), removed.end());
         if (p->second.total_shares == 0) {
           this->ask_levels_.erase(p);
         }
+        this->bbo_.ask = this->level_of_ask(0);
       }
       else {
         auto p = begin(this->bid_levels_);
         auto removed = p->second.match(order, this->on_trade_handler_);
+        this->last_trade_price_ = p->first;
         done_orders.insert(done_orders.end(), removed.begin(), removed.end());
         if (p->second.total_shares == 0) {
           this->bid_levels_.erase(p);
         }
+        this->bbo_.bid = this->level_of_bid(0);
       }
     }
     return done_orders;
   }
 
   bool is_crossing_with(const SimpleOrder & order) {
+    if (order.order_type == OrderType::MKT) {
+      return is_buy(order.side) ? !this->ask_levels_.empty() : !this->bid_levels_.empty();
+    }
     if (is_buy(order.side)) {
       return order.price >= this->top_of_ask().first;
     } else {
@@ -247,6 +387,24 @@ public:
     }
   }
 
+  // whether order can fill completely against the other side. walks
+  // the per level aggregates, not the orders, and stops as soon as
+  // enough shares are found, so usually only the top level is read
+  bool can_fill(const SimpleOrder & order) const {
+    return is_buy(order.side)
+      ? can_fill(order, this->ask_levels_, [](Price level, Price limit) { return level <= limit; })
+      : can_fill(order, this->bid_levels_, [](Price level, Price limit) { return level >= limit; });
+  }
+
+  // price of the last trade, 0 before any trade
+  Price last_trade_price() const {
+    return this->last_trade_price_;
+  }
+
+  size_t stop_orders() const {
+    return this->stop_index_.size();
+  }
+
 
   LevelInfo top_of_bid() const {
     return this->level_of_bid(0);
@@ -293,15 +451,220 @@ public:
 
 
   void reset() {
+    Conflation conflation(*this);
+    this->bbo_ = BBO();
     this->ask_levels_.clear();
     this->bid_levels_.clear();
     this->order_to_price_level_map_.clear();
+    this->buy_stops_.clear();
+    this->sell_stops_.clear();
+    this->stop_index_.clear();
+    this->last_trade_price_ = 0;
   }
 
   friend std::ostream & operator<< (std::ostream & os, const DepthBook & depth_book);
 
+  // appends levels and their FIFO queues, asks then bids, best level first
+  void save(std::string & buf) const {
+    binary::put<uint64_t>(buf, this->order_to_price_level_map_.size());
+    binary::put<uint32_t>(buf, this->ask_levels_.size());
+    for (auto & level : this->ask_levels_) save_level(buf, level.first, level.second);
+    binary::put<uint32_t>(buf, this->bid_levels_.size());
+    for (auto & level : this->bid_levels_) save_level(buf, level.first, level.second);
+    binary::put(buf, this->last_trade_price_);
+    binary::put<uint32_t>(buf, this->buy_stops_.size() + this->sell_stops_.size());
+    for (auto & stop : this->buy_stops_) save_stop(buf, stop.second);
+    for (auto & stop : this->sell_stops_) save_stop(buf, stop.second);
+  }
+
+  // replaces the book with what save() wrote, no matching takes place
+  bool load(binary::Reader & reader) {
+    Conflation conflation(*this);
+    this->reset();
+    uint64_t total_orders;
+    if (!reader.get(total_orders)) return false;
+    this->order_to_price_level_map_.reserve(total_orders);
+    for (auto side : {Side::Sell, Side::Buy}) {
+      uint32_t levels;
+      if (!reader.get(levels)) return false;
+      while (levels--) {
+        Price price;
+        uint32_t orders;
+        if (!reader.get(price) || !reader.get(orders)) return false;
+        auto & level = is_buy(side) ? bid_levels_[price] : ask_levels_[price];
+        level.reserve(orders);
+        while (orders--) {
+          char order_type;
+          Shares shares;
+          OrderId order_id;
+          if (!reader.get(order_type) || !reader.get(shares) || !reader.get(order_id)) return false;
+          level.add_order(SimpleOrder(order_id, static_cast<OrderType>(order_type), side, price, shares));
+          this->order_to_price_level_map_[order_id] = std::make_pair(side, price);
+          is_buy(side) ? this->touch_bid(price) : this->touch_ask(price);
+        }
+      }
+    }
+    uint32_t stops;
+    if (!reader.get(this->last_trade_price_) || !reader.get(stops)) return false;
+    while (stops--) {
+      char side;
+      Price price;
+      Shares shares;
+      OrderId order_id;
+      if (!reader.get(side) || !reader.get(price) || !reader.get(shares) || !reader.get(order_id)) return false;
+      this->add_stop(SimpleOrder(order_id, OrderType::STOP, static_cast<Side>(side), price, shares));
+    }
+    return true;
+  }
+
 private:
 
+  // buy stops trigger once the last trade is at or above the stop price,
+  // so the lowest comes first, sell stops the other way round. equal
+  // stop prices trigger in arrival order
+  using BuyStops = std::multimap<Price, SimpleOrder>;
+  using SellStops = std::multimap<Price, SimpleOrder, std::greater<Price>>;
+
+  // only the iterator of the stop's side is set
+  struct StopLocation {
+    Side side;
+    BuyStops::iterator buy;
+    SellStops::iterator sell;
+  };
+
+  // holds the BBO callback back for the length of a command, so one
+  // that moves the BBO a few times on the way publishes once
+  struct Conflation {
+    DepthBook & book;
+
+    explicit Conflation(DepthBook & book)
+      :book(book) {
+      book.begin_conflation();
+    }
+
+    ~Conflation() {
+      book.end_conflation();
+    }
+  };
+
+  // a side's best level only changes when a level at or better than it
+  // does, so anything deeper costs a compare and the rest a begin()
+  void touch_bid(Price price) {
+    if (price >= this->bbo_.bid.first) this->bbo_.bid = this->level_of_bid(0);
+  }
+
+  void touch_ask(Price price) {
+    if (price <= this->bbo_.ask.first) this->bbo_.ask = this->level_of_ask(0);
+  }
+
+  void publish_bbo() {
+    assert(this->bbo_.bid == this->top_of_bid() && this->bbo_.ask == this->top_of_ask());
+    if (this->bbo_ == this->published_bbo_) return;
+    this->published_bbo_ = this->bbo_;
+    if (this->on_bbo_handler_) this->on_bbo_handler_(this->bbo_);
+  }
+
+  // matches a non stop order and rests what's left if its type rests
+  void execute(SimpleOrder & order) {
+    if (order.order_type == OrderType::FOK && !this->can_fill(order)) return;
+    auto done_orders = this->match(order);
+    this->cleanup_done_orders(done_orders);
+    if (!order.done() && rests(order.order_type)) {
+      if (is_buy(order.side)) {
+        bid_levels_[order.price].add_order(order);
+        this->touch_bid(order.price);
+      } else {
+        ask_levels_[order.price].add_order(order);
+        this->touch_ask(order.price);
+      }
+      this->order_to_price_level_map_[order.order_id] = std::make_pair(order.side, order.price);
+    }
+  }
+
+  template <typename Levels, typename Within>
+  static bool can_fill(const SimpleOrder & order, const Levels & levels, Within within) {
+    // wider than Shares, the sum over every level can overflow it
+    uint64_t available = 0;
+    for (auto & level : levels) {
+      if (order.order_type != OrderType::MKT && !within(level.first, order.price)) break;
+      available += level.second.total_shares;
+      if (available >= order.shares) return true;
+    }
+    return false;
+  }
+
+  void add_stop(const SimpleOrder & order) {
+    if (this->stop_index_.count(order.order_id)) return;
+    StopLocation location;
+    location.side = order.side;
+    if (is_buy(order.side)) {
+      location.buy = this->buy_stops_.emplace(order.price, order);
+    } else {
+      location.sell = this->sell_stops_.emplace(order.price, order);
+    }
+    this->stop_index_.emplace(order.order_id, location);
+  }
+
+  void cancel_stop(const OrderId & order_id) {
+    auto p = this->stop_index_.find(order_id);
+    if (p == end(this->stop_index_)) return;
+    if (is_buy(p->second.side)) {
+      this->buy_stops_.erase(p->second.buy);
+    } else {
+      this->sell_stops_.erase(p->second.sell);
+    }
+    this->stop_index_.erase(p);
+  }
+
+  // fires every stop the last trade price has reached, as market orders.
+  // their trades move the last price too, so keep going until none is left
+  void trigger_stops() {
+    while (this->last_trade_price_) {
+      const SimpleOrder * stop = nullptr;
+      if (!this->buy_stops_.empty() && this->buy_stops_.begin()->first <= this->last_trade_price_) {
+        stop = &this->buy_stops_.begin()->second;
+      } else if (!this->sell_stops_.empty() && this->sell_stops_.begin()->first >= this->last_trade_price_) {
+        stop = &this->sell_stops_.begin()->second;
+      } else {
+        break;
+      }
+      SimpleOrder order = *stop;
+      this->cancel_stop(order.order_id);
+      order.order_type = OrderType::MKT;
+      this->execute(order);
+    }
+  }
+
+  static void save_stop(std::string & buf, const SimpleOrder & order) {
+    binary::put(buf, static_cast<char>(order.side));
+    binary::put(buf, order.price);
+    binary::put(buf, order.shares);
+    binary::put(buf, order.order_id);
+  }
+
+  bool reduce_order(const OrderId & order_id, Side side, Price price, Shares shares) {
+    if (is_buy(side)) {
+      auto level = this->bid_levels_.find(price);
+      if (level == end(this->bid_levels_) || !level->second.reduce_order(order_id, shares)) return false;
+      this->touch_bid(price);
+    } else {
+      auto level = this->ask_levels_.find(price);
+      if (level == end(this->ask_levels_) || !level->second.reduce_order(order_id, shares)) return false;
+      this->touch_ask(price);
+    }
+    return true;
+  }
+
+  static void save_level(std::string & buf, Price price, const PriceLevel & level) {
+    binary::put(buf, price);
+    binary::put<uint32_t>(buf, level.orders().size());
+    for (auto & order : level.orders()) {
+      binary::put(buf, static_cast<char>(order.order_type));
+      binary::put(buf, order.shares);
+      binary::put(buf, order.order_id);
+    }
+  }
+
   void cleanup_done_orders(const std::vector<OrderId> & done_orders) {
     for (auto oid : done_orders) {
       this->order_to_price_level_map_.erase(oid);
@@ -321,8 +684,20 @@ private:
   // of cancael/modify
   OrderToPriceLevelMap order_to_price_level_map_;
 
+  // pending stop orders by stop price, and by id for cancel
+  BuyStops buy_stops_;
+  SellStops sell_stops_;
+  std::unordered_map<OrderId, StopLocation> stop_index_;
+  Price last_trade_price_ = 0;
+
   // on match callback
   OnTradeHandler on_trade_handler_;
+
+  // BBO as of now and as last handed to on_bbo_handler_
+  BBO bbo_;
+  BBO published_bbo_;
+  OnBboHandler on_bbo_handler_;
+  int conflating_ = 0;
 };
 
 std::ostream & operator<< (std::ostream & os, const DepthBook & depth_book) {
@@ -425,71 +800,1056 @@ TEST(DepthBook, basic)
 
 
 }
+
+TEST(DepthBook, partial_fill)
+{
+  DepthBook book([](const SimpleOrder &, const SimpleOrder &, Shares) {});
+  book.add_order("order1", Side::Buy, OrderType::GFD, 1000, 10);
+  book.add_order("order2", Side::Sell, OrderType::GFD, 1000, 3);
+  EXPECT_EQ(7, book.top_of_bid().second);
+  // the resting order keeps its remaining shares
+  book.cancel_order("order1");
+  EXPECT_EQ(0, book.depth_of_bid());
+}
+
+TEST(DepthBook, amend)
+{
+  std::vector< std::tuple<OrderId, OrderId, Shares> > trades;
+  auto on_trade = [&trades](const SimpleOrder & o1, const SimpleOrder & o2, Shares shares) {
+    trades.emplace_back(o1.order_id, o2.order_id, shares);
+  };
+  DepthBook book(on_trade);
+
+  // size down keeps priority
+  book.add_order("order1", Side::Buy, OrderType::GFD, 1000, 10);
+  book.add_order("order2", Side::Buy, OrderType::GFD, 1000, 10);
+  book.modify_order("order1", Side::Buy, 1000, 4);
+  EXPECT_EQ(14, book.top_of_bid().second);
+  book.add_order("order3", Side::Sell, OrderType::GFD, 1000, 6);
+  ASSERT_EQ(2, trades.size());
+  EXPECT_EQ((std::tuple<OrderId, OrderId, Shares>{"order1", "order3", 4}), trades[0]);
+  EXPECT_EQ((std::tuple<OrderId, OrderId, Shares>{"order2", "order3", 2}), trades[1]);
+  EXPECT_EQ(8, book.top_of_bid().second);
+
+  // size down after a partial fill is against what's left
+  book.modify_order("order2", Side::Buy, 1000, 8);
+  EXPECT_EQ(8, book.top_of_bid().second);
+  book.modify_order("order2", Side::Buy, 1000, 5);
+  EXPECT_EQ(5, book.top_of_bid().second);
+
+  book.reset();
+  trades.clear();
+
+  // size up goes to the back of the queue
+  book.add_order("order1", Side::Sell, OrderType::GFD, 1000, 10);
+  book.add_order("order2", Side::Sell, OrderType::GFD, 1000, 10);
+  book.modify_order("order1", Side::Sell, 1000, 11);
+  book.add_order("order3", Side::Buy, OrderType::IOC, 1000, 1);
+  EXPECT_EQ((std::tuple<OrderId, OrderId, Shares>{"order2", "order3", 1}), trades[0]);
+
+  // so does a price change, even with fewer shares
+  book.modify_order("order2", Side::Sell, 1001, 5);
+  book.modify_order("order2", Side::Sell, 1000, 5);
+  book.add_order("order4", Side::Buy, OrderType::IOC, 1000, 1);
+  EXPECT_EQ((std::tuple<OrderId, OrderId, Shares>{"order1", "order4", 1}), trades[1]);
+
+  // and a side change
+  book.modify_order("order1", Side::Buy, 999, 5);
+  EXPECT_EQ(5, book.top_of_ask().second);
+  EXPECT_EQ((DepthBook::LevelInfo{999, 5}), book.top_of_bid());
+  EXPECT_EQ(2, trades.size());
+
+  // down to 0 drops the order, nothing is left to trade against
+  book.modify_order("order1", Side::Buy, 999, 0);
+  EXPECT_FALSE(book.exists("order1"));
+  EXPECT_EQ(0, book.top_of_bid().second);
+  book.add_order("order5", Side::Sell, OrderType::IOC, 999, 1);
+  EXPECT_EQ(2, trades.size());
+}
+
+TEST(DepthBook, market_fok)
+{
+  std::vector< std::tuple<OrderId, OrderId, Shares> > trades;
+  std::vector<Price> prices;
+  auto on_trade = [&trades, &prices](const SimpleOrder & o1, const SimpleOrder & o2, Shares shares) {
+    trades.emplace_back(o1.order_id, o2.order_id, shares);
+    prices.push_back(reported_price(o1, o2));
+  };
+  DepthBook book(on_trade);
+
+  // market order sweeps any price and drops the rest
+  book.add_order("order1", Side::Sell, OrderType::GFD, 1000, 10);
+  book.add_order("order2", Side::Sell, OrderType::GFD, 1500, 10);
+  book.add_order("order3", Side::Buy, OrderType::MKT, 0, 25);
+  EXPECT_EQ(2, trades.size());
+  EXPECT_EQ((std::tuple<OrderId, OrderId, Shares>{"order2", "order3", 10}), trades[1]);
+  EXPECT_EQ(0, book.depth_of_ask());
+  EXPECT_EQ(0, book.depth_of_bid());
+  EXPECT_EQ(1500, book.last_trade_price());
+  // at the resting prices, not its own 0
+  EXPECT_EQ((std::vector<Price>{1000, 1500}), prices);
+
+  // into an empty book nothing happens
+  book.add_order("order4", Side::Sell, OrderType::MKT, 0, 5);
+  EXPECT_EQ(2, trades.size());
+
+  book.reset();
+  trades.clear();
+
+  // fok is killed without a trade when the liquidity isn't there
+  book.add_order("order1", Side::Buy, OrderType::GFD, 1000, 10);
+  book.add_order("order2", Side::Buy, OrderType::GFD, 999, 10);
+  book.add_order("order3", Side::Buy, OrderType::GFD, 998, 10);
+  EXPECT_FALSE(book.can_fill(SimpleOrder("x", OrderType::FOK, Side::Sell, 999, 21)));
+  EXPECT_TRUE(book.can_fill(SimpleOrder("x", OrderType::FOK, Side::Sell, 999, 20)));
+  book.add_order("order4", Side::Sell, OrderType::FOK, 999, 21);
+  EXPECT_EQ(0, trades.size());
+  EXPECT_EQ(3, book.depth_of_bid());
+  // and fills across levels when it is
+  book.add_order("order5", Side::Sell, OrderType::FOK, 999, 15);
+  EXPECT_EQ(2, trades.size());
+  EXPECT_EQ((DepthBook::LevelInfo{999, 5}), book.top_of_bid());
+  EXPECT_EQ(0, book.depth_of_ask());
+  // a sell fok at 0 takes any price, so only the shares decide
+  book.add_order("order6", Side::Sell, OrderType::FOK, 0, 16);
+  EXPECT_EQ(2, trades.size());
+  book.add_order("order7", Side::Sell, OrderType::FOK, 0, 15);
+  ASSERT_EQ(4, trades.size());
+  EXPECT_EQ((std::tuple<OrderId, OrderId, Shares>{"order2", "order7", 5}), trades[2]);
+  EXPECT_EQ((std::tuple<OrderId, OrderId, Shares>{"order3", "order7", 10}), trades[3]);
+  EXPECT_EQ(0, book.depth_of_bid());
+  EXPECT_EQ(0, book.depth_of_ask());
+  EXPECT_EQ(998, book.last_trade_price());
+
+  // liquidity summed over levels can pass what Shares holds
+  book.add_order("order8", Side::Buy, OrderType::GFD, 1000, 4000000000u);
+  book.add_order("order9", Side::Buy, OrderType::GFD, 999, 4000000000u);
+  EXPECT_TRUE(book.can_fill(SimpleOrder("x", OrderType::FOK, Side::Sell, 999, 4100000000u)));
+}
+
+TEST(DepthBook, stop)
+{
+  std::vector< std::tuple<OrderId, OrderId, Shares> > trades;
+  auto on_trade = [&trades](const SimpleOrder & o1, const SimpleOrder & o2, Shares shares) {
+    trades.emplace_back(o1.order_id, o2.order_id, shares);
+  };
+  DepthBook book(on_trade);
+
+  book.add_order("ask1", Side::Sell, OrderType::GFD, 1001, 10);
+  book.add_order("ask2", Side::Sell, OrderType::GFD, 1002, 10);
+  book.add_order("ask3", Side::Sell, OrderType::GFD, 1003, 10);
+  // no trade yet, nothing triggers
+  book.add_order("stop1", Side::Buy, OrderType::STOP, 1002, 10);
+  book.add_order("stop2", Side::Buy, OrderType::STOP, 1003, 5);
+  book.add_order("stop3", Side::Buy, OrderType::STOP, 1010, 5);
+  book.add_order("stop4", Side::Sell, OrderType::STOP, 990, 5);
+  EXPECT_EQ(4, book.stop_orders());
+  EXPECT_TRUE(trades.empty());
+  EXPECT_FALSE(book.exists("stop1"));
+
+  // trade at 1001 doesn't reach the buy stops
+  book.add_order("buy1", Side::Buy, OrderType::IOC, 1001, 5);
+  EXPECT_EQ(1, trades.size());
+  EXPECT_EQ(4, book.stop_orders());
+
+  // trade at 1002 fires stop1, whose fills reach 1003 and fire stop2
+  book.add_order("buy2", Side::Buy, OrderType::IOC, 1002, 10);
+  ASSERT_EQ(6, trades.size());
+  EXPECT_EQ((std::tuple<OrderId, OrderId, Shares>{"ask2", "buy2", 5}), trades[2]);
+  EXPECT_EQ((std::tuple<OrderId, OrderId, Shares>{"ask2", "stop1", 5}), trades[3]);
+  EXPECT_EQ((std::tuple<OrderId, OrderId, Shares>{"ask3", "stop1", 5}), trades[4]);
+  EXPECT_EQ((std::tuple<OrderId, OrderId, Shares>{"ask3", "stop2", 5}), trades[5]);
+  EXPECT_EQ(2, book.stop_orders());
+  EXPECT_EQ(0, book.depth_of_ask());
+
+  // stops cancel like any order
+  book.cancel_order("stop3");
+  book.cancel_order("stop4");
+  EXPECT_EQ(0, book.stop_orders());
+
+  // a stop already reached triggers right away
+  book.add_order("bid1", Side::Buy, OrderType::GFD, 1000, 10);
+  book.add_order("stop5", Side::Sell, OrderType::STOP, 1005, 3);
+  EXPECT_EQ((std::tuple<OrderId, OrderId, Shares>{"bid1", "stop5", 3}), trades.back());
+  EXPECT_EQ(0, book.stop_orders());
+}
+
+TEST(DepthBook, save_load)
+{
+  std::vector< std::tuple<OrderId, OrderId, Shares> > trades;
+  auto on_trade = [&trades](const SimpleOrder & o1, const SimpleOrder & o2, Shares shares) {
+    trades.emplace_back(o1.order_id, o2.order_id, shares);
+  };
+  DepthBook book(on_trade), loaded(on_trade);
+  book.add_order("order1", Side::Buy, OrderType::GFD, 1000, 10);
+  book.add_order("order2", Side::Buy, OrderType::GFD, 1000, 20);
+  book.add_order("order3", Side::Buy, OrderType::GFD, 999, 5);
+  book.add_order("order4", Side::Sell, OrderType::GFD, 1001, 7);
+  book.add_order("order5", Side::Sell, OrderType::GFD, 1000, 4);
+
+  std::string buf;
+  book.save(buf);
+  binary::Reader reader = {buf.data(), buf.data() + buf.size()};
+  EXPECT_TRUE(loaded.load(reader));
+  EXPECT_TRUE(reader.done());
+
+  std::ostringstream lhs, rhs;
+  lhs << book;
+  rhs << loaded;
+  EXPECT_EQ(lhs.str(), rhs.str());
+
+  // time priority survives
+  trades.clear();
+  loaded.add_order("order6", Side::Sell, OrderType::GFD, 1000, 30);
+  EXPECT_EQ(2, trades.size());
+  EXPECT_EQ((std::tuple<OrderId, OrderId, Shares>{"order2", "order6", 20}), trades[1]);
+  EXPECT_TRUE(loaded.exists("order4"));
+  loaded.cancel_order("order4");
+  // order6 rests with what's left after order1 (6) and order2 (20)
+  EXPECT_EQ(1, loaded.depth_of_ask());
+  EXPECT_EQ(4, loaded.top_of_ask().second);
+
+  // pending stops and the last trade price are kept
+  book.add_order("stop1", Side::Sell, OrderType::STOP, 990, 5);
+  buf.clear();
+  book.save(buf);
+  reader = {buf.data(), buf.data() + buf.size()};
+  EXPECT_TRUE(loaded.load(reader));
+  EXPECT_EQ(1, loaded.stop_orders());
+  EXPECT_EQ(1000, loaded.last_trade_price());
+
+  // truncated input fails
+  binary::Reader truncated = {buf.data(), buf.data() + buf.size() - 1};
+  EXPECT_FALSE(loaded.load(truncated));
+}
+
+TEST(DepthBook, bbo)
+{
+  DepthBook book([](const SimpleOrder &, const SimpleOrder &, Shares) {});
+  std::vector<DepthBook::BBO> bbos;
+  book.on_bbo([&bbos](const DepthBook::BBO & bbo) { bbos.push_back(bbo); });
+
+  book.add_order("order1", Side::Buy, OrderType::GFD, 1000, 10);
+  ASSERT_EQ(1, bbos.size());
+  EXPECT_EQ((DepthBook::LevelInfo{1000, 10}), bbos[0].bid);
+  EXPECT_EQ(0, bbos[0].ask.second);
+
+  // deeper levels leave it alone
+  book.add_order("order2", Side::Buy, OrderType::GFD, 999, 10);
+  book.add_order("order3", Side::Sell, OrderType::GFD, 1002, 10);
+  book.add_order("order4", Side::Sell, OrderType::GFD, 1003, 10);
+  book.cancel_order("order4");
+  book.modify_order("order2", Side::Buy, 999, 5);
+  EXPECT_EQ(2, bbos.size());
+  EXPECT_EQ((DepthBook::LevelInfo{1002, 10}), bbos[1].ask);
+
+  // size at the top counts
+  book.add_order("order5", Side::Buy, OrderType::GFD, 1000, 5);
+  ASSERT_EQ(3, bbos.size());
+  EXPECT_EQ((DepthBook::LevelInfo{1000, 15}), bbos[2].bid);
+  book.modify_order("order1", Side::Buy, 1000, 4);
+  ASSERT_EQ(4, bbos.size());
+  EXPECT_EQ((DepthBook::LevelInfo{1000, 9}), bbos[3].bid);
+
+  // a sweep through both bid levels publishes where it ends
+  book.add_order("order6", Side::Sell, OrderType::GFD, 999, 20);
+  ASSERT_EQ(5, bbos.size());
+  EXPECT_EQ(0, bbos[4].bid.second);
+  EXPECT_EQ((DepthBook::LevelInfo{999, 6}), bbos[4].ask);
+  EXPECT_EQ(book.top_of_bid(), book.bbo().bid);
+  EXPECT_EQ(book.top_of_ask(), book.bbo().ask);
+
+  // an IOC that doesn't cross and a missing order change nothing
+  book.add_order("order7", Side::Buy, OrderType::IOC, 998, 10);
+  book.cancel_order("order100");
+  EXPECT_EQ(5, bbos.size());
+
+  // conflated, a change that's undone is never seen and the rest is
+  // seen once
+  book.begin_conflation();
+  book.add_order("order8", Side::Buy, OrderType::GFD, 998, 10);
+  book.cancel_order("order8");
+  book.end_conflation();
+  EXPECT_EQ(5, bbos.size());
+  book.begin_conflation();
+  book.add_order("order9", Side::Buy, OrderType::GFD, 997, 10);
+  book.add_order("order10", Side::Buy, OrderType::GFD, 998, 10);
+  book.cancel_order("order6");
+  EXPECT_EQ(5, bbos.size());
+  book.end_conflation();
+  ASSERT_EQ(6, bbos.size());
+  EXPECT_EQ((DepthBook::LevelInfo{998, 10}), bbos[5].bid);
+  EXPECT_EQ((DepthBook::LevelInfo{1002, 10}), bbos[5].ask);
+
+  book.reset();
+  ASSERT_EQ(7, bbos.size());
+  EXPECT_EQ(DepthBook::BBO(), bbos[6]);
+}
 #endif
 
+
+enum class CommandType: char
+{
+  Add = 'A',
+  Modify = 'M',
+  Cancel = 'C',
+  Print = 'P'
+};
+
+// pre-parsed message
+struct Command {
+  CommandType type;
+  Side side;
+  OrderType order_type;
+  Price price;
+  Shares shares;
+  OrderId order_id;
+};
+
+inline void apply(DepthBook & book, const Command & cmd) {
+  switch (cmd.type) {
+    case CommandType::Add:
+      book.add_order(cmd.order_id, cmd.side, cmd.order_type, cmd.price, cmd.shares);
+      break;
+    case CommandType::Modify:
+      book.modify_order(cmd.order_id, cmd.side, cmd.price, cmd.shares);
+      break;
+    case CommandType::Cancel:
+      book.cancel_order(cmd.order_id);
+      break;
+    default:
+      break;
+  }
+}
+
+
+/*
+ * applies pre-parsed commands a batch at a time. trades are buffered
+ * and handed over together with the resulting top of book once per
+ * batch rather than once per fill
+ */
+class BatchMatcher {
+public:
+  struct Trade {
+    OrderId resting_id;
+    Price resting_price;
+    OrderId incoming_id;
+    Price incoming_price;
+    Shares shares;
+  };
+
+  using Trades = std::vector<Trade>;
+  using OnBatchHandler = std::function<void(const Trades &, DepthBook::LevelInfo bid, DepthBook::LevelInfo ask)>;
+
+  BatchMatcher(OnBatchHandler handler)
+    :book_([this](const SimpleOrder & resting, const SimpleOrder & incoming, Shares shares) {
+        this->trades_.push_back(Trade {resting.order_id, resting.price, incoming.order_id,
+          reported_price(resting, incoming), shares});
+      })
+    ,on_batch_handler_(handler)
+  {
+    this->book_.on_bbo([this](const DepthBook::BBO &) {
+      this->bbo_changed_ = true;
+    });
+  }
+
+  // the book's trade handler points back at this
+  BatchMatcher(const BatchMatcher &) = delete;
+  BatchMatcher & operator= (const BatchMatcher &) = delete;
+
+  DepthBook & book() {
+    return this->book_;
+  }
+
+  // publishes once at the end, and only if the batch traded or
+  // moved the top of book
+  void apply(const Command * cmds, size_t n) {
+    this->book_.begin_conflation();
+    for (size_t i = 0; i < n; i++) {
+      ::apply(this->book_, cmds[i]);
+    }
+    this->book_.end_conflation();
+    this->publish();
+  }
+
+  void apply(const std::vector<Command> & cmds) {
+    this->apply(cmds.data(), cmds.size());
+  }
+
+private:
+  void publish() {
+    if (this->trades_.empty() && !this->bbo_changed_) return;
+    auto & bbo = this->book_.bbo();
+    this->on_batch_handler_(this->trades_, bbo.bid, bbo.ask);
+    this->trades_.clear();
+    this->bbo_changed_ = false;
+  }
+
+private:
+  DepthBook book_;
+  Trades trades_;
+  // the book conflates over the batch, so this is whether its BBO
+  // ended up anywhere else than where it was last published
+  bool bbo_changed_ = false;
+  OnBatchHandler on_batch_handler_;
+};
+
+#ifdef __UNITTEST__
+TEST(BatchMatcher, basic)
+{
+  std::vector<BatchMatcher::Trades> published;
+  std::vector<std::pair<DepthBook::LevelInfo, DepthBook::LevelInfo>> tops;
+  BatchMatcher matcher([&](const BatchMatcher::Trades & trades, DepthBook::LevelInfo bid, DepthBook::LevelInfo ask) {
+    published.push_back(trades);
+    tops.emplace_back(bid, ask);
+  });
+  std::vector< std::tuple<OrderId, OrderId, Shares> > trades;
+  DepthBook book([&trades](const SimpleOrder & o1, const SimpleOrder & o2, Shares shares) {
+    trades.emplace_back(o1.order_id, o2.order_id, shares);
+  });
+
+  std::vector<Command> batch1 = {
+    {CommandType::Add, Side::Sell, OrderType::GFD, 1000, 10, "order1"},
+    {CommandType::Add, Side::Sell, OrderType::GFD, 1001, 10, "order2"},
+    {CommandType::Add, Side::Buy, OrderType::GFD, 999, 10, "order3"},
+    {CommandType::Add, Side::Buy, OrderType::GFD, 998, 10, "order4"},
+    {CommandType::Modify, Side::Buy, OrderType::GFD, 999, 5, "order3"},
+    {CommandType::Cancel, Side::Buy, OrderType::GFD, 0, 0, "order4"},
+  };
+  std::vector<Command> batch2 = {
+    {CommandType::Add, Side::Buy, OrderType::IOC, 1001, 15, "order5"},
+    {CommandType::Add, Side::Sell, OrderType::GFD, 999, 2, "order6"},
+  };
+  // touches nothing
+  std::vector<Command> batch3 = {
+    {CommandType::Cancel, Side::Buy, OrderType::GFD, 0, 0, "order100"},
+  };
+
+  matcher.apply(batch1);
+  ASSERT_EQ(1, published.size());
+  EXPECT_TRUE(published[0].empty());
+  EXPECT_EQ((DepthBook::LevelInfo{999, 5}), tops[0].first);
+  EXPECT_EQ((DepthBook::LevelInfo{1000, 10}), tops[0].second);
+
+  // one publication for all three fills
+  matcher.apply(batch2);
+  ASSERT_EQ(2, published.size());
+  ASSERT_EQ(3, published[1].size());
+  EXPECT_EQ("order1", published[1][0].resting_id);
+  EXPECT_EQ("order5", published[1][1].incoming_id);
+  EXPECT_EQ(1001, published[1][1].resting_price);
+  EXPECT_EQ(5, published[1][1].shares);
+  EXPECT_EQ("order6", published[1][2].incoming_id);
+  EXPECT_EQ((DepthBook::LevelInfo{999, 3}), tops[1].first);
+  EXPECT_EQ((DepthBook::LevelInfo{1001, 5}), tops[1].second);
+
+  matcher.apply(batch3);
+  EXPECT_EQ(2, published.size());
+
+  // same book and trades as applying one by one
+  for (auto & batch : {batch1, batch2, batch3}) {
+    for (auto & cmd : batch) apply(book, cmd);
+  }
+  std::ostringstream lhs, rhs;
+  lhs << book;
+  rhs << matcher.book();
+  EXPECT_EQ(lhs.str(), rhs.str());
+  EXPECT_EQ(3, trades.size());
+}
+#endif
+
+
+/*
+ * append only binary journal of accepted commands. a record is
+ * [uint32 length][uint32 fnv1a checksum][payload], records are
+ * buffered and written with one write + fdatasync per group commit,
+ * so a crash loses at most the last uncommitted group
+ */
+class Journal {
+public:
+  using Seq = uint64_t;
+  using OnCommandHandler = std::function<void(Seq, const Command &)>;
+
+  Journal(const std::string & path, size_t group_size = 64)
+    :fd_(::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644))
+    ,group_size_(group_size)
+  {
+    if (fd_ < 0) throw std::runtime_error("can't open journal " + path);
+  }
+
+  // callers commit() first to see errors, this only catches stragglers
+  ~Journal() {
+    this->close();
+  }
+
+  Journal(const Journal &) = delete;
+  Journal & operator=(const Journal &) = delete;
+
+  // continue numbering after recovery
+  void set_seq(Seq seq) {
+    this->seq_ = seq;
+  }
+
+  Seq seq() const {
+    return this->seq_;
+  }
+
+  Seq append(const Command & cmd) {
+    ++this->seq_;
+    size_t header = this->buffer_.size();
+    binary::put<uint32_t>(this->buffer_, 0);
+    binary::put<uint32_t>(this->buffer_, 0);
+    size_t payload = this->buffer_.size();
+    binary::put(this->buffer_, this->seq_);
+    binary::put(this->buffer_, static_cast<char>(cmd.type));
+    binary::put(this->buffer_, static_cast<char>(cmd.side));
+    binary::put(this->buffer_, static_cast<char>(cmd.order_type));
+    binary::put(this->buffer_, cmd.price);
+    binary::put(this->buffer_, cmd.shares);
+    binary::put(this->buffer_, cmd.order_id);
+    uint32_t length = this->buffer_.size() - payload;
+    uint32_t checksum = fnv1a(this->buffer_.data() + payload, length);
+    memcpy(&this->buffer_[header], &length, sizeof(length));
+    memcpy(&this->buffer_[header + sizeof(length)], &checksum, sizeof(checksum));
+
+    if (++this->pending_ >= this->group_size_) {
+      this->commit();
+    }
+    return this->seq_;
+  }
+
+  // writes out and syncs every pending record
+  void commit() {
+    if (this->buffer_.empty()) return;
+    const char * p = this->buffer_.data();
+    size_t left = this->buffer_.size();
+    while (left) {
+      auto n = ::write(this->fd_, p, left);
+      if (n < 0) throw std::runtime_error("journal write failed");
+      p += n;
+      left -= n;
+    }
+    if (::fdatasync(this->fd_) != 0) throw std::runtime_error("journal sync failed");
+    this->buffer_.clear();
+    this->pending_ = 0;
+  }
+
+  // records appended but not committed yet
+  size_t pending() const {
+    return this->pending_;
+  }
+
+  // commits what is left and closes the file. a failed commit is
+  // reported on stderr rather than thrown, so it is safe at shutdown
+  bool close() noexcept {
+    if (this->fd_ < 0) return true;
+    bool ok = true;
+    try {
+      this->commit();
+    } catch (const std::exception & e) {
+      std::cerr << e.what() << std::endl;
+      ok = false;
+    }
+    ::close(this->fd_);
+    this->fd_ = -1;
+    return ok;
+  }
+
+  // drops every record, called once a snapshot covers them
+  void truncate() {
+    this->commit();
+    if (::ftruncate(this->fd_, 0) != 0) throw std::runtime_error("journal truncate failed");
+  }
+
+  // calls handler for each intact record after seq, a torn or corrupt
+  // tail ends the replay. returns the last seq seen
+  static Seq replay(const std::string & path, Seq after, OnCommandHandler handler) {
+    std::string buf;
+    Seq last = after;
+    if (!binary::read_file(path, buf)) return last;
+    binary::Reader reader = {buf.data(), buf.data() + buf.size()};
+    uint32_t length, checksum;
+    while (reader.get(length) && reader.get(checksum)) {
+      if (size_t(reader.end - reader.p) < length || fnv1a(reader.p, length) != checksum) break;
+      binary::Reader record = {reader.p, reader.p + length};
+      reader.p += length;
+
+      Seq seq;
+      char type, side, order_type;
+      Command cmd;
+      if (!record.get(seq) || !record.get(type) || !record.get(side) || !record.get(order_type)
+          || !record.get(cmd.price) || !record.get(cmd.shares) || !record.get(cmd.order_id)) break;
+      if (seq <= last) continue;
+      cmd.type = static_cast<CommandType>(type);
+      cmd.side = static_cast<Side>(side);
+      cmd.order_type = static_cast<OrderType>(order_type);
+      handler(seq, cmd);
+      last = seq;
+    }
+    return last;
+  }
+
+private:
+  static uint32_t fnv1a(const char * p, size_t n) {
+    uint32_t hash = 2166136261u;
+    while (n--) {
+      hash ^= uint8_t(*p++);
+      hash *= 16777619u;
+    }
+    return hash;
+  }
+
+  int fd_;
+  size_t group_size_;
+  size_t pending_ = 0;
+  Seq seq_ = 0;
+  std::string buffer_;
+};
+
+#ifdef __UNITTEST__
+TEST(Journal, basic)
+{
+  const char * path = "./journal_test.bin";
+  std::remove(path);
+  {
+    Journal journal(path, 2);
+    journal.append(Command {CommandType::Add, Side::Buy, OrderType::GFD, 1000, 10, "order1"});
+    journal.append(Command {CommandType::Modify, Side::Buy, OrderType::GFD, 1001, 20, "order1"});
+    journal.append(Command {CommandType::Cancel, Side::Buy, OrderType::GFD, 0, 0, "order1"});
+    journal.commit();
+    EXPECT_EQ(0, journal.pending());
+  }
+
+  std::vector<std::pair<Journal::Seq, Command>> commands;
+  auto collect = [&commands](Journal::Seq seq, const Command & cmd) { commands.emplace_back(seq, cmd); };
+  EXPECT_EQ(3, Journal::replay(path, 0, collect));
+  ASSERT_EQ(3, commands.size());
+  EXPECT_EQ(1, commands[0].first);
+  EXPECT_EQ(CommandType::Add, commands[0].second.type);
+  EXPECT_EQ(Side::Buy, commands[0].second.side);
+  EXPECT_EQ(1000, commands[0].second.price);
+  EXPECT_EQ(10, commands[0].second.shares);
+  EXPECT_EQ("order1", commands[0].second.order_id);
+  EXPECT_EQ(CommandType::Modify, commands[1].second.type);
+  EXPECT_EQ(CommandType::Cancel, commands[2].second.type);
+
+  // only the tail after a seq
+  commands.clear();
+  EXPECT_EQ(3, Journal::replay(path, 2, collect));
+  ASSERT_EQ(1, commands.size());
+  EXPECT_EQ(3, commands[0].first);
+
+  // a torn last record is dropped
+  std::string buf;
+  binary::read_file(path, buf);
+  std::ofstream(path, std::ios::binary | std::ios::trunc).write(buf.data(), buf.size() - 3);
+  commands.clear();
+  EXPECT_EQ(2, Journal::replay(path, 0, collect));
+  EXPECT_EQ(2, commands.size());
+
+  std::remove(path);
+}
+#endif
+
+
+/*
+ * durable book state in a directory: a journal of the commands applied
+ * since the latest snapshot, and every snapshot_interval commands a
+ * compact binary snapshot of the book (written to a temp file and renamed)
+ * after which the journal starts over
+ */
+class BookStore {
+public:
+  using Seq = Journal::Seq;
+
+  BookStore(const std::string & dir, size_t group_size = 64, size_t snapshot_interval = 1000000)
+    :dir_(dir)
+    ,snapshot_path_(dir + "/book.snapshot")
+    ,journal_path_(dir + "/book.journal")
+    ,journal_(journal_path_, group_size)
+    ,snapshot_interval_(snapshot_interval)
+  {}
+
+  // loads the latest snapshot plus the journal tail, returns the last seq
+  Seq recover(DepthBook & book) {
+    Seq seq = 0;
+    std::string buf;
+    book.reset();
+    if (binary::read_file(this->snapshot_path_, buf)) {
+      binary::Reader reader = {buf.data(), buf.data() + buf.size()};
+      if (!reader.get(seq) || !book.load(reader)) {
+        throw std::runtime_error("corrupt snapshot " + this->snapshot_path_);
+      }
+    }
+    seq = Journal::replay(this->journal_path_, seq, [&book](Seq, const Command & cmd) {
+      apply(book, cmd);
+    });
+    this->journal_.set_seq(seq);
+    return seq;
+  }
+
+  // journals an accepted command, call before applying it
+  Seq append(const Command & cmd) {
+    return this->journal_.append(cmd);
+  }
+
+  // call after applying, snapshots once enough commands went by
+  void after_apply(const DepthBook & book) {
+    if (++this->since_snapshot_ >= this->snapshot_interval_) {
+      this->snapshot(book);
+    }
+  }
+
+  void snapshot(const DepthBook & book) {
+    std::string buf;
+    binary::put(buf, this->journal_.seq());
+    book.save(buf);
+
+    auto tmp = this->snapshot_path_ + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) throw std::runtime_error("can't open " + tmp);
+    const char * p = buf.data();
+    size_t left = buf.size();
+    while (left) {
+      auto n = ::write(fd, p, left);
+      if (n < 0) {
+        ::close(fd);
+        throw std::runtime_error("snapshot write failed");
+      }
+      p += n;
+      left -= n;
+    }
+    int synced = ::fdatasync(fd);
+    ::close(fd);
+    if (synced != 0) throw std::runtime_error("snapshot sync failed");
+    if (std::rename(tmp.c_str(), this->snapshot_path_.c_str()) != 0) {
+      throw std::runtime_error("snapshot rename failed");
+    }
+    // the rename has to be on disk before the journal goes, or a crash
+    // can keep the truncate and lose both. a crash before this point
+    // leaves journal records the snapshot already covers, recover()
+    // skips them by seq
+    sync_dir(this->dir_);
+    this->journal_.truncate();
+    this->since_snapshot_ = 0;
+  }
+
+  void commit() {
+    this->journal_.commit();
+  }
+
+  // commands journaled but not durable yet
+  size_t pending() const {
+    return this->journal_.pending();
+  }
+
+private:
+  static void sync_dir(const std::string & dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0) throw std::runtime_error("can't open " + dir);
+    int synced = ::fsync(fd);
+    ::close(fd);
+    if (synced != 0) throw std::runtime_error("can't sync " + dir);
+  }
+
+  std::string dir_;
+  std::string snapshot_path_;
+  std::string journal_path_;
+  Journal journal_;
+  size_t snapshot_interval_;
+  size_t since_snapshot_ = 0;
+};
+
+#ifdef __UNITTEST__
+TEST(BookStore, recover)
+{
+  const std::string dir = ".";
+  std::remove("./book.snapshot");
+  std::remove("./book.journal");
+  auto no_trade = [](const SimpleOrder &, const SimpleOrder &, Shares) {};
+  std::string expected;
+  {
+    DepthBook book(no_trade);
+    BookStore store(dir, 1, 3);
+    EXPECT_EQ(0, store.recover(book));
+    std::vector<Command> commands = {
+      {CommandType::Add, Side::Buy, OrderType::GFD, 1000, 10, "order1"},
+      {CommandType::Add, Side::Buy, OrderType::GFD, 1000, 20, "order2"},
+      {CommandType::Add, Side::Sell, OrderType::GFD, 1002, 5, "order3"},
+      // snapshot taken here
+      {CommandType::Add, Side::Sell, OrderType::GFD, 1000, 15, "order4"},
+      {CommandType::Modify, Side::Sell, OrderType::GFD, 1003, 5, "order3"},
+    };
+    for (auto & cmd : commands) {
+      store.append(cmd);
+      apply(book, cmd);
+      store.after_apply(book);
+    }
+    store.commit();
+    std::ostringstream oss;
+    oss << book;
+    expected = oss.str();
+  }
+
+  DepthBook recovered(no_trade);
+  BookStore store(dir, 1, 3);
+  EXPECT_EQ(5, store.recover(recovered));
+  std::ostringstream oss;
+  oss << recovered;
+  EXPECT_EQ(expected, oss.str());
+  // order1 was partially filled before the snapshot
+  EXPECT_EQ(15, recovered.top_of_bid().second);
+
+  // numbering continues after recovery
+  EXPECT_EQ(6, store.append(Command {CommandType::Cancel, Side::Buy, OrderType::GFD, 0, 0, "order2"}));
+
+  std::remove("./book.snapshot");
+  std::remove("./book.journal");
+}
+#endif
+
+
+/*
+ * seeded synthetic order flow. passive orders rest within depth ticks
+ * of a mid price that random walks by up to walk ticks per message,
+ * crossing orders go through depth ticks on the other side. the raw
+ * mt19937_64 output is used so a seed gives the same flow everywhere
+ */
+struct FlowConfig {
+  uint64_t seed = 42;
+  size_t messages = 1000000;
+  // relative weights of each message kind
+  double add = 0.5;
+  double cancel = 0.3;
+  double modify = 0.15;
+  double cross = 0.05;
+  Price start_price = 10000;
+  Price depth = 50;
+  Price walk = 1;
+};
+
+class OrderFlowGenerator {
+public:
+  OrderFlowGenerator(const FlowConfig & config)
+    :config_(config)
+    ,rng_(config.seed)
+    ,mid_(config.start_price)
+  {}
+
+  std::vector<Command> generate() {
+    std::vector<Command> commands;
+    commands.reserve(this->config_.messages);
+    double total = this->config_.add + this->config_.cancel + this->config_.modify + this->config_.cross;
+    while (commands.size() < this->config_.messages) {
+      this->step_mid();
+      double r = this->uniform() * total;
+      if (this->live_.empty() || (r -= this->config_.add) < 0) {
+        commands.push_back(this->passive_add());
+      } else if ((r -= this->config_.cancel) < 0) {
+        commands.push_back(this->cancel());
+      } else if ((r -= this->config_.modify) < 0) {
+        commands.push_back(this->modify());
+      } else {
+        commands.push_back(this->crossing_add());
+      }
+    }
+    return commands;
+  }
+
+private:
+  struct LiveOrder {
+    OrderId order_id;
+    Side side;
+  };
+
+  uint64_t next(uint64_t bound) {
+    return this->rng_() % bound;
+  }
+
+  double uniform() {
+    return double(this->rng_() >> 11) / double(1ull << 53);
+  }
+
+  void step_mid() {
+    auto move = Price(this->next(2 * this->config_.walk + 1));
+    if (this->mid_ + move > this->config_.walk + this->config_.depth + 1) {
+      this->mid_ = this->mid_ + move - this->config_.walk;
+    }
+  }
+
+  Side random_side() {
+    return this->next(2) ? Side::Buy : Side::Sell;
+  }
+
+  Price passive_price(Side side) {
+    auto offset = Price(1 + this->next(this->config_.depth));
+    return is_buy(side) ? this->mid_ - offset : this->mid_ + offset;
+  }
+
+  Shares random_shares() {
+    return Shares(1 + this->next(100));
+  }
+
+  Command passive_add() {
+    auto side = this->random_side();
+    auto order_id = "o" + std::to_string(this->next_id_++);
+    this->live_.push_back(LiveOrder {order_id, side});
+    return Command {CommandType::Add, side, OrderType::GFD, this->passive_price(side), this->random_shares(), order_id};
+  }
+
+  Command crossing_add() {
+    auto side = this->random_side();
+    auto price = is_buy(side) ? this->mid_ + this->config_.depth : this->mid_ - this->config_.depth;
+    auto order_type = this->next(2) ? OrderType::GFD : OrderType::IOC;
+    auto order_id = "o" + std::to_string(this->next_id_++);
+    if (order_type == OrderType::GFD) this->live_.push_back(LiveOrder {order_id, side});
+    return Command {CommandType::Add, side, order_type, price, this->random_shares(), order_id};
+  }
+
+  // may hit an order that already traded away, the book ignores those
+  Command cancel() {
+    auto p = begin(this->live_) + this->next(this->live_.size());
+    Command cmd = {CommandType::Cancel, p->side, OrderType::GFD, 0, 0, p->order_id};
+    std::swap(*p, this->live_.back());
+    this->live_.pop_back();
+    return cmd;
+  }
+
+  Command modify() {
+    auto & order = this->live_[this->next(this->live_.size())];
+    return Command {CommandType::Modify, order.side, OrderType::GFD,
+      this->passive_price(order.side), this->random_shares(), order.order_id};
+  }
+
+  FlowConfig config_;
+  std::mt19937_64 rng_;
+  Price mid_;
+  uint64_t next_id_ = 0;
+  std::vector<LiveOrder> live_;
+};
+
+#ifdef __UNITTEST__
+TEST(OrderFlowGenerator, deterministic)
+{
+  FlowConfig config;
+  config.messages = 10000;
+  auto lhs = OrderFlowGenerator(config).generate();
+  auto rhs = OrderFlowGenerator(config).generate();
+  ASSERT_EQ(config.messages, lhs.size());
+  ASSERT_EQ(lhs.size(), rhs.size());
+  std::map<CommandType, size_t> kinds;
+  for (size_t i = 0; i < lhs.size(); i++) {
+    EXPECT_EQ(lhs[i].type, rhs[i].type);
+    EXPECT_EQ(lhs[i].order_id, rhs[i].order_id);
+    EXPECT_EQ(lhs[i].price, rhs[i].price);
+    EXPECT_EQ(lhs[i].shares, rhs[i].shares);
+    if (lhs[i].type != CommandType::Cancel) {
+      EXPECT_GT(lhs[i].price, 0);
+    }
+    kinds[lhs[i].type]++;
+  }
+  // rough mix of 0.55 adds (passive + cross), 0.3 cancels, 0.15 modifies
+  EXPECT_NEAR(0.55, double(kinds[CommandType::Add]) / lhs.size(), 0.03);
+  EXPECT_NEAR(0.3, double(kinds[CommandType::Cancel]) / lhs.size(), 0.03);
+  EXPECT_NEAR(0.15, double(kinds[CommandType::Modify]) / lhs.size(), 0.03);
+
+  config.seed = 7;
+  auto other = OrderFlowGenerator(config).generate();
+  size_t same = 0;
+  for (size_t i = 0; i < lhs.size(); i++) same += lhs[i].price == other[i].price;
+  EXPECT_LT(same, lhs.size());
+
+  // replaying the flow leaves a sane book
+  DepthBook book([](const SimpleOrder &, const SimpleOrder &, Shares) {});
+  for (auto & cmd : lhs) apply(book, cmd);
+  EXPECT_LT(book.top_of_bid().first, book.top_of_ask().first);
+}
+#endif
+
+
 class MessageHandler {
 public:
-  MessageHandler(DepthBook & book):
+  MessageHandler(DepthBook & book, BookStore * store = nullptr, std::ostream & out = std::cout):
     book_(book)
+    ,store_(store)
+    ,out_(out)
   {}
 
 
   void handle(const std::string & msg) {
+    Command cmd;
+    if (!parse(msg, cmd)) return;
+    if (cmd.type == CommandType::Print) {
+      handle_print_book();
+      return;
+    }
+    if (this->store_) this->store_->append(cmd);
+    apply(this->book_, cmd);
+    if (this->store_) this->store_->after_apply(this->book_);
+  }
+
+  // returns false for anything that isn't a valid command
+  static bool parse(const std::string & msg, Command & cmd) {
     std::istringstream iss(msg);
     std::string command;
     iss >> command;
     if (command == "BUY" or command == "SELL") {
-      handle_add_order(command[0], iss);
+      return parse_add_order(command[0], iss, cmd);
     }
     else if (command == "MODIFY")  {
-      handle_modify_order(iss);
+      return parse_modify_order(iss, cmd);
     }
     else if (command == "CANCEL") {
-      handle_cancel_order(iss);
+      return parse_cancel_order(iss, cmd);
     }
     else if (command == "PRINT") {
-      handle_print_book();
-    } else {
-      handle_other();
+      cmd.type = CommandType::Print;
+      return true;
     }
+    return false;
   }
 
 private:
-  void handle_add_order(char side, std::istringstream & iss) {
+  static bool parse_add_order(char side, std::istringstream & iss, Command & cmd) {
     std::string order_type;
     OrderId order_id;
     int price, shares;
     iss >> order_type >> price >> shares >> order_id;
-    if (price <= 0 or shares <= 0) return;
-    this->book_.add_order(order_id, static_cast<Side>(side), static_cast<OrderType>(order_type[0]), price, shares);
+    // market orders carry no price, e.g. BUY MKT 0 10 order1
+    bool market = order_type == "MKT";
+    if ((price <= 0 and !market) or price < 0 or shares <= 0 or order_id.empty()) return false;
+    cmd = Command {CommandType::Add, static_cast<Side>(side), static_cast<OrderType>(order_type[0]),
+      Price(price), Shares(shares), order_id};
+    return true;
   }
 
-  void handle_modify_order(std::istringstream & iss) {
+  static bool parse_modify_order(std::istringstream & iss, Command & cmd) {
     std::string order_id, side;
     int price, shares;
     iss >> order_id >> side >> price >> shares;
-    if (price <= 0 or shares <= 0) return;
-    this->book_.modify_order(order_id, static_cast<Side>(side[0]), price, shares);
+    if (price <= 0 or shares <= 0) return false;
+    cmd = Command {CommandType::Modify, static_cast<Side>(side[0]), OrderType::GFD,
+      Price(price), Shares(shares), order_id};
+    return true;
   }
 
-  void handle_cancel_order(std::istringstream & iss) {
+  static bool parse_cancel_order(std::istringstream & iss, Command & cmd) {
     std::string order_id;
     iss >> order_id;
-    this->book_.cancel_order(order_id);
+    if (order_id.empty()) return false;
+    cmd = Command {CommandType::Cancel, Side::Buy, OrderType::GFD, 0, 0, order_id};
+    return true;
   }
 
 
   void handle_print_book() {
-    std::cout << this->book_;
-  }
-
-
-  void handle_other() {
-    // no-ops
+    this->out_ << this->book_;
   }
 
 private:
   DepthBook & book_;
+  BookStore * store_;
+  std::ostream & out_;
 };
 
 #ifdef __UNITTEST__
@@ -570,6 +1930,24 @@ TEST(MessageHandler, basic)
   EXPECT_EQ(0, trades.size());
 
 
+  // market order
+  book.reset();
+  trades.clear();
+  handler.handle("SELL GFD 1000 10 order1");
+  handler.handle("BUY MKT 0 4 order2");
+  EXPECT_EQ(1, trades.size());
+  EXPECT_EQ(6, book.top_of_ask().second);
+  handler.handle("BUY GFD 0 4 order3");
+  EXPECT_EQ(0, book.depth_of_bid());
+
+  // fok and stop
+  handler.handle("BUY FOK 1000 7 order4");
+  EXPECT_EQ(1, trades.size());
+  handler.handle("SELL STOP 900 5 order5");
+  EXPECT_EQ(1, book.stop_orders());
+  handler.handle("CANCEL order5");
+  EXPECT_EQ(0, book.stop_orders());
+
   // test <0 price/shares and empty order id
   book.reset();
   trades.clear();
@@ -603,6 +1981,316 @@ TEST(MessageHandler, basic)
 }
 #endif
 
+#ifdef __BENCHMARK__
+using bench::seconds;
+
+// n resting orders, bids below 10000 and asks above, nothing crosses
+std::vector<std::string> make_resting_orders(size_t n) {
+  std::vector<std::string> lines;
+  lines.reserve(n);
+  srand(42);
+  for (size_t i = 0; i < n; i++) {
+    bool buy = rand() % 2;
+    int price = buy ? 10000 - 1 - rand() % 1000 : 10000 + rand() % 1000;
+    lines.push_back(std::string(buy ? "BUY" : "SELL") + " GFD " + std::to_string(price)
+        + " " + std::to_string(1 + rand() % 1000) + " order" + std::to_string(i));
+  }
+  return lines;
+}
+
+// time to rebuild an n order book from text, from the journal alone
+// and from a snapshot
+int bench_recovery(size_t n) {
+  auto no_trade = [](const SimpleOrder &, const SimpleOrder &, Shares) {};
+  auto lines = make_resting_orders(n);
+  const std::string dir = "./bench_store";
+  ::mkdir(dir.c_str(), 0755);
+  std::remove((dir + "/book.snapshot").c_str());
+  std::remove((dir + "/book.journal").c_str());
+
+  DepthBook book(no_trade);
+  double text_replay, journal_write, journal_replay, snapshot_write;
+  {
+    MessageHandler handler(book);
+    text_replay = seconds([&]() {
+      for (auto & line : lines) handler.handle(line);
+    });
+  }
+  {
+    DepthBook journaled(no_trade);
+    BookStore store(dir, 1024, std::numeric_limits<size_t>::max());
+    MessageHandler handler(journaled, &store);
+    journal_write = seconds([&]() {
+      for (auto & line : lines) handler.handle(line);
+      store.commit();
+    });
+  }
+
+  DepthBook from_journal(no_trade);
+  {
+    BookStore store(dir);
+    journal_replay = seconds([&]() { store.recover(from_journal); });
+    snapshot_write = seconds([&]() { store.snapshot(from_journal); });
+  }
+  DepthBook recovered(no_trade);
+  double snapshot_load = seconds([&]() {
+    BookStore store(dir);
+    store.recover(recovered);
+  });
+
+  std::ostringstream lhs, rhs;
+  lhs << book;
+  rhs << recovered;
+
+  std::cout << "orders," << n << std::endl
+            << "text_replay_s," << text_replay << std::endl
+            << "journal_write_s," << journal_write << std::endl
+            << "journal_replay_s," << journal_replay << std::endl
+            << "snapshot_write_s," << snapshot_write << std::endl
+            << "snapshot_load_s," << snapshot_load << std::endl
+            << "recovered_matches," << (lhs.str() == rhs.str()) << std::endl;
+
+  std::remove((dir + "/book.snapshot").c_str());
+  std::remove((dir + "/book.journal").c_str());
+  ::rmdir(dir.c_str());
+  return 0;
+}
+
+// size-down modify of n resting orders, amended in place against
+// the cancel/replace every modify used to go through
+int bench_amend(size_t n) {
+  auto no_trade = [](const SimpleOrder &, const SimpleOrder &, Shares) {};
+  std::vector<Command> orders;
+  std::mt19937_64 rng(42);
+  for (size_t i = 0; i < n; i++) {
+    bool buy = rng() % 2;
+    Price price = buy ? 10000 - 1 - rng() % 100 : 10000 + rng() % 100;
+    orders.push_back(Command {CommandType::Add, buy ? Side::Buy : Side::Sell, OrderType::GFD,
+      price, 100, "order" + std::to_string(i)});
+  }
+  DepthBook amended(no_trade), replaced(no_trade);
+  for (auto & cmd : orders) {
+    apply(amended, cmd);
+    apply(replaced, cmd);
+  }
+  std::shuffle(begin(orders), end(orders), rng);
+
+  double amend_s = seconds([&]() {
+    for (auto & cmd : orders) amended.modify_order(cmd.order_id, cmd.side, cmd.price, 50);
+  });
+  double replace_s = seconds([&]() {
+    for (auto & cmd : orders) {
+      replaced.cancel_order(cmd.order_id);
+      replaced.add_order(cmd.order_id, cmd.side, OrderType::GFD, cmd.price, 50);
+    }
+  });
+
+  std::cout << "orders," << n << std::endl
+            << "amend_in_place_ns," << amend_s * 1e9 / n << std::endl
+            << "cancel_replace_ns," << replace_s * 1e9 / n << std::endl;
+  return 0;
+}
+
+// splits key=value arguments
+std::map<std::string, std::string> parse_args(int argc, char * argv[], int first) {
+  std::map<std::string, std::string> args;
+  for (int i = first; i < argc; i++) {
+    std::string arg = argv[i];
+    auto eq = arg.find('=');
+    if (eq != std::string::npos) args[arg.substr(0, eq)] = arg.substr(eq + 1);
+  }
+  return args;
+}
+
+// generator settings from key=value arguments, defaults otherwise
+FlowConfig flow_config(const std::map<std::string, std::string> & args) {
+  FlowConfig config;
+  auto get = [&args](const char * key, double value) {
+    auto p = args.find(key);
+    return p == end(args) ? value : std::stod(p->second);
+  };
+  // counts and the seed in full, a double can't hold every 64 bit seed
+  auto get_int = [&args](const char * key, uint64_t value) {
+    auto p = args.find(key);
+    return p == end(args) ? value : uint64_t(std::stoull(p->second));
+  };
+  config.seed = get_int("seed", config.seed);
+  config.messages = get_int("messages", config.messages);
+  config.add = get("add", config.add);
+  config.cancel = get("cancel", config.cancel);
+  config.modify = get("modify", config.modify);
+  config.cross = get("cross", config.cross);
+  config.depth = Price(get_int("depth", config.depth));
+  config.walk = Price(get_int("walk", config.walk));
+  return config;
+}
+
+/*
+ * replays a generated flow against DepthBook twice: once straight
+ * through for throughput, once timing every message with bench::each
+ * (rdtsc, read overhead taken off) for the latency distribution.
+ * book_hash and trades change only if matching behaviour does
+ */
+int bench_replay(const std::map<std::string, std::string> & args) {
+  auto config = flow_config(args);
+  auto commands = OrderFlowGenerator(config).generate();
+
+  size_t trades = 0;
+  auto on_trade = [&trades](const SimpleOrder &, const SimpleOrder &, Shares) { trades++; };
+
+  DepthBook book(on_trade);
+  double elapsed = seconds([&]() {
+    for (auto & cmd : commands) apply(book, cmd);
+  });
+
+  bench::Stats latency;
+  {
+    DepthBook timed([](const SimpleOrder &, const SimpleOrder &, Shares) {});
+    latency = bench::each("apply", commands.size(), [&](size_t i) { apply(timed, commands[i]); }).ns;
+  }
+
+  std::ostringstream oss;
+  oss << book;
+
+  std::cout << "seed," << config.seed << std::endl
+            << "messages," << commands.size() << std::endl
+            << "msgs_per_sec," << uint64_t(commands.size() / elapsed) << std::endl
+            << "latency_p50_ns," << latency.p50 << std::endl
+            << "latency_p90_ns," << latency.p90 << std::endl
+            << "latency_p99_ns," << latency.p99 << std::endl
+            << "latency_p999_ns," << latency.p999 << std::endl
+            << "latency_max_ns," << latency.max << std::endl
+            << "trades," << trades << std::endl
+            << "bid_levels," << book.depth_of_bid() << std::endl
+            << "ask_levels," << book.depth_of_ask() << std::endl
+            << "book_hash," << std::hash<std::string>()(oss.str()) << std::endl;
+  return 0;
+}
+
+/*
+ * replays a generated flow through BatchMatcher at batch sizes 1, 16,
+ * 64 and 256. every publication formats its trades and top of book and
+ * writes them to /dev/null with one write(), the way a feed would go
+ * out, so batch 1 pays that per message
+ */
+int bench_batch(const std::map<std::string, std::string> & args) {
+  auto config = flow_config(args);
+  auto commands = OrderFlowGenerator(config).generate();
+
+  int fd = ::open("/dev/null", O_WRONLY);
+  if (fd < 0) return 1;
+  std::string out;
+  size_t publications = 0;
+  auto publish = [&](const BatchMatcher::Trades & trades, DepthBook::LevelInfo bid, DepthBook::LevelInfo ask) {
+    out.clear();
+    for (auto & t : trades) {
+      out += "TRADE " + t.resting_id + " " + std::to_string(t.resting_price) + " " + std::to_string(t.shares)
+        + " " + t.incoming_id + " " + std::to_string(t.incoming_price) + " " + std::to_string(t.shares) + "\n";
+    }
+    out += "TOP " + std::to_string(bid.first) + " " + std::to_string(bid.second)
+      + " " + std::to_string(ask.first) + " " + std::to_string(ask.second) + "\n";
+    if (::write(fd, out.data(), out.size()) < 0) return;
+    publications++;
+  };
+
+  std::cout << "seed," << config.seed << std::endl
+            << "messages," << commands.size() << std::endl;
+  std::string expected;
+  auto run = [&](size_t batch, const std::string & key) {
+    BatchMatcher matcher(publish);
+    publications = 0;
+    double elapsed = seconds([&]() {
+      for (size_t i = 0; i < commands.size(); i += batch) {
+        matcher.apply(commands.data() + i, std::min(batch, commands.size() - i));
+      }
+    });
+    std::ostringstream oss;
+    oss << matcher.book();
+    if (expected.empty()) expected = oss.str();
+    std::cout << key << "_msgs_per_sec," << uint64_t(commands.size() / elapsed) << std::endl
+              << key << "_publications," << publications << std::endl
+              << key << "_book_matches," << (oss.str() == expected) << std::endl;
+  };
+  for (size_t batch : {1, 16, 64, 256}) {
+    run(batch, "batch_" + std::to_string(batch));
+  }
+  ::close(fd);
+  return 0;
+}
+
+/*
+ * follows the top of book through a generated flow two ways: with the
+ * BBO callback, formatting a line per change, and by printing the book
+ * after every message and picking the best levels out of the dump, the
+ * only way before the callback. printing is slow enough on a deep book
+ * that it only runs over the first print=n messages. bbo_off replays
+ * with no callback set, what keeping the BBO current costs the book
+ */
+int bench_bbo(const std::map<std::string, std::string> & args) {
+  auto config = flow_config(args);
+  auto commands = OrderFlowGenerator(config).generate();
+  auto p = args.find("print");
+  size_t printed_messages = std::min(commands.size(), size_t(p == end(args) ? 100000 : std::stoul(p->second)));
+  auto no_trade = [](const SimpleOrder &, const SimpleOrder &, Shares) {};
+
+  DepthBook off(no_trade);
+  double off_s = seconds([&]() {
+    for (auto & cmd : commands) apply(off, cmd);
+  });
+
+  std::string out;
+  size_t changes = 0, printed_changes = 0;
+  DepthBook callback(no_trade);
+  callback.on_bbo([&](const DepthBook::BBO & bbo) {
+    out.clear();
+    out += "BBO " + std::to_string(bbo.bid.first) + " " + std::to_string(bbo.bid.second)
+      + " " + std::to_string(bbo.ask.first) + " " + std::to_string(bbo.ask.second) + "\n";
+    changes++;
+  });
+  double callback_s = seconds([&]() {
+    for (size_t i = 0; i < commands.size(); i++) {
+      if (i == printed_messages) printed_changes = changes;
+      apply(callback, commands[i]);
+    }
+  });
+  if (printed_messages == commands.size()) printed_changes = changes;
+
+  // the best ask is the line above BUY:, the best bid the one below
+  DepthBook printed(no_trade);
+  size_t print_changes = 0;
+  std::string last;
+  std::ostringstream oss;
+  double print_s = seconds([&]() {
+    for (size_t i = 0; i < printed_messages; i++) {
+      apply(printed, commands[i]);
+      oss.str("");
+      oss << printed;
+      auto dump = oss.str();
+      auto buy = dump.find("BUY:\n");
+      auto ask = dump.rfind('\n', buy - 2);
+      auto bid = dump.find('\n', buy + 5);
+      out.assign(dump, ask + 1, (bid == std::string::npos ? dump.size() : bid) - ask - 1);
+      if (out != last) {
+        last = out;
+        print_changes++;
+      }
+    }
+  });
+
+  std::cout << "seed," << config.seed << std::endl
+            << "messages," << commands.size() << std::endl
+            << "bbo_changes," << changes << std::endl
+            << "bid_levels," << callback.depth_of_bid() << std::endl
+            << "ask_levels," << callback.depth_of_ask() << std::endl
+            << "bbo_off_ns," << off_s * 1e9 / commands.size() << std::endl
+            << "bbo_callback_ns," << callback_s * 1e9 / commands.size() << std::endl
+            << "printed_messages," << printed_messages << std::endl
+            << "print_book_ns," << print_s * 1e9 / printed_messages << std::endl
+            << "changes_match," << (printed_changes == print_changes) << std::endl;
+  return 0;
+}
+#endif
+
 int main(int argc, char * argv[])
 {
 
@@ -611,21 +2299,90 @@ int main(int argc, char * argv[])
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
 
+#elif defined(__BENCHMARK__)
+
+  // main_bench [replay] [key=value ...]  e.g. seed=7 messages=1000000 cross=0.1
+  // main_bench recovery [orders]
+  // main_bench amend [orders]
+  // main_bench batch [key=value ...]
+  // main_bench bbo [key=value ...]
+  if (argc > 1 && std::string(argv[1]) == "recovery") {
+    return bench_recovery(argc > 2 ? std::stoul(argv[2]) : 1000000);
+  }
+  if (argc > 1 && std::string(argv[1]) == "amend") {
+    return bench_amend(argc > 2 ? std::stoul(argv[2]) : 1000000);
+  }
+  if (argc > 1 && std::string(argv[1]) == "batch") {
+    return bench_batch(parse_args(argc, argv, 2));
+  }
+  if (argc > 1 && std::string(argv[1]) == "bbo") {
+    return bench_bbo(parse_args(argc, argv, 2));
+  }
+  return bench_replay(parse_args(argc, argv, 1));
+
 #else
 
-  auto on_trade = [](const SimpleOrder & lhs, const SimpleOrder & rhs, Shares shares) {
-    std::cout << "TRADE " << lhs.order_id << " " << lhs.price << " " << shares
-         << " " << rhs.order_id << " " << rhs.price << " " << shares << std::endl;
+  // ./main -d <dir> keeps the book durable in dir and recovers
+  // from it on start up. ./main -b also prints the best bid and offer
+  // after every command that moves it, an empty side as 0 0
+  std::string dir;
+  bool print_bbo = false;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-d" && i + 1 < argc) {
+      dir = argv[++i];
+    } else if (arg == "-b") {
+      print_bbo = true;
+    }
+  }
+
+  // with a store, output is held back until the commands behind it
+  // are durable, so nothing is reported that a crash could take back
+  std::ostringstream held;
+  std::ostream & out = dir.empty() ? std::cout : held;
+
+  bool recovering = false;
+  auto on_trade = [&recovering, &out](const SimpleOrder & lhs, const SimpleOrder & rhs, Shares shares) {
+    if (recovering) return;
+    out << "TRADE " << lhs.order_id << " " << lhs.price << " " << shares
+         << " " << rhs.order_id << " " << reported_price(lhs, rhs) << " " << shares << std::endl;
   };
   DepthBook depth_book(on_trade);
-  MessageHandler handler(depth_book);
+  if (print_bbo) {
+    depth_book.on_bbo([&recovering, &out](const DepthBook::BBO & bbo) {
+      if (recovering) return;
+      out << "BBO " << (bbo.bid.second ? bbo.bid.first : 0) << " " << bbo.bid.second
+           << " " << (bbo.ask.second ? bbo.ask.first : 0) << " " << bbo.ask.second << std::endl;
+    });
+  }
 
+  std::unique_ptr<BookStore> store;
+  if (!dir.empty()) {
+    store.reset(new BookStore(dir));
+    recovering = true;
+    store->recover(depth_book);
+    recovering = false;
+  }
+  MessageHandler handler(depth_book, store.get(), out);
+
+  auto release = [&held]() {
+    std::cout << held.str() << std::flush;
+    held.str("");
+  };
 
   std::ios_base::sync_with_stdio(false);
   std::string line;
   while (getline(std::cin, line))
   {
     handler.handle(line);
+    if (!store) continue;
+    // a group isn't left waiting for commands that aren't coming
+    if (store->pending() && std::cin.rdbuf()->in_avail() <= 0) store->commit();
+    if (!store->pending()) release();
+  }
+  if (store) {
+    store->commit();
+    release();
   }
 
 
@@ -109,6 +109,12 @@ Include the amount of time you spent working on the solution.
 #include <map>
 #include <iterator>
 #include <list>
+#include <chrono>
+#include <tuple>
+#include <stdexcept>
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
 
 
 using Timestamp = uint64_t;
@@ -116,6 +122,7 @@ using Symbol = std::string;
 using Shares = uint64_t;
 using Volumes = uint64_t;
 using Price = uint64_t;
+using Notional = unsigned __int128;
 
 
 struct SymbolStats {
@@ -125,37 +132,100 @@ struct SymbolStats {
   Symbol symbol;
   Timestamp last_timestamp = 0;
   Timestamp max_time_gap = 0;
-  Shares volumes;
-  Price total_price;
+  Shares volumes = 0;
+  // sum of shares * price, 128 bit so a full day of a heavy symbol can't overflow
+  Notional total_price = 0;
   Price max_price = 0;
+  // set while the symbol is queued for the next snapshot
+  bool changed = false;
 
 
   Price average_price() const {
-    return volumes > 0 ? total_price / volumes : total_price;
+    return volumes > 0 ? Price(total_price / volumes) : Price(total_price);
   }
 
+  // price is always > 0, so a zero max price means no trade yet
+  bool traded() const {
+    return max_price > 0;
+  }
 
 };
 
 class SymbolBook {
 public:
-  using SymbolMap = std::unordered_map<Symbol, SymbolStats>;
-  using SymbolOrderMap = std::set<Symbol>;
+  using SymbolIndex = size_t;
+  using SymbolMap = std::unordered_map<Symbol, SymbolIndex>;
+  using SymbolOrderMap = std::map<Symbol, SymbolIndex>;
+
+  // dense index of symbol, registered on first use
+  SymbolIndex index_of(const Symbol & symbol) {
+    auto p = map_.find(symbol);
+    if (p != end(map_)) return p->second;
+    SymbolIndex index = stats_.size();
+    stats_.push_back(SymbolStats {symbol});
+    map_.emplace(symbol, index);
+    ordered_map_.emplace(symbol, index);
+    return index;
+  }
 
   void add(Timestamp timestamp, Symbol symbol, Shares shares, Price price) {
-    if (!map_.count(symbol)) {
-      ordered_map_.insert(symbol);
-      map_[symbol] = SymbolStats {symbol, timestamp, 0, shares, shares * price, price};
-    } else {
-      auto & report = map_[symbol];
-      report.max_time_gap = std::max(report.max_time_gap, timestamp - report.last_timestamp);
+    auto & report = stats_[this->index_of(symbol)];
+    if (!report.traded()) {
       report.last_timestamp = timestamp;
-      report.volumes += shares;
-      report.total_price += shares * price;
-      report.max_price = std::max(report.max_price, price);
+    }
+    report.max_time_gap = std::max(report.max_time_gap, timestamp - report.last_timestamp);
+    report.last_timestamp = timestamp;
+    report.volumes += shares;
+    report.total_price += Notional(shares) * price;
+    report.max_price = std::max(report.max_price, price);
+    this->mark_changed(report);
+  }
+
+  /**
+   * applies n trades given as parallel arrays. the batch must be sorted
+   * by symbol index, stable so each symbol keeps its timestamp order.
+   * every run of one symbol is folded with separate straight loops,
+   * so volume, max price and max gap vectorize; the 128 bit notional
+   * is the only scalar loop
+   */
+  void add_batch(const SymbolIndex * symbols, const Timestamp * timestamps,
+      const Shares * shares, const Price * prices, size_t n) {
+    size_t b = 0;
+    while (b < n) {
+      size_t e = b + 1;
+      while (e < n && symbols[e] == symbols[b]) e++;
+
+      auto & report = stats_[symbols[b]];
+      Timestamp first_gap = report.traded() ? timestamps[b] - report.last_timestamp : 0;
+      report.max_time_gap = std::max({report.max_time_gap, first_gap, max_gap(timestamps + b, e - b)});
+      report.last_timestamp = timestamps[e - 1];
+      report.volumes += sum(shares + b, e - b);
+      report.total_price += notional(shares + b, prices + b, e - b);
+      report.max_price = std::max(report.max_price, max(prices + b, e - b));
+      this->mark_changed(report);
+
+      b = e;
     }
   }
 
+
+  // returns stats of the symbols updated since the last call,
+  // sorted by symbol. cost is O(k log k) for k changed symbols
+  std::vector<SymbolStats> take_changes() {
+    std::vector<SymbolStats> res;
+    res.reserve(changed_.size());
+    for (auto index : changed_) {
+      stats_[index].changed = false;
+      res.push_back(stats_[index]);
+    }
+    changed_.clear();
+    std::sort(std::begin(res), std::end(res),
+        [](const SymbolStats & lhs, const SymbolStats & rhs) {
+          return lhs.symbol < rhs.symbol;
+        });
+    return res;
+  }
+
   friend std::ostream & operator<<(std::ostream &, const SymbolBook &);
 
 
@@ -163,28 +233,122 @@ public:
   std::vector<SymbolStats> dump() const {
     std::vector<SymbolStats> res;
     for (auto p = std::begin(ordered_map_); p != std::end(ordered_map_); p++) {
-      res.push_back(map_[*p]);
+      res.push_back(stats_[p->second]);
     }
     return res;
   }
 
 private:
-  mutable SymbolMap map_;
+  static Shares sum(const Shares * shares, size_t n) {
+    Shares res = 0;
+    for (size_t i = 0; i < n; i++) res += shares[i];
+    return res;
+  }
+
+  static Price max(const Price * prices, size_t n) {
+    Price res = 0;
+    for (size_t i = 0; i < n; i++) res = std::max(res, prices[i]);
+    return res;
+  }
+
+  // largest gap between consecutive timestamps within the run
+  static Timestamp max_gap(const Timestamp * timestamps, size_t n) {
+    Timestamp res = 0;
+    for (size_t i = 1; i < n; i++) res = std::max(res, timestamps[i] - timestamps[i - 1]);
+    return res;
+  }
+
+  static Notional notional(const Shares * shares, const Price * prices, size_t n) {
+    Notional res = 0;
+    for (size_t i = 0; i < n; i++) res += Notional(shares[i]) * prices[i];
+    return res;
+  }
+
+  void mark_changed(SymbolStats & report) {
+    if (!report.changed) {
+      report.changed = true;
+      changed_.push_back(&report - stats_.data());
+    }
+  }
+
+  std::vector<SymbolStats> stats_;
+  SymbolMap map_;
   SymbolOrderMap ordered_map_;
+  std::vector<SymbolIndex> changed_;
 };
 
+std::ostream & operator<< (std::ostream & os, const SymbolStats & report) {
+  os << report.symbol << ","
+     << report.max_time_gap << ","
+     << report.volumes << ","
+     << report.average_price() << ","
+     << report.max_price << std::endl;
+  return os;
+}
+
 std::ostream & operator<< (std::ostream & os, const SymbolBook & book) {
   std::vector<SymbolStats> dump = book.dump();
   for (auto & report : dump) {
-    os << report.symbol << ","
-       << report.max_time_gap << ","
-       << report.volumes << ","
-       << report.average_price() << ","
-       << report.max_price << std::endl;
+    os << report;
   }
   return os;
 }
 
+
+/*
+ * follow mode: every interval, writes the rows changed since the
+ * previous delta to ./output.delta.<seq>.csv, so a consumer tailing
+ * a live feed can patch its own copy of output.csv
+ */
+class DeltaWriter {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  DeltaWriter(SymbolBook & book, std::chrono::milliseconds interval)
+    :book_(book)
+    ,interval_(interval)
+    ,last_flush_(Clock::now())
+  {}
+
+  // cheap enough to call after every message
+  void poll() {
+    auto now = Clock::now();
+    if (now - last_flush_ >= interval_) {
+      this->flush();
+      last_flush_ = now;
+    }
+  }
+
+  // how long until the next poll() has a delta to write
+  std::chrono::milliseconds timeout() const {
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(last_flush_ + interval_ - Clock::now());
+    return std::max(left, std::chrono::milliseconds(0));
+  }
+
+  // returns number of rows written
+  size_t flush() {
+    auto changes = book_.take_changes();
+    if (changes.empty()) return 0;
+    std::ofstream ofs(this->next_file_name());
+    for (auto & report : changes) {
+      ofs << report;
+    }
+    return changes.size();
+  }
+
+private:
+  std::string next_file_name() {
+    std::ostringstream oss;
+    oss << "./output.delta." << std::setw(6) << std::setfill('0') << seq_++ << ".csv";
+    return oss.str();
+  }
+
+  SymbolBook & book_;
+  std::chrono::milliseconds interval_;
+  Clock::time_point last_flush_;
+  size_t seq_ = 0;
+};
+
 template<class T>
 class MessageHandler {
 public:
@@ -251,6 +415,104 @@ TEST(MessageHandler, basic)
 
 }
 
+TEST(SymbolBook, take_changes)
+{
+  SymbolBook book;
+  EXPECT_TRUE(book.take_changes().empty());
+
+  book.add(1, "aac", 10, 100);
+  book.add(2, "aaa", 10, 100);
+  book.add(3, "aac", 10, 200);
+
+  // every symbol reported once, in symbol order
+  auto changes = book.take_changes();
+  EXPECT_EQ(2, changes.size());
+  EXPECT_EQ("aaa", changes[0].symbol);
+  EXPECT_EQ("aac", changes[1].symbol);
+  EXPECT_EQ(20, changes[1].volumes);
+  EXPECT_EQ(150, changes[1].average_price());
+
+  // nothing changed since the last snapshot
+  EXPECT_TRUE(book.take_changes().empty());
+
+  book.add(5, "aab", 1, 10);
+  book.add(6, "aac", 10, 300);
+  changes = book.take_changes();
+  EXPECT_EQ(2, changes.size());
+  EXPECT_EQ("aab", changes[0].symbol);
+  EXPECT_EQ("aac", changes[1].symbol);
+  EXPECT_EQ(30, changes[1].volumes);
+  EXPECT_EQ(3, changes[1].max_time_gap);
+
+  // full report is not affected by snapshots
+  EXPECT_EQ(3, book.dump().size());
+}
+
+TEST(SymbolBook, no_overflow)
+{
+  SymbolBook book;
+  Shares shares = 1ull << 32;
+  Price price = 1ull << 33;
+
+  // each trade alone is 2^65 in notional
+  book.add(1, "aaa", shares, price);
+  book.add(2, "aaa", shares, price + 3);
+  auto reports = book.dump();
+  EXPECT_EQ(2 * shares, reports[0].volumes);
+  // (2^65 + 2^65 + 3 * 2^32) / 2^33 = 2^33 + 1.5, truncated
+  EXPECT_EQ(price + 1, reports[0].average_price());
+  EXPECT_EQ(price + 3, reports[0].max_price);
+}
+
+TEST(SymbolBook, add_batch)
+{
+  std::vector<std::tuple<Timestamp, Symbol, Shares, Price>> trades = {
+    {52924702, "aaa", 13, 1136},
+    {52924702, "aac", 20, 477},
+    {52925641, "aab", 31, 907},
+    {52927350, "aab", 29, 724},
+    {52927783, "aac", 21, 638},
+    {52930489, "aaa", 18, 1222},
+    {52931654, "aaa", 9, 1077},
+    {52933453, "aab", 9, 756},
+  };
+
+  SymbolBook expected, book;
+  for (auto & t : trades) {
+    expected.add(std::get<0>(t), std::get<1>(t), std::get<2>(t), std::get<3>(t));
+  }
+
+  // split in two batches, so the second continues runs of the first
+  for (auto batch : {std::make_pair(0, 5), std::make_pair(5, 8)}) {
+    std::vector<std::pair<SymbolBook::SymbolIndex, size_t>> order;
+    for (int i = batch.first; i < batch.second; i++) {
+      order.emplace_back(book.index_of(std::get<1>(trades[i])), i);
+    }
+    std::stable_sort(std::begin(order), std::end(order),
+        [](const std::pair<size_t, size_t> & lhs, const std::pair<size_t, size_t> & rhs) {
+          return lhs.first < rhs.first;
+        });
+
+    std::vector<SymbolBook::SymbolIndex> symbols;
+    std::vector<Timestamp> timestamps;
+    std::vector<Shares> shares;
+    std::vector<Price> prices;
+    for (auto & o : order) {
+      symbols.push_back(o.first);
+      timestamps.push_back(std::get<0>(trades[o.second]));
+      shares.push_back(std::get<2>(trades[o.second]));
+      prices.push_back(std::get<3>(trades[o.second]));
+    }
+    book.add_batch(symbols.data(), timestamps.data(), shares.data(), prices.data(), symbols.size());
+  }
+
+  std::ostringstream lhs, rhs;
+  lhs << expected;
+  rhs << book;
+  EXPECT_EQ(lhs.str(), rhs.str());
+  EXPECT_EQ(3, book.take_changes().size());
+}
+
 #endif
 
 int main(int argc, char * argv[])
@@ -266,12 +528,57 @@ int main(int argc, char * argv[])
   SymbolBook symbol_book;
   MessageHandler<SymbolBook> handler(symbol_book);
 
+  // ./main -f <interval ms> turns on follow mode
+  std::unique_ptr<DeltaWriter> delta_writer;
+  if (argc > 2 && std::string(argv[1]) == "-f") {
+    // a 0 interval would make poll() return at once and spin
+    std::string interval = argv[2];
+    size_t used = 0;
+    int ms = 0;
+    try {
+      ms = std::stoi(interval, &used);
+    } catch (const std::logic_error &) {
+    }
+    if (used != interval.size() || ms <= 0) {
+      std::cerr << "usage: ./main [-f <interval ms, at least 1>] < input" << std::endl;
+      return 1;
+    }
+    delta_writer.reset(new DeltaWriter(symbol_book, std::chrono::milliseconds(ms)));
+  }
+
 
   std::ios_base::sync_with_stdio(false);
-  std::string line;
-  while (getline(std::cin, line))
-  {
-    handler.handle(line);
+  if (delta_writer) {
+    // reads stdin itself instead of through cin and waits for it with
+    // poll(2), so a quiet feed still wakes up to write its deltas
+    std::string buf;
+    char chunk[1 << 16];
+    pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    for (;;) {
+      int ready = ::poll(&pfd, 1, int(delta_writer->timeout().count()));
+      if (ready < 0 && errno != EINTR) break;
+      if (ready > 0) {
+        ssize_t n = ::read(STDIN_FILENO, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        buf.append(chunk, n);
+        size_t begin = 0, eol;
+        while ((eol = buf.find('\n', begin)) != std::string::npos) {
+          handler.handle(buf.substr(begin, eol - begin));
+          begin = eol + 1;
+        }
+        buf.erase(0, begin);
+      }
+      delta_writer->poll();
+    }
+    if (!buf.empty()) handler.handle(buf);
+    delta_writer->flush();
+  } else {
+    std::string line;
+    while (getline(std::cin, line))
+    {
+      handler.handle(line);
+    }
   }
 
   std::ofstream ofs("./output.csv");
@@ -9,6 +9,18 @@
   ./main < /path/to/your/input/file
 
 
+  ./main_bench [number of messages] runs the benchmarks on a
+  synthetic script, --json for json output and --filter=name to
+  pick some of them (see common/bench.h)
+
+  ./main_bench arena [orders] compares the book's nodes on the heap
+  and in an arena (common/arena.h), with and without huge pages
+
+  ./main -l2 /dev/shm/book.l2 10 1000 < ./script.txt
+  also publishes level 2 updates, plus a top 10 snapshot every
+  1000 messages, to /dev/shm/book.l2 (record layout in namespace l2)
+
+
   2. Output for each sample input
 >./main < ./script.txt
 45.2
@@ -36,8 +48,6 @@
 
    4. TODOs
     * stringstream is a bad idea for parsing input, need to get rid of it
-    * provide a MicroDollar(or NanoDollar) class for price and a constructor
-      to take double price
     * accessing price level is still O(logn) which is suboptimal, so the assumptio      is price level is not huge, i haven't quite figured out a better way yet
  */
 
@@ -45,6 +55,10 @@
 #include <gtest/gtest.h>
 #endif
 
+#ifdef __BENCHMARK__
+#include "../common/bench.h"
+#endif
+
 
 #include <set>
 #include <functional>
@@ -62,6 +76,12 @@
 #include <iterator>
 #include <chrono>
 #include <list>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+#include "../common/book.h"
+#include "../common/arena.h"
 
 
 namespace spec
@@ -78,11 +98,130 @@ namespace spec
 }
 
 using OrderId = int;
-using Price = double;
 using MicroDollars = uint64_t;
 using Shares = uint32_t;
 using Side = char;
 
+constexpr MicroDollars MICROS_PER_DOLLAR = 1000000;
+constexpr int MICRO_DIGITS = 6;
+
+
+/*
+ * decimal fixed point price parsing/formatting, no floating point
+ * involved so "45.2" is exactly 45200000 micro dollars
+ */
+namespace price {
+
+  // parses [digits][.digits] from [start, end), digits beyond
+  // the 6th decimal are truncated. returns false on malformed input
+  inline bool parse(const char * start, const char * end, MicroDollars & res) {
+    MicroDollars dollars = 0, micros = 0;
+    bool has_digit = false;
+    while (start != end && *start >= '0' && *start <= '9') {
+      dollars = dollars * 10 + (*start++ - '0');
+      has_digit = true;
+    }
+    int scale = MICRO_DIGITS;
+    if (start != end && *start == '.') {
+      start++;
+      while (start != end && *start >= '0' && *start <= '9') {
+        if (scale > 0) {
+          micros = micros * 10 + (*start - '0');
+          scale--;
+        }
+        start++;
+        has_digit = true;
+      }
+    }
+    while (scale--) micros *= 10;
+    res = dollars * MICROS_PER_DOLLAR + micros;
+    return has_digit && start == end;
+  }
+
+  inline bool parse(const std::string & s, MicroDollars & res) {
+    return parse(s.data(), s.data() + s.size(), res);
+  }
+
+  // writes price without trailing fractional zeros, e.g. 45.2 or 50
+  // into buf (at least 28 chars), returns the number of chars written
+  inline size_t format(MicroDollars price, char * buf) {
+    char tmp[20];
+    size_t n = 0;
+    MicroDollars dollars = price / MICROS_PER_DOLLAR;
+    do {
+      tmp[n++] = '0' + dollars % 10;
+      dollars /= 10;
+    } while (dollars);
+    size_t len = 0;
+    while (n) buf[len++] = tmp[--n];
+
+    MicroDollars micros = price % MICROS_PER_DOLLAR;
+    if (micros) {
+      int digits = MICRO_DIGITS;
+      while (micros % 10 == 0) {
+        micros /= 10;
+        digits--;
+      }
+      buf[len++] = '.';
+      for (int i = digits - 1; i >= 0; i--) {
+        buf[len + i] = '0' + micros % 10;
+        micros /= 10;
+      }
+      len += digits;
+    }
+    return len;
+  }
+
+  inline std::string format(MicroDollars price) {
+    char buf[32];
+    return std::string(buf, format(price, buf));
+  }
+}
+
+#ifdef __UNITTEST__
+TEST(price, parse)
+{
+  MicroDollars res = 0;
+  EXPECT_TRUE(price::parse("45.2", res));
+  EXPECT_EQ(45200000, res);
+  EXPECT_TRUE(price::parse("50", res));
+  EXPECT_EQ(50000000, res);
+  EXPECT_TRUE(price::parse("0.000001", res));
+  EXPECT_EQ(1, res);
+  EXPECT_TRUE(price::parse(".5", res));
+  EXPECT_EQ(500000, res);
+  EXPECT_TRUE(price::parse("12.", res));
+  EXPECT_EQ(12000000, res);
+  // beyond micro dollars is truncated
+  EXPECT_TRUE(price::parse("1.23456789", res));
+  EXPECT_EQ(1234567, res);
+  // doubles can't do this one exactly
+  EXPECT_TRUE(price::parse("4503599627.370497", res));
+  EXPECT_EQ(4503599627370497, res);
+
+  EXPECT_FALSE(price::parse("", res));
+  EXPECT_FALSE(price::parse(".", res));
+  EXPECT_FALSE(price::parse("-1", res));
+  EXPECT_FALSE(price::parse("1.2x", res));
+}
+
+TEST(price, format)
+{
+  EXPECT_EQ("45.2", price::format(45200000));
+  EXPECT_EQ("50", price::format(50000000));
+  EXPECT_EQ("0", price::format(0));
+  EXPECT_EQ("0.000001", price::format(1));
+  EXPECT_EQ("1.05", price::format(1050000));
+  EXPECT_EQ("18446744073709.551615", price::format(std::numeric_limits<MicroDollars>::max()));
+
+  for (auto s : {"37.8", "24.7", "0.1", "100.000101"}) {
+    MicroDollars p;
+    price::parse(s, p);
+    EXPECT_EQ(s, price::format(p));
+  }
+}
+#endif
+
 
 constexpr bool
 is_buy(Side s)
@@ -127,196 +266,392 @@ struct SimpleOrder {
 };
 
 
-struct PriceLevel {
-  int total_shares = 0;
+using LevelAction = book::LevelAction;
 
-  using OrderList = std::list<SimpleOrder>;
-  using OrderMap = std::unordered_map<OrderId, OrderList::iterator>;
-
-  void add(SimpleOrder order) {
-    orders_.push_back(order);
-    orders_map_[order.order_id] = std::prev(end(orders_));
-    this->total_shares += order.shares;
-  }
-
-  void modify(OrderId order_id, Shares new_shares) {
-    if (this->orders_map_.count(order_id)) {
-      auto p = this->orders_map_[order_id];
-      this->total_shares -= p->shares;
-      p->shares = new_shares;
-      this->total_shares += p->shares;
-    }
-  }
-
-  void remove(OrderId order_id) {
-    if (this->orders_map_.count(order_id)) {
-      auto p = this->orders_map_[order_id];
-      this->total_shares -= p->shares;
-      this->orders_.erase(p);
-      this->orders_map_.erase(order_id);
-    }
-  }
-
-  bool empty() const {
-    return this->orders_.empty();
-  }
-
-private:
-  OrderList orders_;
-  OrderMap orders_map_;
+// incremental level 2 update, shares is the level aggregate
+// after the update (0 on delete)
+struct LevelUpdate {
+  uint64_t seq;
+  Side side;
+  LevelAction action;
+  MicroDollars price;
+  Shares shares;
 };
 
+using OnLevelUpdateHandler = std::function<void(const LevelUpdate &)>;
 
+
+/*
+ * the shared level book (common/book.h) with level 2 sequencing
+ * on top
+ */
 class OrderBook {
 public:
-  using LevelInfo = std::pair<Price, Shares>;
-
-  void add(OrderId order_id, Side side, Price order_price, Shares shares) {
-    MicroDollars price = order_price * 1000000;
-    SimpleOrder order(order_id, side, price, shares);
-    if (!order.done()) {
-      if (is_buy(side))
-        bid_levels_[price].add(order);
-      else
-        ask_levels_[price].add(order);
-      this->order_to_price_level_map_[order_id] = std::make_pair(order.side, order.price);
+  using LevelInfo = std::pair<MicroDollars, Shares>;
+
+  // what common/book.h is instantiated with
+  struct Traits {
+    using OrderId = ::OrderId;
+    using Price = MicroDollars;
+    using Shares = ::Shares;
+    using Side = ::Side;
+
+    static bool is_buy(Side s) {
+      return ::is_buy(s);
     }
+  };
+
+  // top n levels of both sides, seq is that of the last update
+  // reflected so a consumer can line it up with the update stream
+  struct Snapshot {
+    uint64_t seq = 0;
+    std::vector<LevelInfo> bids;
+    std::vector<LevelInfo> asks;
+  };
+
+  OrderBook(OnLevelUpdateHandler handler = nullptr)
+    :book_(Publisher {this}, arena::Allocator<SimpleOrder>(region_))
+    ,on_level_update_handler_(handler) {}
+
+  // the book's listener points back here
+  OrderBook(const OrderBook &) = delete;
+  OrderBook & operator=(const OrderBook &) = delete;
+
+  // a duplicate order id is ignored
+  void add(OrderId order_id, Side side, MicroDollars price, Shares shares) {
+    this->book_.add(SimpleOrder(order_id, side, price, shares));
   }
 
   void modify(OrderId order_id, Shares new_shares) {
-    if (new_shares == 0) this->remove(order_id);
-    if (this->exists(order_id)) {
-      auto v = this->order_to_price_level_map_[order_id];
-      auto side = v.first;
-      auto price = v.second;
-      if (is_buy(side)) {
-        if (this->bid_levels_.count(price)) {
-          this->bid_levels_[price].modify(order_id, new_shares);
-        }
-      } else {
-        if (this->ask_levels_.count(price)) {
-          this->ask_levels_[price].modify(order_id, new_shares);
-        }
-      }
-    }
+    this->book_.modify(order_id, new_shares);
   }
 
-
-  double get_price(char side, int level) {
+  MicroDollars get_price(char side, int level) {
     if (is_buy(side)) {
-      double res = double(this->level_of_bid(level - 1).first) / 1000000;
-      return res;
+      return this->book_.level_of_bid(level - 1).first;
     } else {
-      double res = double(this->level_of_ask(level - 1).first) / 1000000;
-      return res;
+      return this->book_.level_of_ask(level - 1).first;
     }
   }
 
   int get_size(char side, int level) {
     if (is_buy(side)) {
-      return this->level_of_bid(level - 1).second;
+      return this->book_.level_of_bid(level - 1).second;
     } else {
-      return this->level_of_ask(level - 1).second;
+      return this->book_.level_of_ask(level - 1).second;
     }
 
   }
 
   bool exists(OrderId order_id) {
-    return this->order_to_price_level_map_.count(order_id);
+    return this->book_.exists(order_id);
   }
 
   void remove(OrderId order_id) {
-    if (this->exists(order_id)) {
-      auto v = this->order_to_price_level_map_[order_id];
-      auto side = v.first;
-      auto price = v.second;
-      if (is_buy(side)) {
-        if (this->bid_levels_.count(price)) {
-          this->bid_levels_[price].remove(order_id);
-          if (this->bid_levels_[price].empty()) {
-            this->bid_levels_.erase(price);
-          }
+    this->book_.remove(order_id);
+  }
 
-        }
-      } else {
-        if (this->ask_levels_.count(price)) {
-          this->ask_levels_[price].remove(order_id);
-          if (this->ask_levels_[price].empty()) {
-            this->ask_levels_.erase(price);
-          }
 
-        }
-      }
-      this->order_to_price_level_map_.erase(order_id);
+  Snapshot snapshot(size_t depth) const {
+    Snapshot res;
+    res.seq = this->seq_;
+    for (auto p = begin(this->book_.bids()); p != end(this->book_.bids()) && res.bids.size() < depth; p++) {
+      res.bids.emplace_back(p->first, p->second.total_shares);
+    }
+    for (auto p = begin(this->book_.asks()); p != end(this->book_.asks()) && res.asks.size() < depth; p++) {
+      res.asks.emplace_back(p->first, p->second.total_shares);
     }
+    return res;
   }
 
 
   // unit test purpose
   void reset() {
-    this->ask_levels_.clear();
-    this->bid_levels_.clear();
-    this->order_to_price_level_map_.clear();
+    this->book_.clear();
   }
 
 private:
 
-  // index starts with 0
-  LevelInfo level_of_bid(size_t index) const {
-    if (index >= this->bid_levels_.size()) {
-      return std::make_pair(std::numeric_limits<Price>::min(), 0);
+  struct Publisher {
+    OrderBook * book;
+
+    void operator()(Side side, LevelAction action, MicroDollars price, Shares shares) const {
+      book->publish(side, action, price, shares);
     }
-    auto p = begin(this->bid_levels_);
-    while (index) {
-      p = next(p);
-      index--;
-    };
-    return std::make_pair(p->first, p->second.total_shares);
-  }
-
-  // index starts with 0
-  LevelInfo level_of_ask(size_t index) const {
-    if (index >= this->ask_levels_.size()) {
-      return std::make_pair(std::numeric_limits<Price>::max(), 0);
+  };
+
+  void publish(Side side, LevelAction action, MicroDollars price, Shares shares) {
+    ++this->seq_;
+    if (this->on_level_update_handler_) {
+      this->on_level_update_handler_(LevelUpdate {this->seq_, side, action, price, shares});
     }
-    auto p = begin(this->ask_levels_);
-    while (index) {
-      p = next(p);
-      index--;
-    };
-    return std::make_pair(p->first, p->second.total_shares);
   }
 
-  size_t depth_of_bid() const {
-    return this->bid_levels_.size();
+  // the book's levels, queue nodes and index nodes, packed together
+  // rather than spread over the heap; declared first so it outlives them
+  arena::Region region_;
+
+  // price levels plus an order id index, so cancel/modify is a
+  // single hash probe
+  book::Book<Traits, SimpleOrder, Publisher, arena::Allocator<SimpleOrder>> book_;
+
+  // level 2 update sequence and callback
+  uint64_t seq_ = 0;
+  OnLevelUpdateHandler on_level_update_handler_;
+};
+
+#ifdef __UNITTEST__
+TEST(OrderBook, level_updates)
+{
+  std::vector<LevelUpdate> updates;
+  OrderBook book([&updates](const LevelUpdate & u) { updates.push_back(u); });
+
+  auto expect_update = [&updates](uint64_t seq, Side side, LevelAction action, MicroDollars price, Shares shares) {
+    ASSERT_LE(seq, updates.size());
+    auto & u = updates[seq - 1];
+    EXPECT_EQ(seq, u.seq);
+    EXPECT_EQ(side, u.side);
+    EXPECT_EQ(action, u.action);
+    EXPECT_EQ(price, u.price);
+    EXPECT_EQ(shares, u.shares);
+  };
+
+  book.add(1, 'B', 45200000, 100);
+  expect_update(1, 'B', LevelAction::Add, 45200000, 100);
+  book.add(2, 'B', 45200000, 50);
+  expect_update(2, 'B', LevelAction::Change, 45200000, 150);
+  book.add(3, 'S', 51400000, 200);
+  expect_update(3, 'S', LevelAction::Add, 51400000, 200);
+  book.modify(1, 30);
+  expect_update(4, 'B', LevelAction::Change, 45200000, 80);
+  // no change, no update
+  book.modify(1, 30);
+  EXPECT_EQ(4, updates.size());
+  book.remove(2);
+  expect_update(5, 'B', LevelAction::Change, 45200000, 30);
+  book.modify(1, 0);
+  expect_update(6, 'B', LevelAction::Delete, 45200000, 0);
+  // unknown order publishes nothing
+  book.remove(42);
+  EXPECT_EQ(6, updates.size());
+
+  book.add(4, 'S', 51200000, 300);
+  book.add(5, 'S', 51300000, 100);
+  // duplicate id is ignored
+  book.add(5, 'B', 45000000, 100);
+  EXPECT_EQ(8, updates.size());
+  auto snapshot = book.snapshot(2);
+  EXPECT_EQ(8, snapshot.seq);
+  EXPECT_TRUE(snapshot.bids.empty());
+  EXPECT_EQ((std::vector<OrderBook::LevelInfo>{{51200000, 300}, {51300000, 100}}), snapshot.asks);
+}
+
+TEST(OrderBook, shared_book)
+{
+  struct Traits {
+    using OrderId = int;
+    using Price = int;
+    using Shares = int;
+    using Side = char;
+    static bool is_buy(char s) { return s == 'B'; }
+  };
+  book::Book<Traits> b;
+  EXPECT_TRUE(b.add({1, 'B', 100, 10}));
+  EXPECT_TRUE(b.add({2, 'B', 100, 20}));
+  EXPECT_TRUE(b.add({3, 'S', 101, 5}));
+  EXPECT_FALSE(b.add({3, 'S', 102, 5}));
+  EXPECT_FALSE(b.add({4, 'S', 102, 0}));
+  EXPECT_EQ(3, b.size());
+
+  // executions and partial cancels take shares off, the order
+  // leaves once nothing is left
+  EXPECT_TRUE(b.reduce(1, 4));
+  EXPECT_EQ(6, b.find(1)->shares);
+  EXPECT_EQ((std::make_pair(100, 26)), b.level_of_bid(0));
+  EXPECT_TRUE(b.reduce(1, 6));
+  EXPECT_EQ(nullptr, b.find(1));
+  EXPECT_FALSE(b.reduce(1, 1));
+
+  // the order keeps its place in the queue
+  EXPECT_TRUE(b.add({5, 'B', 100, 1}));
+  EXPECT_TRUE(b.modify(2, 50));
+  EXPECT_EQ(2, b.bids().begin()->second.orders().front().order_id);
+  EXPECT_EQ(1, b.depth_of_bid());
+  EXPECT_EQ((std::make_pair(std::numeric_limits<int>::max(), 0)), b.level_of_ask(1));
+}
+
+TEST(OrderBook, arena_reuse)
+{
+  using Alloc = arena::Allocator<std::pair<const int, int>>;
+  using Map = std::unordered_map<int, int, std::hash<int>, std::equal_to<int>, Alloc>;
+  arena::Region region(2 << 20, arena::Pages::normal);
+  size_t mapped = 0;
+  // the nodes and every bucket array a table drops as it grows go to
+  // the next table, so filling one again maps nothing new
+  for (int round = 0; round < 10; round++) {
+    Map m(0, std::hash<int>(), std::equal_to<int>(), Alloc(region));
+    for (int i = 0; i < 100000; i++) m[i] = i;
+    if (round == 0) mapped = region.mapped();
+    EXPECT_EQ(mapped, region.mapped());
   }
+}
+#endif
+
+
+/*
+ * level 2 wire format: fixed size little endian records, each starting
+ * with a one byte type. a snapshot header is followed by bid_depth and
+ * then ask_depth level records, best first
+ */
+namespace l2 {
+  constexpr char UPDATE = 'U';
+  constexpr char SNAPSHOT = 'S';
+
+  struct __attribute__((packed)) Update {
+    char type;
+    uint64_t seq;
+    char side;
+    char action;
+    uint64_t price;
+    uint32_t shares;
+  };
+
+  struct __attribute__((packed)) SnapshotHeader {
+    char type;
+    uint64_t seq;
+    uint32_t bid_depth;
+    uint32_t ask_depth;
+  };
+
+  struct __attribute__((packed)) Level {
+    uint64_t price;
+    uint32_t shares;
+  };
+}
 
-  size_t depth_of_ask() const {
-    return this->ask_levels_.size();
+
+/*
+ * appends level 2 records to a file, put it under /dev/shm
+ * to hand the stream to a consumer on the same box through memory
+ */
+class L2Writer {
+public:
+  L2Writer(const std::string & path)
+    :file_(fopen(path.c_str(), "wb"))
+  {
+    if (!file_) throw std::runtime_error("can't open " + path);
+    setvbuf(file_, nullptr, _IOFBF, 1 << 16);
   }
 
+  ~L2Writer() {
+    fclose(file_);
+  }
 
-  using AskSide = std::map<MicroDollars, PriceLevel>;
-  using BidSide = std::map<MicroDollars, PriceLevel, std::greater<MicroDollars>>;
-  using OrderToPriceLevelMap = std::unordered_map<OrderId, std::pair<Side, MicroDollars>>;
+  L2Writer(const L2Writer &) = delete;
+  L2Writer & operator=(const L2Writer &) = delete;
 
+  void write(const LevelUpdate & update) {
+    l2::Update rec = {l2::UPDATE, update.seq, update.side, static_cast<char>(update.action),
+      update.price, update.shares};
+    fwrite(&rec, sizeof(rec), 1, file_);
+  }
 
-  // price level to order map
-  AskSide ask_levels_;
-  BidSide bid_levels_;
+  void write(const OrderBook::Snapshot & snapshot) {
+    l2::SnapshotHeader header = {l2::SNAPSHOT, snapshot.seq,
+      uint32_t(snapshot.bids.size()), uint32_t(snapshot.asks.size())};
+    fwrite(&header, sizeof(header), 1, file_);
+    for (auto levels : {&snapshot.bids, &snapshot.asks}) {
+      for (auto & level : *levels) {
+        l2::Level rec = {level.first, level.second};
+        fwrite(&rec, sizeof(rec), 1, file_);
+      }
+    }
+  }
 
-  // order id to price level map
-  // to facilitate locating order in the case
-  // of cancael/modify
-  OrderToPriceLevelMap order_to_price_level_map_;
+  // records are buffered until this, call it once a batch of input
+  // is done so a consumer following the file sees them
+  void flush() {
+    fflush(file_);
+  }
 
+private:
+  FILE * file_;
 };
 
+#ifdef __UNITTEST__
+TEST(OrderBook, handles)
+{
+  OrderBook book;
+  // levels come and go while other orders keep their handles
+  for (OrderId id = 1; id <= 100; id++) {
+    book.add(id, id % 2 ? 'B' : 'S', (id % 2 ? 40 : 50) * MICROS_PER_DOLLAR + id % 7, 10);
+  }
+  for (OrderId id = 1; id <= 100; id += 3) book.remove(id);
+  for (OrderId id = 2; id <= 100; id += 3) book.modify(id, 20);
+  for (OrderId id = 1; id <= 100; id++) {
+    book.add(id, id % 2 ? 'B' : 'S', (id % 2 ? 40 : 50) * MICROS_PER_DOLLAR + id % 5, 10);
+  }
+
+  Shares total = 0;
+  for (auto & level : book.snapshot(100).bids) total += level.second;
+  for (auto & level : book.snapshot(100).asks) total += level.second;
+  // 34 re-added at 10, 33 modified to 20, 33 untouched at 10
+  EXPECT_EQ(34 * 10 + 33 * 20 + 33 * 10, total);
+
+  for (OrderId id = 1; id <= 100; id++) book.remove(id);
+  EXPECT_TRUE(book.snapshot(100).bids.empty());
+  EXPECT_TRUE(book.snapshot(100).asks.empty());
+}
+
+TEST(L2Writer, basic)
+{
+  const char * path = "./l2_writer_test.bin";
+  {
+    L2Writer writer(path);
+    OrderBook book([&writer](const LevelUpdate & u) { writer.write(u); });
+    book.add(1, 'B', 45200000, 100);
+    book.add(2, 'S', 51400000, 200);
+    writer.write(book.snapshot(5));
+    // visible to a reader once flushed, before the writer closes
+    writer.flush();
+    std::ifstream live(path, std::ios::binary | std::ios::ate);
+    EXPECT_EQ(2 * sizeof(l2::Update) + sizeof(l2::SnapshotHeader) + 2 * sizeof(l2::Level), size_t(live.tellg()));
+  }
+
+  std::ifstream ifs(path, std::ios::binary);
+  std::string buf((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+  std::remove(path);
+  ASSERT_EQ(2 * sizeof(l2::Update) + sizeof(l2::SnapshotHeader) + 2 * sizeof(l2::Level), buf.size());
+
+  l2::Update update;
+  memcpy(&update, buf.data() + sizeof(l2::Update), sizeof(update));
+  EXPECT_EQ(l2::UPDATE, update.type);
+  EXPECT_EQ(2, update.seq);
+  EXPECT_EQ('S', update.side);
+  EXPECT_EQ('A', update.action);
+  EXPECT_EQ(51400000, update.price);
+  EXPECT_EQ(200, update.shares);
+
+  l2::SnapshotHeader header;
+  memcpy(&header, buf.data() + 2 * sizeof(l2::Update), sizeof(header));
+  EXPECT_EQ(l2::SNAPSHOT, header.type);
+  EXPECT_EQ(2, header.seq);
+  EXPECT_EQ(1, header.bid_depth);
+  EXPECT_EQ(1, header.ask_depth);
+
+  l2::Level level;
+  memcpy(&level, buf.data() + 2 * sizeof(l2::Update) + sizeof(header), sizeof(level));
+  EXPECT_EQ(45200000, level.price);
+  EXPECT_EQ(100, level.shares);
+}
+#endif
+
 
 class MessageHandler {
 public:
-  MessageHandler(OrderBook & book):
+  MessageHandler(OrderBook & book, std::ostream & os = std::cout):
     book_(book)
+    ,os_(os)
   {}
 
 
@@ -344,9 +679,11 @@ private:
   void handle_add_order(std::istringstream & iss) {
     OrderId order_id;
     Side side;
-    Price price;
+    std::string price_str;
+    MicroDollars price;
     Shares shares;
-    iss >> order_id >> side >> price >> shares;
+    iss >> order_id >> side >> price_str >> shares;
+    if (!price::parse(price_str, price)) return;
     this->book_.add(order_id, side, price, shares);
   }
 
@@ -370,9 +707,11 @@ private:
     int level;
     iss >> get_type >> side >> level;
     if (get_type == spec::get_type::PRICE) {
-      std::cout << this->book_.get_price(side, level) << std::endl;
+      char buf[32];
+      this->os_.write(buf, price::format(this->book_.get_price(side, level), buf));
+      this->os_ << std::endl;
     } else if (get_type == spec::get_type::SIZE) {
-      std::cout << this->book_.get_size(side, level) << std::endl;
+      this->os_ << this->book_.get_size(side, level) << std::endl;
     }
   }
 
@@ -383,6 +722,7 @@ private:
 
 private:
   OrderBook & book_;
+  std::ostream & os_;
 };
 
 #ifdef __UNITTEST__
@@ -396,7 +736,7 @@ TEST(MessageHandler, basic)
   handler.handle("add 1 B 45.2 100");
   handler.handle("modify 1 50");
   handler.handle("get price B 1//this returns 45.2");
-  EXPECT_EQ(45.2, book.get_price('B', 1));
+  EXPECT_EQ(45200000, book.get_price('B', 1));
   handler.handle("add 2 S 51.4 200");
   handler.handle("add 3 B 45.1 100");
   handler.handle("get size S 1 // this returns 200");
@@ -405,11 +745,11 @@ TEST(MessageHandler, basic)
   handler.handle("add 5 S 51.2 200");
   handler.handle("remove 3");
   handler.handle("get price B 1");
-  EXPECT_EQ(45.2, book.get_price('B', 1));
+  EXPECT_EQ(45200000, book.get_price('B', 1));
   handler.handle("get size B 1");
   EXPECT_EQ(50, book.get_size('B', 1));
   handler.handle("get price S 1");
-  EXPECT_EQ(51.2, book.get_price('S', 1));
+  EXPECT_EQ(51200000, book.get_price('S', 1));
   handler.handle("get size S 1");
   EXPECT_EQ(500, book.get_size('S', 1));
 
@@ -421,14 +761,14 @@ TEST(MessageHandler, basic)
   handler.handle("add 2 S 37.8 250");
   handler.handle("add 3 B 24.7 150");
   handler.handle("get price B 1");
-  EXPECT_EQ(24.7, book.get_price('B', 1));
+  EXPECT_EQ(24700000, book.get_price('B', 1));
   handler.handle("get price B 2");
-  EXPECT_EQ(22.5, book.get_price('B', 2));
+  EXPECT_EQ(22500000, book.get_price('B', 2));
   handler.handle("modify 3 50");
   handler.handle("add 4 S 35.1 250");
   handler.handle("add 5 S 37.8 150");
   handler.handle("get price S 1");
-  EXPECT_EQ(35.1, book.get_price('S', 1));
+  EXPECT_EQ(35100000, book.get_price('S', 1));
   handler.handle("remove 3");
   handler.handle("get size S 1");
   EXPECT_EQ(250, book.get_size('S', 1));
@@ -441,14 +781,14 @@ TEST(MessageHandler, basic)
   handler.handle("get size B 1");
   EXPECT_EQ(200, book.get_size('B', 1));
   handler.handle("get price S 2");
-  EXPECT_EQ(37.6, book.get_price('S', 2));
+  EXPECT_EQ(37600000, book.get_price('S', 2));
   handler.handle("modify 8 150");
   handler.handle("add 9 S 35.1 200");
   handler.handle("add 10 B 22.5 350");
   handler.handle("get size B 2");
   EXPECT_EQ(450, book.get_size('B', 2));
   handler.handle("get price S 3");
-  EXPECT_EQ(37.8, book.get_price('S', 3));
+  EXPECT_EQ(37800000, book.get_price('S', 3));
 
 
   // this will not cause trouble
@@ -456,6 +796,193 @@ TEST(MessageHandler, basic)
 
 
 }
+
+TEST(MessageHandler, output)
+{
+  OrderBook book;
+  std::ostringstream oss;
+  MessageHandler handler(book, oss);
+
+  // script.txt
+  for (auto msg : {"add 1 B 45.2 100", "modify 1 50", "get price B 1", "add 2 S 51.4 200",
+      "add 3 B 45.1 100", "get size S 1", "add 4 S 51.2 300", "add 5 S 51.2 200",
+      "remove 3", "get price B 1", "get size B 1", "get price S 1", "get size S 1"}) {
+    handler.handle(msg);
+  }
+  EXPECT_EQ("45.2\n200\n45.2\n50\n51.2\n500\n", oss.str());
+
+  // malformed price is ignored
+  handler.handle("add 6 B 45.x 100");
+  EXPECT_FALSE(book.exists(6));
+}
+#endif
+
+#ifdef __BENCHMARK__
+// script.txt style messages scaled up to n lines, prices have 2 decimals
+std::vector<std::string> make_script(size_t n) {
+  std::vector<std::string> script;
+  std::vector<OrderId> live;
+  OrderId next_id = 1;
+  srand(42);
+  for (size_t i = 0; i < n; i++) {
+    std::ostringstream oss;
+    int r = rand() % 10;
+    if (r < 5 || live.empty()) {
+      char side = rand() % 2 ? 'B' : 'S';
+      int cents = (side == 'B' ? 4000 : 5000) + rand() % 1000;
+      oss << spec::ADD << " " << next_id << " " << side << " "
+          << cents / 100 << "." << std::setw(2) << std::setfill('0') << cents % 100
+          << " " << 100 * (1 + rand() % 10);
+      live.push_back(next_id++);
+    } else if (r < 7) {
+      oss << spec::MODIFY << " " << live[rand() % live.size()] << " " << 50 * (1 + rand() % 10);
+    } else if (r < 9) {
+      auto p = begin(live) + rand() % live.size();
+      oss << spec::DELETE << " " << *p;
+      std::swap(*p, live.back());
+      live.pop_back();
+    } else {
+      oss << spec::GET << " " << (rand() % 2 ? "price" : "size") << " "
+          << (rand() % 2 ? 'B' : 'S') << " " << 1 + rand() % 5;
+    }
+    script.push_back(oss.str());
+  }
+  return script;
+}
+
+// per call latency of add, modify and remove on a book of n orders
+// spread over 1000 levels a side, ids visited in random order
+void bench_book_ops(bench::Suite & suite, size_t n) {
+  std::vector<OrderId> ids(n);
+  for (size_t i = 0; i < n; i++) ids[i] = i + 1;
+  std::vector<MicroDollars> prices(n);
+  srand(7);
+  for (auto & price : prices) price = MicroDollars(40000 + rand() % 2000) * 1000;
+
+  OrderBook book;
+  auto add = [&](size_t i) {
+    book.add(ids[i], prices[i] < 41000000 ? 'B' : 'S', prices[i], 100);
+  };
+  suite.each("book_add", n, add);
+  // modify and remove need the full book even when --filter skips the adds
+  if (!suite.selected("book_add")) {
+    for (size_t i = 0; i < n; i++) add(i);
+  }
+  std::mt19937 gen(7);
+  std::shuffle(begin(ids), end(ids), gen);
+  suite.each("book_modify", n, [&](size_t i) { book.modify(ids[i], 50); });
+  std::shuffle(begin(ids), end(ids), gen);
+  suite.each("book_remove", n, [&](size_t i) { book.remove(ids[i]); });
+}
+
+/*
+ * the shared book with its nodes from the heap, from an arena on 4k
+ * pages and from an arena on huge pages. each book is filled with n
+ * orders over 1000 levels a side, then n/10 random orders are
+ * cancelled and added back one at a time (timed, dTLB load misses
+ * counted where perf lets us), so the cancels probe a book far bigger
+ * than the TLB reaches
+ */
+template <typename Alloc>
+void bench_arena_book(bench::Suite & suite, const std::string & name, size_t n, const Alloc & alloc) {
+  using Traits = OrderBook::Traits;
+  using Order = book::Order<Traits>;
+  using Book = book::Book<Traits, Order, book::NoListener, Alloc>;
+
+  std::mt19937_64 rng(7);
+  auto order_at = [&](OrderId id) {
+    auto level = MicroDollars(id * 2654435761u % 2000);
+    return Order {id, level < 1000 ? 'B' : 'S', 40000000 + level * 1000, Shares(100)};
+  };
+  std::vector<OrderId> cancels(n / 10);
+  for (auto & id : cancels) id = OrderId(1 + rng() % n);
+  std::sort(begin(cancels), end(cancels));
+  cancels.erase(std::unique(begin(cancels), end(cancels)), end(cancels));
+  std::shuffle(begin(cancels), end(cancels), rng);
+
+  Book book {book::NoListener(), alloc};
+  book.reserve(n);
+  double add_ns = bench::time_it([&]() {
+    for (size_t i = 1; i <= n; i++) book.add(order_at(OrderId(i)));
+  });
+
+  auto dtlb = bench::Counter::dtlb_load_misses();
+  dtlb.start();
+  suite.each(name + "_cancel", cancels.size(), [&](size_t i) { book.remove(cancels[i]); });
+  auto cancel_misses = dtlb.stop();
+  dtlb.start();
+  suite.each(name + "_readd", cancels.size(), [&](size_t i) { book.add(order_at(cancels[i])); });
+  auto readd_misses = dtlb.stop();
+
+  suite.note(name + "_fill_ns_per_order", std::to_string(add_ns / n));
+  suite.note(name + "_cancel_dtlb_misses", dtlb.valid() ? std::to_string(cancel_misses) : "n/a");
+  suite.note(name + "_readd_dtlb_misses", dtlb.valid() ? std::to_string(readd_misses) : "n/a");
+  suite.note(name + "_orders", std::to_string(book.size()));
+}
+
+int bench_arena(bench::Suite & suite, size_t n) {
+  suite.note("orders", std::to_string(n));
+  bench_arena_book(suite, "heap", n, std::allocator<char>());
+  {
+    arena::Region region(256 << 20, arena::Pages::normal);
+    bench_arena_book(suite, "arena_4k", n, arena::Allocator<char>(region));
+    suite.note("arena_4k_mapped_mb", std::to_string(region.mapped() >> 20));
+  }
+  {
+    arena::Region region(256 << 20, arena::Pages::huge);
+    bench_arena_book(suite, "arena_huge", n, arena::Allocator<char>(region));
+    suite.note("arena_huge_mapped_mb", std::to_string(region.mapped() >> 20));
+    suite.note("arena_huge_hugetlb_chunks", std::to_string(region.huge_chunks()));
+  }
+  return suite.report();
+}
+
+int run_benchmarks(bench::Suite & suite, size_t n) {
+  suite.note("orders", std::to_string(n));
+  bench_book_ops(suite, n);
+
+  auto script = make_script(n);
+
+  std::vector<std::string> prices;
+  for (auto & msg : script) {
+    if (msg.compare(0, 3, spec::ADD) == 0) {
+      std::istringstream iss(msg);
+      std::string token;
+      iss >> token >> token >> token >> token;
+      prices.push_back(token);
+    }
+  }
+
+  // one price per call, cycling through the script's
+  size_t next = 0;
+  auto price_at = [&]() -> const std::string & {
+    if (++next == prices.size()) next = 0;
+    return prices[next];
+  };
+  suite.run("parse_price_double", [&]() {
+    bench::do_not_optimize(MicroDollars(std::stod(price_at()) * MICROS_PER_DOLLAR));
+  });
+  suite.run("parse_price_fixed", [&]() {
+    MicroDollars price;
+    bench::do_not_optimize(price::parse(price_at(), price));
+    bench::do_not_optimize(price);
+  });
+  char buf[32];
+  MicroDollars value = 0;
+  suite.run("format_price", [&]() {
+    bench::do_not_optimize(price::format(value += 10007, buf));
+  });
+
+  // every message of the script is one sample, replayed on a fresh book
+  std::ostringstream out;
+  OrderBook book;
+  MessageHandler handler(book, out);
+  suite.each("handle_message", script.size(), [&](size_t i) { handler.handle(script[i]); });
+
+  suite.note("messages", std::to_string(script.size()));
+  suite.note("output_bytes", std::to_string(out.str().size()));
+  return suite.report();
+}
 #endif
 
 int main(int argc, char * argv[])
@@ -466,17 +993,46 @@ int main(int argc, char * argv[])
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
 
+#elif defined(__BENCHMARK__)
+
+  bench::Suite suite(argc, argv);
+  if (suite.arg(0, "") == "arena") {
+    return bench_arena(suite, std::stoul(suite.arg(1, "10000000")));
+  }
+  return run_benchmarks(suite, std::stoul(suite.arg(0, "1000000")));
+
 #else
 
-  OrderBook order_book;
+  // ./main -l2 <path> <depth> <n> publishes level 2 updates to path
+  // plus a top <depth> snapshot every n messages
+  std::unique_ptr<L2Writer> l2_writer;
+  size_t snapshot_depth = 0, snapshot_interval = 0;
+  if (argc > 4 && std::string(argv[1]) == "-l2") {
+    l2_writer.reset(new L2Writer(argv[2]));
+    snapshot_depth = std::stoul(argv[3]);
+    snapshot_interval = std::stoul(argv[4]);
+  }
+
+  OrderBook order_book(l2_writer ? OnLevelUpdateHandler([&l2_writer](const LevelUpdate & u) {
+    l2_writer->write(u);
+  }) : nullptr);
   MessageHandler handler(order_book);
 
 
   std::ios_base::sync_with_stdio(false);
   std::string line;
+  size_t count = 0;
   while (getline(std::cin, line))
   {
     handler.handle(line);
+    if (!l2_writer) continue;
+    if (snapshot_interval && ++count % snapshot_interval == 0) {
+      l2_writer->write(order_book.snapshot(snapshot_depth));
+      l2_writer->flush();
+    } else if (std::cin.rdbuf()->in_avail() <= 0) {
+      // caught up with the input read so far
+      l2_writer->flush();
+    }
   }
 
 
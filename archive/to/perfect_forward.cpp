@@ -1,5 +1,5 @@
 #include <bits/stdc++.h>
-
+#include "../common/bench.h"
 
 using namespace std;
 
@@ -27,28 +27,68 @@ auto time_foo(T&& param) {
   return elapsed.count();
 }
 
-template<typename Func, typename...Params>
-auto time_it(Func&& func, Params &&... params)
-{
-  auto before = chrono::system_clock::now();
-  forward<Func>(decltype(func))(forward<Params>(params)...);
-  auto after = chrono::system_clock::now();
+// moved to common/bench.h as bench::time_it, in ns on steady_clock
+using bench::time_it;
 
-  auto elapsed = chrono::duration_cast<chrono::milliseconds>(after - before);
 
-  return elapsed.count();
+/*
+ * what forwarding buys: a sink that takes its argument by forwarding
+ * reference moves an rvalue in, one taking const & has to copy it
+ */
+struct Sink {
+  vector<string> v;
+
+  template<typename T>
+  void forwarded(T&& s) {
+    v.emplace_back(forward<T>(s));
+  }
 
+  void copied(const string & s) {
+    v.emplace_back(s);
+  }
+
+  void clear() {
+    if (v.size() > 1024) v.clear();
+  }
+};
+
+int run_benchmarks(int argc, char *argv[])
+{
+  bench::Suite suite(argc, argv);
+  const string text(64, 'x');
+  Sink sink;
+  suite.run("copy_lvalue", [&]() {
+    sink.copied(text);
+    sink.clear();
+  });
+  suite.run("forward_rvalue", [&]() {
+    string s = text;
+    sink.forwarded(move(s));
+    sink.clear();
+  });
+  suite.run("copy_rvalue", [&]() {
+    string s = text;
+    sink.copied(s);
+    sink.clear();
+  });
+  return suite.report();
 }
 
+// g++ -O3 -std=c++17 perfect_forward.cpp
+// ./a.out [bench [--json] [--filter=name]]
 int main(int argc, char *argv[])
 {
+  if (argc > 1 && string(argv[1]) == "bench") {
+    return run_benchmarks(argc - 1, argv + 1);
+  }
+
   auto l = time_foo("hello world");
   std::string && s = std::string("hello world");
   l = time_foo(s);
   cout << l << '\n';
 
-  l = time_it(foo, "hello world");
-  
-  cout << l << '\n';
+  auto ns = time_it(static_cast<void (*)(const string &)>(foo), "hello world");
+
+  cout << ns / 1e6 << '\n';
   return 0;
 }
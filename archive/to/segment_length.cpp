@@ -1,4 +1,5 @@
 #include <bits/stdc++.h>
+#include "../common/bench.h"
 
 using namespace std;
 
@@ -26,13 +27,215 @@ int segment_length(const vector<pair<int, int>> &segments) {
 }
 
 
+/*
+ * lsd radix sort of ints, a byte per pass. the sign bit is flipped so
+ * negative coordinates sort first, and passes where every key has the
+ * same byte are skipped, which drops the top one or two for typical
+ * coordinate ranges
+ */
+void radix_sort(vector<int> & keys) {
+  vector<uint32_t> a(keys.size()), b(keys.size());
+  for (size_t i = 0; i < keys.size(); i++) a[i] = uint32_t(keys[i]) ^ 0x80000000u;
+  for (int shift = 0; shift < 32; shift += 8) {
+    size_t counts[257] = {0};
+    for (auto k : a) counts[((k >> shift) & 0xff) + 1]++;
+    if (counts[((a.empty() ? 0 : a[0] >> shift) & 0xff) + 1] == a.size()) continue;
+    for (int i = 0; i < 256; i++) counts[i + 1] += counts[i];
+    for (auto k : a) b[counts[(k >> shift) & 0xff]++] = k;
+    swap(a, b);
+  }
+  for (size_t i = 0; i < keys.size(); i++) keys[i] = int(a[i] ^ 0x80000000u);
+}
+
+/*
+ * batch mode. starts and ends go into two flat arrays which are sorted
+ * on their own and swept like a merge, keeping a count of open segments.
+ * no tree nodes, and the length is 64 bit so 10^7 segments can't
+ * overflow it
+ */
+int64_t covered_length(const vector<pair<int, int>> & segments) {
+  vector<int> starts, ends;
+  starts.reserve(segments.size());
+  ends.reserve(segments.size());
+  for (auto & v : segments) {
+    if (v.first >= v.second) continue;
+    starts.push_back(v.first);
+    ends.push_back(v.second);
+  }
+  radix_sort(starts);
+  radix_sort(ends);
+
+  int64_t res = 0;
+  size_t open = 0, i = 0, j = 0;
+  int last = 0;
+  while (j < ends.size()) {
+    // ties don't matter, nothing between them to cover
+    int x = i < starts.size() && starts[i] < ends[j] ? starts[i] : ends[j];
+    if (open) res += int64_t(x) - last;
+    last = x;
+    if (i < starts.size() && starts[i] == x) {
+      i++;
+      open++;
+    } else {
+      j++;
+      open--;
+    }
+  }
+  return res;
+}
+
+/*
+ * incremental mode. a segment tree over the compressed coordinates,
+ * leaf k being [coords[k], coords[k + 1]). a node keeps how many
+ * inserted segments cover it whole and the covered length under it,
+ * so insert and erase touch O(log n) nodes and length() is the root.
+ * coordinates have to be given up front, segments can only be erased
+ * after being inserted
+ */
+class CoverageTree {
+public:
+  explicit CoverageTree(vector<int> coords)
+    :coords_(std::move(coords)) {
+    sort(begin(coords_), end(coords_));
+    coords_.erase(unique(begin(coords_), end(coords_)), end(coords_));
+    leaves_ = coords_.size() > 1 ? coords_.size() - 1 : 0;
+    size_t size = 1;
+    while (size < leaves_) size <<= 1;
+    count_.assign(2 * size, 0);
+    covered_.assign(2 * size, 0);
+  }
+
+  // throws std::invalid_argument for coordinates not given up front
+  void insert(int l, int r) {
+    update(l, r, 1);
+  }
+
+  void erase(int l, int r) {
+    update(l, r, -1);
+  }
+
+  int64_t length() const {
+    return covered_.empty() ? 0 : covered_[1];
+  }
+
+private:
+  size_t index_of(int x) const {
+    auto p = lower_bound(begin(coords_), end(coords_), x);
+    if (p == end(coords_) || *p != x) throw invalid_argument("unknown coordinate " + to_string(x));
+    return p - begin(coords_);
+  }
+
+  void update(int l, int r, int delta) {
+    if (l >= r) return;
+    update(1, 0, leaves_, index_of(l), index_of(r), delta);
+  }
 
+  // node covers leaves [lo, hi), the update leaves [l, r)
+  void update(size_t node, size_t lo, size_t hi, size_t l, size_t r, int delta) {
+    if (r <= lo || hi <= l) return;
+    if (l <= lo && hi <= r) {
+      count_[node] += delta;
+    } else {
+      size_t mid = (lo + hi) / 2;
+      update(2 * node, lo, mid, l, r, delta);
+      update(2 * node + 1, mid, hi, l, r, delta);
+    }
+    if (count_[node]) {
+      covered_[node] = int64_t(coords_[hi]) - coords_[lo];
+    } else if (hi - lo == 1) {
+      covered_[node] = 0;
+    } else {
+      covered_[node] = covered_[2 * node] + covered_[2 * node + 1];
+    }
+  }
+
+  vector<int> coords_;
+  size_t leaves_ = 0;
+  vector<int> count_;
+  vector<int64_t> covered_;
+};
+
+
+using bench::seconds;
+
+// n random segments up to 1000 long in [0, 10^9)
+void run_benchmarks(size_t n) {
+  mt19937 rng(42);
+  vector<pair<int, int>> segments(n);
+  for (auto & v : segments) {
+    v.first = rng() % 1000000000;
+    v.second = v.first + 1 + rng() % 1000;
+  }
+
+  int64_t batch = 0, tree_all = 0, tree_half = 0, batch_half = 0;
+  double batch_s = seconds([&]() { batch = covered_length(segments); });
+
+  vector<int> coords;
+  coords.reserve(2 * n);
+  for (auto & v : segments) {
+    coords.push_back(v.first);
+    coords.push_back(v.second);
+  }
+  CoverageTree tree(coords);
+  double insert_s = seconds([&]() {
+    for (auto & v : segments) tree.insert(v.first, v.second);
+    tree_all = tree.length();
+  });
+  double erase_s = seconds([&]() {
+    for (size_t i = 0; i < n; i += 2) tree.erase(segments[i].first, segments[i].second);
+    tree_half = tree.length();
+  });
+  vector<pair<int, int>> odd;
+  for (size_t i = 1; i < n; i += 2) odd.push_back(segments[i]);
+  batch_half = covered_length(odd);
+
+  cout << "segments," << n << endl
+       << "batch_radix_s," << batch_s << endl
+       << "tree_insert_ns," << insert_s * 1e9 / n << endl
+       << "tree_erase_ns," << erase_s * 1e9 / ((n + 1) / 2) << endl
+       << "covered," << batch << endl
+       << "results_match," << (batch == tree_all && batch_half == tree_half) << endl;
+  // the map sweep, 2n tree nodes
+  if (n <= 1000000) {
+    int res = 0;
+    cout << "map_s," << seconds([&]() { res = segment_length(segments); }) << endl
+         << "map_matches," << (res == batch) << endl;
+  }
+}
+
+
+// ./a.out [bench [segments]]
 int main(int argc, char *argv[])
 {
   assert (8 == segment_length( {{1, 3}, {1, 4}, {2, 4}, {7, 9}, {12, 13}, {13, 15}} ));
   assert (3 == segment_length({{1, 3}, {5,6}}));
   assert (2 == segment_length({{1, 3}, {2, 3}}));
 
+  assert (8 == covered_length( {{1, 3}, {1, 4}, {2, 4}, {7, 9}, {12, 13}, {13, 15}} ));
+  assert (3 == covered_length({{1, 3}, {5,6}}));
+  assert (2 == covered_length({{1, 3}, {2, 3}}));
+  assert (5 == covered_length({{-5, -2}, {-3, 0}}));
+  assert (0 == covered_length({}));
+
+  CoverageTree tree({1, 2, 3, 4, 7, 9, 12, 13, 15});
+  tree.insert(1, 3);
+  tree.insert(2, 4);
+  tree.insert(7, 9);
+  assert (5 == tree.length());
+  tree.insert(1, 4);
+  tree.erase(1, 3);
+  assert (5 == tree.length());
+  tree.erase(1, 4);
+  assert (4 == tree.length());
+  tree.insert(12, 13);
+  tree.insert(13, 15);
+  tree.erase(2, 4);
+  assert (5 == tree.length());
+
+  if (argc > 1 && string(argv[1]) == "bench") {
+    run_benchmarks(argc > 2 ? stoul(argv[2]) : 10000000);
+  }
+
 
   return 0;
 }
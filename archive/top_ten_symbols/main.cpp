@@ -2,8 +2,15 @@
 #include <gtest/gtest.h>
 #endif
 
+#ifdef __BENCHMARK__
+#include "../common/bench.h"
+#endif
+
 
 #include <set>
+#include <deque>
+#include <tuple>
+#include <random>
 #include <vector>
 #include <string>
 #include <iostream>
@@ -17,26 +24,26 @@
 #include <map>
 #include <iterator>
 #include <chrono>
+#include <cstring>
+#include <cstdio>
+
+#include "../common/wire.h"
+#include "../common/book.h"
+#include "../common/arena.h"
 
 
 using OrderId = uint64_t;
 using Symbol = std::string;
 using Volume = uint32_t;
 using Shares = uint32_t;
+// 4 implied decimals
+using Price = uint64_t;
 template <typename TKey, typename TValue>
 using MyMap = std::unordered_map<TKey, TValue>;
-
-struct OrderId_Traits {
-  using type = OrderId;
-};
-
-struct Symbol_Traits {
-  using type = Symbol;
-};
-
-struct Shares_Traits {
-  using type = Shares;
-};
+// per order tables, their nodes from an arena::Region
+template <typename TKey, typename TValue>
+using ArenaMap = std::unordered_map<TKey, TValue, std::hash<TKey>, std::equal_to<TKey>,
+  arena::Allocator<std::pair<const TKey, TValue>>>;
 
 namespace spec {
   constexpr char ADD_ORDER_TYPE = 'A';
@@ -45,15 +52,35 @@ namespace spec {
   constexpr char TRADE_TYPE = 'P';
 
   namespace header {
+    constexpr size_t TIMESTAMP_OFFSET = 0;
+    constexpr size_t TIMESTAMP_LENGTH = 8;
     constexpr size_t MSG_TYPE_OFFSET = 8;
+
+    using TimestampField = wire::Decimal<TIMESTAMP_OFFSET, TIMESTAMP_LENGTH>;
+    using MsgTypeField = wire::Char<MSG_TYPE_OFFSET>;
   }
   namespace add {
     constexpr size_t ORDERID_OFFSET = 9;
     constexpr size_t ORDERID_LENGTH = 12;
+    constexpr size_t SIDE_OFFSET = 21;
     constexpr size_t SHARES_OFFSET = 22;
     constexpr size_t SHARES_LENGTH = 6;
     constexpr size_t SYMBOL_OFFSET = 28;
     constexpr size_t SYMBOL_LENGTH = 6;
+    constexpr size_t PRICE_OFFSET = 34;
+    constexpr size_t PRICE_LENGTH = 10;
+    constexpr size_t DISPLAY_OFFSET = 44;
+    constexpr size_t LENGTH = 45;
+
+    using OrderIdField = wire::Base36<ORDERID_OFFSET, ORDERID_LENGTH, OrderId>;
+    using SideField = wire::Char<SIDE_OFFSET>;
+    using SharesField = wire::Decimal<SHARES_OFFSET, SHARES_LENGTH, Shares>;
+    using SymbolField = wire::Text<SYMBOL_OFFSET, SYMBOL_LENGTH>;
+    using PriceField = wire::Decimal<PRICE_OFFSET, PRICE_LENGTH, Price>;
+    using DisplayField = wire::Char<DISPLAY_OFFSET>;
+    using Message = wire::Layout<LENGTH, header::TimestampField, header::MsgTypeField,
+          OrderIdField, SideField, SharesField, SymbolField, PriceField, DisplayField>;
+    static_assert(Message::tiles(), "add order doesn't match the spec");
   }
 
   namespace cancel {
@@ -61,6 +88,13 @@ namespace spec {
     constexpr size_t ORDERID_LENGTH = 12;
     constexpr size_t CANCELED_SHARES_OFFSET = 21;
     constexpr size_t CANCELED_SHARES_LENGTH = 6;
+    constexpr size_t LENGTH = 27;
+
+    using OrderIdField = wire::Base36<ORDERID_OFFSET, ORDERID_LENGTH, OrderId>;
+    using CanceledSharesField = wire::Decimal<CANCELED_SHARES_OFFSET, CANCELED_SHARES_LENGTH, Shares>;
+    using Message = wire::Layout<LENGTH, header::TimestampField, header::MsgTypeField,
+          OrderIdField, CanceledSharesField>;
+    static_assert(Message::tiles(), "order cancel doesn't match the spec");
   }
 
   namespace execute {
@@ -68,16 +102,77 @@ namespace spec {
     constexpr size_t ORDERID_LENGTH = 12;
     constexpr size_t EXECUTED_SHARES_OFFSET = 21;
     constexpr size_t EXECUTED_SHARES_LENGTH = 6;
+    constexpr size_t EXECUTION_ID_OFFSET = 27;
+    constexpr size_t EXECUTION_ID_LENGTH = 12;
+    constexpr size_t LENGTH = 39;
+
+    using OrderIdField = wire::Base36<ORDERID_OFFSET, ORDERID_LENGTH, OrderId>;
+    using ExecutedSharesField = wire::Decimal<EXECUTED_SHARES_OFFSET, EXECUTED_SHARES_LENGTH, Shares>;
+    using ExecutionIdField = wire::Base36<EXECUTION_ID_OFFSET, EXECUTION_ID_LENGTH>;
+    using Message = wire::Layout<LENGTH, header::TimestampField, header::MsgTypeField,
+          OrderIdField, ExecutedSharesField, ExecutionIdField>;
+    static_assert(Message::tiles(), "order executed doesn't match the spec");
   }
 
   namespace trade {
+    constexpr size_t ORDERID_OFFSET = 9;
+    constexpr size_t ORDERID_LENGTH = 12;
+    constexpr size_t SIDE_OFFSET = 21;
     constexpr size_t SHARES_OFFSET = 22;
     constexpr size_t SHARES_LENGTH = 6;
     constexpr size_t SYMBOL_OFFSET = 28;
     constexpr size_t SYMBOL_LENGTH = 6;
+    constexpr size_t PRICE_OFFSET = 34;
+    constexpr size_t PRICE_LENGTH = 10;
+    constexpr size_t EXECUTION_ID_OFFSET = 44;
+    constexpr size_t EXECUTION_ID_LENGTH = 12;
+    constexpr size_t LENGTH = 56;
+
+    using SharesField = wire::Decimal<SHARES_OFFSET, SHARES_LENGTH, Shares>;
+    using SymbolField = wire::Text<SYMBOL_OFFSET, SYMBOL_LENGTH>;
+    using Message = wire::Layout<LENGTH, header::TimestampField, header::MsgTypeField,
+          wire::Base36<ORDERID_OFFSET, ORDERID_LENGTH, OrderId>, wire::Char<SIDE_OFFSET>,
+          SharesField, SymbolField, wire::Decimal<PRICE_OFFSET, PRICE_LENGTH, uint64_t>,
+          wire::Base36<EXECUTION_ID_OFFSET, EXECUTION_ID_LENGTH>>;
+    static_assert(Message::tiles(), "trade doesn't match the spec");
   }
 }
 
+#ifdef __UNITTEST__
+TEST (spec, add_order)
+{
+  const char * msg = "28800011AAK27GA0000DTS000100SH    0000619200Y";
+  using namespace spec::add;
+  EXPECT_EQ(28800011, spec::header::TimestampField::get(msg));
+  EXPECT_EQ('A', spec::header::MsgTypeField::get(msg));
+  EXPECT_EQ('S', SideField::get(msg));
+  EXPECT_EQ(100, SharesField::get(msg));
+  EXPECT_EQ("SH", SymbolField::get(msg));
+  EXPECT_EQ(619200, PriceField::get(msg));
+  EXPECT_EQ('Y', DisplayField::get(msg));
+  // 'AK27GA0000DT' in base 36
+  EXPECT_EQ(1389564350501069297ull, OrderIdField::get(msg));
+  EXPECT_EQ(10, (wire::Base36<0, 2>::get("0A")));
+  EXPECT_EQ(36 * 35 + 1, (wire::Base36<0, 2>::get("Z1")));
+}
+
+TEST (wire, binary)
+{
+  using Layout = wire::Layout<8, wire::Int<0, uint16_t>, wire::Int<2, uint32_t, wire::Endian::big>, wire::Skip<6, 2>>;
+  static_assert(Layout::tiles(), "");
+  static_assert(!wire::Layout<8, wire::Int<0, uint32_t>, wire::Int<2, uint32_t>>::disjoint(), "");
+  static_assert(!wire::Layout<4, wire::Int<2, uint32_t>>::fits(), "");
+  static_assert(!wire::Layout<8, wire::Int<0, uint32_t>>::tiles(), "");
+  char buf[8] = {0};
+  wire::Int<0, uint16_t>::put(buf, 0x0102);
+  wire::Int<2, uint32_t, wire::Endian::big>::put(buf, 0x03040506);
+  EXPECT_EQ(0x02, buf[0]);
+  EXPECT_EQ(0x03, buf[2]);
+  EXPECT_EQ(0x06, buf[5]);
+  EXPECT_EQ(0x0102, (wire::Int<0, uint16_t>::get(buf)));
+  EXPECT_EQ(0x03040506u, (wire::Int<2, uint32_t, wire::Endian::big>::get(buf)));
+}
+#endif
 
 // takes care of top 10
 template <size_t N>
@@ -238,8 +333,10 @@ struct SimpleOrderBook {
 
   using SharedPtr = std::shared_ptr<SimpleOrderBook>;
 
-  SimpleOrderBook(const Symbol & symbol)
-    :symbol_(symbol)
+  // the region has to outlive the book
+  SimpleOrderBook(const Symbol & symbol, arena::Region & region)
+    :order_book_(OrderBook::allocator_type(region))
+    ,symbol_(symbol)
     ,volume_ (0)
   {}
 
@@ -293,7 +390,7 @@ struct SimpleOrderBook {
 
 
 private:
-  using OrderBook = MyMap<OrderId, SimpleOrder>;
+  using OrderBook = ArenaMap<OrderId, SimpleOrder>;
   void cleanup(OrderId id) {
     if (order_book_[id].done()) {
       order_book_.erase(id);
@@ -308,7 +405,8 @@ private:
 #ifdef __UNITTEST__
 TEST (SimpleOrderBook, basic)
 {
-  SimpleOrderBook order_book("AAPL");
+  arena::Region region(2 << 20);
+  SimpleOrderBook order_book("AAPL", region);
   order_book.add_order(1, 100);
   order_book.add_order(2, 200);
   EXPECT_EQ(0, order_book.volume());
@@ -339,9 +437,16 @@ public:
 
   using StatsType = TopVolumesRank<10>;
   // TODO: try multi_index_container
-  using BookLookupTable = MyMap<OrderId, SimpleOrderBook::SharedPtr>;
+  using BookLookupTable = ArenaMap<OrderId, SimpleOrderBook::SharedPtr>;
   using SymbolBookTable = MyMap<Symbol, SimpleOrderBook::SharedPtr>;
 
+  Book()
+    :book_lookup_(BookLookupTable::allocator_type(region_)) {}
+
+  // the symbol books hold on to region_
+  Book(const Book &) = delete;
+  Book & operator=(const Book &) = delete;
+
   void add_order(OrderId order_id, const Symbol & sym, Shares shares) {
     auto order_book = this->get_order_book(sym);
 
@@ -386,11 +491,13 @@ private:
 
   SimpleOrderBook::SharedPtr get_order_book(const Symbol & sym) {
     if (!symbol_book_.count(sym)) {
-      symbol_book_[sym] = std::make_shared<SimpleOrderBook>(sym);
+      symbol_book_[sym] = std::make_shared<SimpleOrderBook>(sym, this->region_);
     }
     return symbol_book_[sym];
   }
 
+  // every order node of every symbol, declared first so it goes last
+  arena::Region region_;
 
   BookLookupTable book_lookup_;
   SymbolBookTable symbol_book_;
@@ -419,65 +526,210 @@ TEST (Book, basic)
 
 
 
-
-/**
- *
- *
- * helper functions for pitch
- *
- *
+/*
+ * optional full depth: a price level book per symbol (common/book.h)
+ * out of the same add/cancel/execute stream, plus an order id ->
+ * symbol index so a cancel or execute, which carries no symbol, is one
+ * probe to find the symbol and one into its book to find the level
+ * and the order. trades are against hidden orders and leave the books
+ * alone.
  *
+ * every symbol touched is marked, publish() writes the top of each
+ * marked symbol whose top actually moved since it was last written
  */
-namespace parser {
-  template<typename T>
-  typename T::type parse(const char * start, size_t length);
-};
+class DepthBooks {
+public:
+  struct Traits {
+    using OrderId = ::OrderId;
+    using Price = ::Price;
+    using Shares = ::Shares;
+    using Side = char;
+
+    static bool is_buy(char s) {
+      return s == 'B';
+    }
+  };
+
+  using SymbolBook = book::Book<Traits, book::Order<Traits>, book::NoListener, arena::Allocator<book::Order<Traits>>>;
+  using OrderIndex = ArenaMap<OrderId, uint32_t>;
+
+  // shares 0 means the side is empty
+  struct TopOfBook {
+    Price bid_price = 0;
+    Shares bid_shares = 0;
+    Price ask_price = 0;
+    Shares ask_shares = 0;
+
+    bool operator== (const TopOfBook & rhs) const {
+      return bid_price == rhs.bid_price && bid_shares == rhs.bid_shares
+        && ask_price == rhs.ask_price && ask_shares == rhs.ask_shares;
+    }
+  };
+
+  DepthBooks()
+    :order_symbol_(OrderIndex::allocator_type(region_)) {}
+
+  // the books hold on to region_
+  DepthBooks(const DepthBooks &) = delete;
+  DepthBooks & operator=(const DepthBooks &) = delete;
 
+  void add_order(OrderId order_id, const Symbol & sym, char side, Price price, Shares shares) {
+    auto index = this->index_of(sym);
+    if (this->books_[index].book.add({order_id, side, price, shares})) {
+      this->order_symbol_[order_id] = index;
+      this->touch(index);
+    }
+  }
 
-template<>
-Shares
-parser::parse<Shares_Traits> (const char * start, size_t length) {
-  Shares res = 0;
-  while(length) {
-    res = res * 10 + (*start++ - '0');
-    length--;
+  // cancel and execute both take shares off the order
+  void reduce_order(OrderId order_id, Shares shares) {
+    auto p = this->order_symbol_.find(order_id);
+    if (p == end(this->order_symbol_)) return;
+    auto index = p->second;
+    auto & book = this->books_[index].book;
+    auto order = book.find(order_id);
+    if (order && order->shares <= shares) this->order_symbol_.erase(p);
+    book.reduce(order_id, shares);
+    this->touch(index);
+  }
+
+  TopOfBook top(const Symbol & sym) const {
+    auto p = this->symbol_index_.find(sym);
+    return p == end(this->symbol_index_) ? TopOfBook() : top_of(this->books_[p->second].book);
   }
-  return res;
-}
 
+  const SymbolBook * book(const Symbol & sym) const {
+    auto p = this->symbol_index_.find(sym);
+    return p == end(this->symbol_index_) ? nullptr : &this->books_[p->second].book;
+  }
 
-template<>
-OrderId
-parser::parse<OrderId_Traits> (const char * start, size_t length) {
-  OrderId res = 0;
-  while(length) {
-    res = res * 36 +  (*start >= 'A' ? (*start - 'A' + 10) : (*start - '0'));
-    start++;
-    length--;
+  // one line per symbol whose top moved since the last publish:
+  // symbol bid_shares bid_price ask_price ask_shares, prices in dollars
+  size_t publish(std::ostream & os) {
+    size_t lines = 0;
+    for (auto index : this->touched_) {
+      auto & entry = this->books_[index];
+      entry.touched = false;
+      auto top = top_of(entry.book);
+      if (top == entry.published) continue;
+      entry.published = top;
+      os << entry.symbol << " " << top.bid_shares << " " << dollars(top.bid_price)
+         << " " << dollars(top.ask_price) << " " << top.ask_shares << "\n";
+      lines++;
+    }
+    this->touched_.clear();
+    return lines;
   }
-  return res;
-}
 
-template<>
-Symbol
-parser::parse<Symbol_Traits> (const char * start, size_t length) {
-  Symbol sym;
-  while (length && *start != ' ') {
-    sym.push_back(*start++);
-    length--;
+  size_t orders() const {
+    return this->order_symbol_.size();
   }
-  return sym;
+
+private:
+  struct Entry {
+    Entry(const Symbol & symbol, arena::Region & region)
+      :symbol(symbol)
+      ,book(book::NoListener(), arena::Allocator<book::Order<Traits>>(region)) {}
+
+    Symbol symbol;
+    SymbolBook book;
+    TopOfBook published;
+    bool touched = false;
+  };
+
+  static TopOfBook top_of(const SymbolBook & book) {
+    TopOfBook top;
+    if (book.depth_of_bid()) std::tie(top.bid_price, top.bid_shares) = book.level_of_bid(0);
+    if (book.depth_of_ask()) std::tie(top.ask_price, top.ask_shares) = book.level_of_ask(0);
+    return top;
+  }
+
+  static std::string dollars(Price price) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lu.%04lu", (unsigned long) (price / 10000), (unsigned long) (price % 10000));
+    return buf;
+  }
+
+  uint32_t index_of(const Symbol & sym) {
+    auto p = this->symbol_index_.emplace(sym, this->books_.size());
+    if (p.second) {
+      this->books_.emplace_back(sym, this->region_);
+    }
+    return p.first->second;
+  }
+
+  void touch(uint32_t index) {
+    if (!this->books_[index].touched) {
+      this->books_[index].touched = true;
+      this->touched_.push_back(index);
+    }
+  }
+
+  // levels, queue nodes and index nodes of every symbol packed
+  // together, declared first so it outlives them
+  arena::Region region_;
+  // deque so books don't move as symbols are added
+  std::deque<Entry> books_;
+  MyMap<Symbol, uint32_t> symbol_index_;
+  OrderIndex order_symbol_;
+  std::vector<uint32_t> touched_;
+};
+
+#ifdef __UNITTEST__
+TEST (DepthBooks, basic)
+{
+  DepthBooks depth;
+  depth.add_order(1, "AAPL", 'B', 1828600, 100);
+  depth.add_order(2, "AAPL", 'B', 1828600, 200);
+  depth.add_order(3, "AAPL", 'S', 1830100, 300);
+  depth.add_order(4, "MSFT", 'S', 619200, 100);
+  EXPECT_EQ(2, depth.book("AAPL")->depth_of_bid() + depth.book("AAPL")->depth_of_ask());
+  EXPECT_EQ(nullptr, depth.book("IBM"));
+
+  auto top = depth.top("AAPL");
+  EXPECT_EQ(1828600, top.bid_price);
+  EXPECT_EQ(300, top.bid_shares);
+  EXPECT_EQ(1830100, top.ask_price);
+  EXPECT_EQ(300, top.ask_shares);
+
+  std::ostringstream oss;
+  EXPECT_EQ(2, depth.publish(oss));
+  EXPECT_EQ("AAPL 300 182.8600 183.0100 300\nMSFT 0 0.0000 61.9200 100\n", oss.str());
+
+  // cancel and execute find the order without its symbol
+  depth.reduce_order(1, 40);
+  depth.reduce_order(3, 300);
+  EXPECT_EQ(3, depth.orders());
+  top = depth.top("AAPL");
+  EXPECT_EQ(260, top.bid_shares);
+  EXPECT_EQ(0, top.ask_shares);
+  depth.reduce_order(42, 100);
+
+  // only what moved is published again
+  oss.str("");
+  EXPECT_EQ(1, depth.publish(oss));
+  EXPECT_EQ("AAPL 260 182.8600 0.0000 0\n", oss.str());
+  depth.reduce_order(4, 10);
+  depth.reduce_order(4, 0);
+  oss.str("");
+  EXPECT_EQ(1, depth.publish(oss));
+  EXPECT_EQ(0, depth.publish(oss));
 }
+#endif
+
+
 
 class PitchMessageHandler {
 public:
-  PitchMessageHandler(Book & book):
+  // depth, if given, is kept up to date from the same messages
+  PitchMessageHandler(Book & book, DepthBooks * depth = nullptr):
     book_(book)
+    ,depth_(depth)
   {}
 
 
   void handle(const char * msg) {
-    char msg_type = *(msg + spec::header::MSG_TYPE_OFFSET);
+    char msg_type = spec::header::MsgTypeField::get(msg);
     switch (msg_type) {
       case spec::ADD_ORDER_TYPE:
         handle_add_order(msg);
@@ -499,60 +751,35 @@ public:
 private:
   void handle_add_order(const char * msg) {
     using namespace spec::add;
-    OrderId oid = parser::parse<OrderId_Traits>(
-      msg + ORDERID_OFFSET,
-      ORDERID_LENGTH
-    );
-    Shares shares = parser::parse<Shares_Traits>(
-      msg + SHARES_OFFSET,
-      SHARES_LENGTH
-    );
-    Symbol sym = parser::parse<Symbol_Traits>(
-      msg + SYMBOL_OFFSET,
-      SYMBOL_LENGTH
-    );
-    this->book_.add_order(oid, sym, shares);
-
+    auto order_id = OrderIdField::get(msg);
+    auto shares = SharesField::get(msg);
+    Symbol sym(SymbolField::get(msg));
+    this->book_.add_order(order_id, sym, shares);
+    if (this->depth_) {
+      this->depth_->add_order(order_id, sym, SideField::get(msg), PriceField::get(msg), shares);
+    }
   }
 
   void handle_order_cancel(const char *msg) {
     using namespace spec::cancel;
-    OrderId oid = parser::parse<OrderId_Traits>(
-      msg + ORDERID_OFFSET,
-      ORDERID_LENGTH
-    );
-    Shares shares = parser::parse<Shares_Traits>(
-      msg + CANCELED_SHARES_OFFSET,
-      CANCELED_SHARES_LENGTH
-    );
-    this->book_.cancel_order(oid, shares);
+    auto order_id = OrderIdField::get(msg);
+    auto shares = CanceledSharesField::get(msg);
+    this->book_.cancel_order(order_id, shares);
+    if (this->depth_) this->depth_->reduce_order(order_id, shares);
   }
 
 
   void handle_order_executed(const char * msg) {
     using namespace spec::execute;
-    OrderId oid = parser::parse<OrderId_Traits>(
-      msg + ORDERID_OFFSET,
-      ORDERID_LENGTH
-    );
-    Shares shares = parser::parse<Shares_Traits>(
-      msg + EXECUTED_SHARES_OFFSET,
-      EXECUTED_SHARES_LENGTH
-    );
-    this->book_.execute_order(oid, shares);
+    auto order_id = OrderIdField::get(msg);
+    auto shares = ExecutedSharesField::get(msg);
+    this->book_.execute_order(order_id, shares);
+    if (this->depth_) this->depth_->reduce_order(order_id, shares);
   }
 
   void handle_trade(const char * msg) {
     using namespace spec::trade;
-    Shares shares = parser::parse<Shares_Traits>(
-      msg + SHARES_OFFSET,
-      SHARES_LENGTH
-    );
-    Symbol sym = parser::parse<Symbol_Traits>(
-      msg + SYMBOL_OFFSET,
-      SYMBOL_LENGTH
-    );
-    this->book_.add_trade(sym, shares);
+    this->book_.add_trade(Symbol(SymbolField::get(msg)), SharesField::get(msg));
   }
 
 
@@ -562,6 +789,7 @@ private:
 
 private:
   Book & book_;
+  DepthBooks * depth_;
 };
 
 #ifdef __UNITTEST__
@@ -579,6 +807,201 @@ TEST(PitchMessageHandler, basic)
   handler.handle("28800318E1K27GA00000X00010000001AQ00001");
   EXPECT_EQ((StatsList{{"AAPL", 100}}), book.stats().dump());
 }
+
+TEST(PitchMessageHandler, depth)
+{
+  using StatsList = std::vector< std::pair<Symbol, Volume> >;
+  Book book;
+  DepthBooks depth;
+  PitchMessageHandler handler(book, &depth);
+  handler.handle("28800011AAK27GA0000DTS000100SH    0000619200Y");
+  handler.handle("28800162A1K27GA00000XB000100AAPL  0001828600Y");
+  handler.handle("28800170A1K27GA00000YB000300AAPL  0001828700Y");
+  handler.handle("28800180X1K27GA00000Y000100");
+  handler.handle("28800318E1K27GA00000X00004000001AQ00001");
+  handler.handle("28800320P1K27GA00000ZB000050AAPL  000182870000001AQ00002");
+  EXPECT_EQ((StatsList{{"AAPL", 90}}), book.stats().dump());
+
+  auto top = depth.top("AAPL");
+  EXPECT_EQ(1828700, top.bid_price);
+  EXPECT_EQ(200, top.bid_shares);
+  EXPECT_EQ(0, top.ask_shares);
+  EXPECT_EQ(2, depth.book("AAPL")->depth_of_bid());
+  EXPECT_EQ(60, depth.book("AAPL")->level_of_bid(1).second);
+  EXPECT_EQ(619200, depth.top("SH").ask_price);
+}
+#endif
+
+#ifdef __BENCHMARK__
+/*
+ * synthetic PITCH flow over 200 symbols: half adds around a moving
+ * price, the rest cancels, executions and trades of live orders
+ */
+std::vector<std::string> make_pitch(size_t n) {
+  std::vector<std::string> msgs;
+  msgs.reserve(n);
+  std::vector<std::pair<OrderId, Shares>> live;
+  std::mt19937_64 rng(42);
+  OrderId next_id = 1;
+  char buf[64];
+  for (size_t i = 0; i < n; i++) {
+    unsigned ts = 28800000 + i / 1000;
+    auto r = rng() % 10;
+    if (r < 5 || live.empty()) {
+      char side = rng() % 2 ? 'B' : 'S';
+      Shares shares = 100 * (1 + rng() % 10);
+      Price price = (side == 'B' ? 990000 : 1000000) + 100 * (rng() % 50);
+      snprintf(buf, sizeof(buf), "%08uA%012luB%06uS%03lu  %010luY", ts, (unsigned long) next_id,
+          shares, (unsigned long) (rng() % 200), (unsigned long) price);
+      buf[21] = side;
+      live.emplace_back(next_id++, shares);
+    } else {
+      auto k = rng() % live.size();
+      auto & order = live[k];
+      Shares shares = r == 9 ? 100 : std::min<Shares>(order.second, 100 * (1 + rng() % 3));
+      if (r < 7) {
+        snprintf(buf, sizeof(buf), "%08uX%012lu%06u", ts, (unsigned long) order.first, shares);
+      } else if (r < 9) {
+        snprintf(buf, sizeof(buf), "%08uE%012lu%06u%012lu", ts, (unsigned long) order.first, shares, (unsigned long) i);
+      } else {
+        snprintf(buf, sizeof(buf), "%08uP%012luB%06uS%03lu  %010lu%012lu", ts, 0ul, shares,
+            (unsigned long) (rng() % 200), 995000ul, (unsigned long) i);
+      }
+      if (r < 9) {
+        order.second -= shares;
+        if (order.second == 0) {
+          std::swap(order, live.back());
+          live.pop_back();
+        }
+      }
+    }
+    msgs.push_back(buf);
+  }
+  return msgs;
+}
+
+/*
+ * the cost of full depth on top of the volume only handler, per
+ * message of the same flow, and with the top of book written out
+ * every 1000 messages
+ */
+void bench_depth(bench::Suite & suite, size_t n) {
+  auto msgs = make_pitch(n);
+
+  Book volume_book;
+  PitchMessageHandler volume(volume_book);
+  suite.each("pitch_volume_only", n, [&](size_t i) { volume.handle(msgs[i].c_str()); });
+
+  Book book;
+  DepthBooks depth;
+  PitchMessageHandler handler(book, &depth);
+  suite.each("pitch_with_depth", n, [&](size_t i) { handler.handle(msgs[i].c_str()); });
+
+  Book published_book;
+  DepthBooks published;
+  PitchMessageHandler publishing(published_book, &published);
+  std::ostringstream out;
+  size_t lines = 0;
+  suite.each("pitch_with_depth_publish_1000", n, [&](size_t i) {
+    publishing.handle(msgs[i].c_str());
+    if ((i + 1) % 1000 == 0) {
+      lines += published.publish(out);
+      out.str("");
+    }
+  });
+
+  suite.note("depth_messages", std::to_string(n));
+  auto volume_only = suite.find("pitch_volume_only");
+  auto with_depth = suite.find("pitch_with_depth");
+  if (with_depth) suite.note("depth_resting_orders", std::to_string(depth.orders()));
+  if (volume_only && with_depth) {
+    suite.note("depth_overhead_pct", std::to_string(100 * (with_depth->ns.mean / volume_only->ns.mean - 1)));
+  }
+  if (suite.find("pitch_with_depth_publish_1000")) suite.note("depth_top_lines", std::to_string(lines));
+}
+
+/*
+ * wire views against the loads they replace: the hand written digit
+ * loops PitchMessageHandler used before over n add order messages, and
+ * a raw memcpy over n binary records, one message per call. equal
+ * times mean the views cost nothing on top
+ */
+int run_benchmarks(bench::Suite & suite, size_t n) {
+  std::string adds;
+  for (size_t i = 0; i < n; i++) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "28800011A%012zuS%06zuAAPL  %010zuY", i % 1000000000000ul, i % 1000000, i % 10000000000ul);
+    adds.append(buf, spec::add::LENGTH);
+  }
+
+  size_t next = 0;
+  auto add_at = [&]() {
+    if (++next == n) next = 0;
+    return adds.data() + next * spec::add::LENGTH;
+  };
+  auto by_hand = [](const char * msg) {
+    using namespace spec::add;
+    OrderId oid = 0;
+    for (size_t k = 0; k < ORDERID_LENGTH; k++) {
+      char c = msg[ORDERID_OFFSET + k];
+      oid = oid * 36 + (c >= 'A' ? (c - 'A' + 10) : (c - '0'));
+    }
+    Shares shares = 0;
+    for (size_t k = 0; k < SHARES_LENGTH; k++) shares = shares * 10 + (msg[SHARES_OFFSET + k] - '0');
+    return oid + shares;
+  };
+  auto by_view = [](const char * msg) {
+    using namespace spec::add;
+    return OrderIdField::get(msg) + SharesField::get(msg);
+  };
+  suite.run("pitch_by_hand", [&]() { bench::do_not_optimize(by_hand(add_at())); });
+  suite.run("pitch_view", [&]() { bench::do_not_optimize(by_view(add_at())); });
+
+  // 16 byte records: u64 id, u32 little endian size, u32 big endian price
+  using Id = wire::Int<0, uint64_t>;
+  using Size = wire::Int<8, uint32_t>;
+  using Price = wire::Int<12, uint32_t, wire::Endian::big>;
+  static_assert(wire::Layout<16, Id, Size, Price>::tiles(), "");
+  std::string records(16 * n, '\0');
+  for (size_t i = 0; i < n; i++) {
+    Id::put(&records[16 * i], i);
+    Size::put(&records[16 * i], i * 3);
+    Price::put(&records[16 * i], i * 7);
+  }
+  auto record_at = [&]() {
+    if (++next == n) next = 0;
+    return records.data() + 16 * next;
+  };
+  auto raw = [](const char * p) {
+    uint64_t id;
+    uint32_t size, price;
+    memcpy(&id, p, 8);
+    memcpy(&size, p + 8, 4);
+    memcpy(&price, p + 12, 4);
+    return id + size + __builtin_bswap32(price);
+  };
+  auto view = [](const char * p) {
+    return Id::get(p) + Size::get(p) + Price::get(p);
+  };
+  suite.run("binary_raw", [&]() { bench::do_not_optimize(raw(record_at())); });
+  suite.run("binary_view", [&]() { bench::do_not_optimize(view(record_at())); });
+
+  // both decoders over every message, outside the timed runs
+  uint64_t hand_sum = 0, view_sum = 0, raw_sum = 0, binary_view_sum = 0;
+  for (size_t i = 0; i < n; i++) {
+    hand_sum += by_hand(adds.data() + i * spec::add::LENGTH);
+    view_sum += by_view(adds.data() + i * spec::add::LENGTH);
+    raw_sum += raw(records.data() + 16 * i);
+    binary_view_sum += view(records.data() + 16 * i);
+  }
+
+  bench_depth(suite, std::min(n, size_t(2000000)));
+
+  suite.note("messages", std::to_string(n));
+  suite.note("pitch_matches", std::to_string(hand_sum == view_sum));
+  suite.note("binary_matches", std::to_string(raw_sum == binary_view_sum));
+  return suite.report();
+}
 #endif
 
 int main(int argc, char * argv[])
@@ -589,22 +1012,41 @@ int main(int argc, char * argv[])
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
 
+#elif defined(__BENCHMARK__)
+
+  // main_bench [messages] [--json] [--filter=name]
+  bench::Suite suite(argc, argv);
+  return run_benchmarks(suite, std::stoul(suite.arg(0, "10000000")));
+
 #else
+  // main [--depth messages] < pitch_data
+  // with --depth, also keeps full depth per symbol and writes the top
+  // of book of every symbol whose top moved, every that many messages
+  size_t depth_every = 0;
+  if (argc > 2 && std::string(argv[1]) == "--depth") {
+    depth_every = std::max(1ul, std::stoul(argv[2]));
+  }
+
   auto begin = std::chrono::high_resolution_clock::now();
 
 
   Book book;
-  PitchMessageHandler handler(book);
+  std::unique_ptr<DepthBooks> depth;
+  if (depth_every) depth.reset(new DepthBooks());
+  PitchMessageHandler handler(book, depth.get());
 
 
   std::ios_base::sync_with_stdio(false);
   std::string line;
+  size_t messages = 0;
   while (getline(std::cin, line))
   {
     const char *p = line.c_str();
     // ignore first character per instructions
     handler.handle(p + 1);
+    if (depth && ++messages % depth_every == 0) depth->publish(std::cout);
   }
+  if (depth) depth->publish(std::cout);
 
   auto end = std::chrono::high_resolution_clock::now();
   auto intake_time = std::chrono::duration_cast<std::chrono::nanoseconds>(end-begin).count() / 1000000;
@@ -5,6 +5,12 @@
 #include <assert.h>
 #include <iostream>
 #include <memory>
+#include <atomic>
+#include <thread>
+#include <deque>
+#include <random>
+#include <cstdint>
+#include "../../common/bench.h"
 
 using namespace std;
 
@@ -57,6 +63,7 @@ struct BankAccounts {
 
   int add_account(shared_ptr<Account> account) {
     accounts_[account->account_number] = account;
+    return account->account_number;
   }
 
   Account * get_account(int account_number) {
@@ -76,6 +83,7 @@ private:
 struct Transaction {
 
   virtual void execute(Account &) = 0;
+  virtual ~Transaction() = default;
 };
 
 
@@ -142,6 +150,511 @@ private:
 
 
 
+/*
+ * batch path. balances live in one dense array indexed by account
+ * number instead of behind a shared_ptr each, and transactions come in
+ * as parallel arrays instead of one virtual object apiece
+ */
+struct AccountColumns {
+  vector<int64_t> balance;
+  vector<uint8_t> open;
+
+  // slot 0 is never open, apply_batch points invalid transactions at it
+  AccountColumns()
+    :balance{0}
+    ,open{0} {}
+
+  // false for account numbers below 1, slot 0 is taken
+  bool add(const Account & account) {
+    if (account.account_number <= 0) return false;
+    size_t a = account.account_number;
+    if (a >= balance.size()) {
+      balance.resize(a + 1, 0);
+      open.resize(a + 1, 0);
+    }
+    balance[a] = account.balance;
+    open[a] = 1;
+    return true;
+  }
+
+  size_t size() const {
+    return balance.size();
+  }
+};
+
+enum BatchOp: uint8_t {BATCH_DEPOSIT, BATCH_WITHDRAW};
+
+struct TransactionBatch {
+  vector<int> account;
+  vector<uint8_t> op;
+  vector<int64_t> amount;
+
+  void add(int account_number, BatchOp o, int64_t a) {
+    account.push_back(account_number);
+    op.push_back(o);
+    amount.push_back(a);
+  }
+
+  size_t size() const {
+    return account.size();
+  }
+
+  void clear() {
+    account.clear();
+    op.clear();
+    amount.clear();
+  }
+};
+
+/*
+ * applies a batch in order and sets bit i of rejects for every
+ * transaction rejected: unknown account, negative amount or overdraft.
+ *
+ * the first loop is pure column arithmetic and vectorizes: it turns
+ * each transaction into a signed delta and an account index, mapping
+ * anything invalid to the closed slot 0. the second loop has to stay
+ * scalar, two transactions on one account depend on each other, but it
+ * is branch free: the overdraft check selects between the old and new
+ * balance instead of jumping
+ */
+void apply_batch(AccountColumns & accounts, const TransactionBatch & batch, vector<uint64_t> & rejects) {
+  size_t n = batch.size();
+  rejects.assign((n + 63) / 64, 0);
+  vector<int64_t> delta(n);
+  vector<uint32_t> index(n);
+  const int * account = batch.account.data();
+  const uint8_t * op = batch.op.data();
+  const int64_t * amount = batch.amount.data();
+  uint32_t size = accounts.size();
+  for (size_t i = 0; i < n; i++) {
+    uint32_t a = uint32_t(account[i]);
+    bool valid = a < size && amount[i] >= 0;
+    index[i] = valid ? a : 0;
+    delta[i] = op[i] == BATCH_WITHDRAW ? -amount[i] : amount[i];
+  }
+
+  int64_t * balance = accounts.balance.data();
+  const uint8_t * open = accounts.open.data();
+  for (size_t base = 0; base < n; base += 64) {
+    uint64_t bits = 0;
+    size_t end = min(n, base + 64);
+    for (size_t i = base; i < end; i++) {
+      uint32_t a = index[i];
+      int64_t next = balance[a] + delta[i];
+      bool ok = open[a] & (next >= 0);
+      balance[a] = ok ? next : balance[a];
+      bits |= uint64_t(!ok) << (i - base);
+    }
+    rejects[base / 64] = bits;
+  }
+}
+
+inline bool rejected(const vector<uint64_t> & rejects, size_t i) {
+  return rejects[i / 64] >> (i % 64) & 1;
+}
+
+
+/*
+ * bounded multi producer single consumer queue. every cell carries a
+ * sequence number telling producers and the consumer whose turn it is,
+ * so producers claim a cell with one CAS on the tail and the consumer
+ * needs no atomic read-modify-write at all
+ */
+template <typename T>
+class MpscQueue {
+public:
+  // capacity is rounded up to a power of 2
+  explicit MpscQueue(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    cells_ = vector<Cell>(size);
+    for (size_t i = 0; i < size; i++) cells_[i].seq.store(i, memory_order_relaxed);
+    mask_ = size - 1;
+  }
+
+  // false when full
+  bool try_push(const T & value) {
+    size_t pos = tail_.load(memory_order_relaxed);
+    for (;;) {
+      Cell & cell = cells_[pos & mask_];
+      size_t seq = cell.seq.load(memory_order_acquire);
+      intptr_t diff = intptr_t(seq) - intptr_t(pos);
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1, memory_order_relaxed)) {
+          cell.value = value;
+          cell.seq.store(pos + 1, memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = tail_.load(memory_order_relaxed);
+      }
+    }
+  }
+
+  void push(const T & value) {
+    while (!try_push(value)) this_thread::yield();
+  }
+
+  // consumer thread only
+  bool try_pop(T & value) {
+    Cell & cell = cells_[head_ & mask_];
+    if (cell.seq.load(memory_order_acquire) != head_ + 1) return false;
+    value = cell.value;
+    cell.seq.store(head_ + mask_ + 1, memory_order_release);
+    head_++;
+    return true;
+  }
+
+private:
+  struct Cell {
+    atomic<size_t> seq;
+    T value;
+  };
+
+  vector<Cell> cells_;
+  size_t mask_ = 0;
+  alignas(64) atomic<size_t> tail_{0};
+  alignas(64) size_t head_ = 0;
+};
+
+
+/*
+ * accounts sharded by account number over N partitions. a partition's
+ * balances are only ever touched by its own worker thread, which takes
+ * commands from its own MpscQueue, so deposits and withdrawals need no
+ * lock.
+ *
+ * a transfer between shards goes in two phases, always in the same
+ * order: the source shard checks and debits, then forwards a credit to
+ * the destination shard (or a refund back, if the destination account
+ * doesn't exist). money is never created, only in flight between the
+ * two. transfers within a shard are applied in one step.
+ *
+ * commands complete asynchronously, a Ticket reports the outcome and
+ * sync() waits until everything submitted so far is done
+ */
+class ShardedLedger {
+public:
+  enum Status {PENDING, OK, REJECTED};
+
+  struct Ticket {
+    atomic<int> status{PENDING};
+
+    int wait() const {
+      int s;
+      while ((s = status.load(memory_order_acquire)) == PENDING) this_thread::yield();
+      return s;
+    }
+  };
+
+  ShardedLedger(size_t shards, size_t queue_capacity = 1 << 16) {
+    for (size_t i = 0; i < shards; i++) {
+      partitions_.emplace_back(new Partition(queue_capacity));
+    }
+    for (size_t i = 0; i < shards; i++) {
+      partitions_[i]->worker = thread([this, i]() { this->run(*partitions_[i]); });
+    }
+  }
+
+  ~ShardedLedger() {
+    sync();
+    stop_.store(true, memory_order_release);
+    for (auto & p : partitions_) p->worker.join();
+  }
+
+  ShardedLedger(const ShardedLedger &) = delete;
+  ShardedLedger & operator=(const ShardedLedger &) = delete;
+
+  // rejected if the account is already open
+  void open(int account_number, int64_t balance, Ticket * ticket = nullptr) {
+    submit({OPEN, account_number, 0, balance, ticket});
+  }
+
+  void open(const Account & account, Ticket * ticket = nullptr) {
+    open(account.account_number, account.balance, ticket);
+  }
+
+  void deposit(int account_number, int64_t amount, Ticket * ticket = nullptr) {
+    submit({DEPOSIT, account_number, 0, amount, ticket});
+  }
+
+  // rejected on overdraft
+  void withdraw(int account_number, int64_t amount, Ticket * ticket = nullptr) {
+    submit({WITHDRAW, account_number, 0, amount, ticket});
+  }
+
+  void transfer(int from, int to, int64_t amount, Ticket * ticket = nullptr) {
+    submit({TRANSFER, from, to, amount, ticket});
+  }
+
+  // waits until every command submitted so far has completed
+  void sync() const {
+    while (pending_.load(memory_order_acquire)) this_thread::yield();
+  }
+
+  // only consistent after sync(), while nothing else is submitted
+  int64_t balance(int account_number) const {
+    auto & balances = partition_of(account_number).balances;
+    auto p = balances.find(account_number);
+    return p == end(balances) ? 0 : p->second;
+  }
+
+  int64_t total_balance() const {
+    int64_t total = 0;
+    for (auto & p : partitions_) {
+      for (auto & b : p->balances) total += b.second;
+    }
+    return total;
+  }
+
+  size_t shards() const {
+    return partitions_.size();
+  }
+
+private:
+  enum Op {OPEN, DEPOSIT, WITHDRAW, TRANSFER, CREDIT, REFUND};
+
+  struct Command {
+    Op op;
+    int account;
+    // transfer counterparty
+    int peer;
+    int64_t amount;
+    Ticket * ticket;
+  };
+
+  struct Partition {
+    explicit Partition(size_t capacity): queue(capacity) {}
+
+    MpscQueue<Command> queue;
+    unordered_map<int, int64_t> balances;
+    // commands for other shards that didn't fit in their queue yet.
+    // a worker never blocks on another queue, two full shards sending
+    // to each other would deadlock
+    deque<pair<size_t, Command>> outbox;
+    thread worker;
+  };
+
+  size_t shard_of(int account_number) const {
+    return size_t(account_number) % partitions_.size();
+  }
+
+  Partition & partition_of(int account_number) const {
+    return *partitions_[shard_of(account_number)];
+  }
+
+  void submit(const Command & cmd) {
+    pending_.fetch_add(1, memory_order_relaxed);
+    partition_of(cmd.account).queue.push(cmd);
+  }
+
+  void complete(const Command & cmd, Status status) {
+    if (cmd.ticket) cmd.ticket->status.store(status, memory_order_release);
+    pending_.fetch_sub(1, memory_order_release);
+  }
+
+  void forward(Partition & from, const Command & cmd) {
+    size_t shard = shard_of(cmd.account);
+    if (!from.outbox.empty() || !partitions_[shard]->queue.try_push(cmd)) {
+      from.outbox.emplace_back(shard, cmd);
+    }
+  }
+
+  void run(Partition & self) {
+    Command cmd;
+    while (!stop_.load(memory_order_acquire)) {
+      while (!self.outbox.empty() && partitions_[self.outbox.front().first]->queue.try_push(self.outbox.front().second)) {
+        self.outbox.pop_front();
+      }
+      size_t n = 0;
+      while (n < 256 && self.queue.try_pop(cmd)) {
+        apply(self, cmd);
+        n++;
+      }
+      if (!n) this_thread::yield();
+    }
+  }
+
+  void apply(Partition & self, const Command & cmd) {
+    auto & balances = self.balances;
+    auto p = balances.find(cmd.account);
+    switch (cmd.op) {
+      case OPEN:
+        if (p != end(balances)) return complete(cmd, REJECTED);
+        balances.emplace(cmd.account, cmd.amount);
+        return complete(cmd, OK);
+      case DEPOSIT:
+        if (p == end(balances) || cmd.amount < 0) return complete(cmd, REJECTED);
+        p->second += cmd.amount;
+        return complete(cmd, OK);
+      case WITHDRAW:
+        if (p == end(balances) || p->second < cmd.amount || cmd.amount < 0) return complete(cmd, REJECTED);
+        p->second -= cmd.amount;
+        return complete(cmd, OK);
+      case TRANSFER: {
+        if (p == end(balances) || p->second < cmd.amount || cmd.amount < 0) return complete(cmd, REJECTED);
+        if (shard_of(cmd.peer) == shard_of(cmd.account)) {
+          auto q = balances.find(cmd.peer);
+          if (q == end(balances)) return complete(cmd, REJECTED);
+          p->second -= cmd.amount;
+          q->second += cmd.amount;
+          return complete(cmd, OK);
+        }
+        // phase one done, the amount is in flight until credited
+        p->second -= cmd.amount;
+        return forward(self, {CREDIT, cmd.peer, cmd.account, cmd.amount, cmd.ticket});
+      }
+      case CREDIT:
+        if (p == end(balances)) {
+          return forward(self, {REFUND, cmd.peer, cmd.account, cmd.amount, cmd.ticket});
+        }
+        p->second += cmd.amount;
+        return complete(cmd, OK);
+      case REFUND:
+        p->second += cmd.amount;
+        return complete(cmd, REJECTED);
+    }
+  }
+
+  vector<unique_ptr<Partition>> partitions_;
+  atomic<bool> stop_{false};
+  alignas(64) atomic<int64_t> pending_{0};
+};
+
+
+/*
+ * producers submit a random mix of deposits, withdrawals and transfers
+ * (a third each) over `accounts` accounts without waiting for results.
+ * deposits and withdrawals are tracked through tickets so the final
+ * total can be checked: it must equal the opening total plus accepted
+ * deposits minus accepted withdrawals, transfers moving money only
+ */
+void bench_ledger(size_t transactions, size_t shards, size_t producers) {
+  const int accounts = 100000;
+  const int64_t opening = 1000;
+  ShardedLedger ledger(shards);
+  for (int a = 1; a <= accounts; a++) ledger.open(a, opening);
+  ledger.sync();
+
+  struct Op {
+    int kind, from, to;
+    int64_t amount;
+  };
+  vector<vector<Op>> work(producers);
+  vector<vector<ShardedLedger::Ticket>> tickets(producers);
+  for (size_t t = 0; t < producers; t++) {
+    mt19937 rng(42 + t);
+    size_t n = transactions / producers;
+    tickets[t] = vector<ShardedLedger::Ticket>(n);
+    for (size_t i = 0; i < n; i++) {
+      work[t].push_back({int(rng() % 3), int(1 + rng() % accounts), int(1 + rng() % accounts), int64_t(rng() % 500)});
+    }
+  }
+
+  double elapsed = bench::seconds([&]() {
+    vector<thread> threads;
+    for (size_t t = 0; t < producers; t++) {
+      threads.emplace_back([&ledger, &work, &tickets, t]() {
+        auto & ops = work[t];
+        for (size_t i = 0; i < ops.size(); i++) {
+          auto & op = ops[i];
+          if (op.kind == 0) ledger.deposit(op.from, op.amount, &tickets[t][i]);
+          else if (op.kind == 1) ledger.withdraw(op.from, op.amount, &tickets[t][i]);
+          else ledger.transfer(op.from, op.to, op.amount, &tickets[t][i]);
+        }
+      });
+    }
+    for (auto & t : threads) t.join();
+    ledger.sync();
+  });
+
+  int64_t expected = opening * accounts;
+  size_t rejected = 0;
+  for (size_t t = 0; t < producers; t++) {
+    for (size_t i = 0; i < work[t].size(); i++) {
+      auto & op = work[t][i];
+      bool ok = tickets[t][i].status.load() == ShardedLedger::OK;
+      rejected += !ok;
+      if (ok && op.kind == 0) expected += op.amount;
+      if (ok && op.kind == 1) expected -= op.amount;
+    }
+  }
+  bool no_overdraft = true;
+  for (int a = 1; a <= accounts; a++) no_overdraft &= ledger.balance(a) >= 0;
+
+  size_t done = transactions / producers * producers;
+  cout << "transactions," << done << endl
+       << "shards," << shards << endl
+       << "producers," << producers << endl
+       << "tx_per_sec," << uint64_t(done / elapsed) << endl
+       << "rejected," << rejected << endl
+       << "total_matches," << (ledger.total_balance() == expected) << endl
+       << "no_overdraft," << no_overdraft << endl;
+}
+
+
+/*
+ * the same transactions through ATM::execute with a Deposit or
+ * Withdraw object each, and through apply_batch 4096 at a time.
+ * balances open high enough that nothing overdraws, since Withdraw
+ * doesn't check, so both must end up with the same balances
+ */
+void bench_batch(size_t transactions) {
+  const int accounts = 100000;
+  const size_t BATCH = 4096;
+  User user("bench");
+  BankAccounts bank_accounts;
+  AccountColumns columns;
+  vector<int> numbers;
+  for (int a = 0; a < accounts; a++) {
+    auto account = make_shared<Account>(user, Account::Kind::CHECKING, 1000000000);
+    numbers.push_back(bank_accounts.add_account(account));
+    columns.add(*account);
+  }
+
+  mt19937 rng(42);
+  TransactionBatch all;
+  for (size_t i = 0; i < transactions; i++) {
+    all.add(numbers[rng() % accounts], rng() % 2 ? BATCH_WITHDRAW : BATCH_DEPOSIT, rng() % 500);
+  }
+
+  ATM atm(bank_accounts);
+  double object_s = bench::seconds([&]() {
+    for (size_t i = 0; i < transactions; i++) {
+      atm.login(all.account[i]);
+      unique_ptr<Transaction> t;
+      if (all.op[i] == BATCH_WITHDRAW) t = make_unique<Withdraw>(all.amount[i]);
+      else t = make_unique<Deposit>(all.amount[i]);
+      atm.execute(*t);
+      atm.logout();
+    }
+  });
+
+  TransactionBatch batch;
+  vector<uint64_t> rejects;
+  size_t rejected_count = 0;
+  double batch_s = bench::seconds([&]() {
+    for (size_t base = 0; base < transactions; base += BATCH) {
+      batch.clear();
+      for (size_t i = base; i < min(transactions, base + BATCH); i++) {
+        batch.add(all.account[i], BatchOp(all.op[i]), all.amount[i]);
+      }
+      apply_batch(columns, batch, rejects);
+      for (auto bits : rejects) rejected_count += __builtin_popcountll(bits);
+    }
+  });
+
+  bool match = true;
+  for (auto a : numbers) match &= bank_accounts.get_account(a)->balance == columns.balance[a];
+  cout << "transactions," << transactions << endl
+       << "per_object_ns," << object_s * 1e9 / transactions << endl
+       << "batch_soa_ns," << batch_s * 1e9 / transactions << endl
+       << "rejected," << rejected_count << endl
+       << "balances_match," << match << endl;
+}
+
 
 int main(int argc, char *argv[])
 {
@@ -167,6 +680,85 @@ int main(int argc, char *argv[])
 
   assert(90 == account1->balance);
 
+  {
+    ShardedLedger ledger(4);
+    ShardedLedger::Ticket opened, withdrawn, overdraft, moved, missing, negative_in, negative_out;
+    ledger.open(*account1, &opened);
+    ledger.open(1000, 0);
+    ledger.open(1001, 0);
+    assert(ShardedLedger::OK == opened.wait());
+    ledger.withdraw(account1->account_number, 40, &withdrawn);
+    ledger.withdraw(account1->account_number, 100, &overdraft);
+    // accounts 1, 1000 and 2002 live on different shards
+    ledger.transfer(account1->account_number, 1000, 30, &moved);
+    // the credit lands on 1000 asynchronously, without this the next
+    // debit could be rejected at the source and never need a refund
+    ledger.sync();
+    assert(ShardedLedger::OK == withdrawn.wait());
+    assert(ShardedLedger::REJECTED == overdraft.wait());
+    assert(ShardedLedger::OK == moved.wait());
+    assert(30 == ledger.balance(1000));
+    // debited from 1000, then refunded since 2002 doesn't exist
+    ledger.transfer(1000, 2002, 10, &missing);
+    ledger.sync();
+    assert(ShardedLedger::REJECTED == missing.wait());
+    assert(20 == ledger.balance(account1->account_number));
+    assert(30 == ledger.balance(1000));
+    assert(50 == ledger.total_balance());
+    // negative amounts would make or take money past the checks
+    ledger.deposit(1000, -40, &negative_in);
+    ledger.withdraw(1000, -40, &negative_out);
+    assert(ShardedLedger::REJECTED == negative_in.wait());
+    assert(ShardedLedger::REJECTED == negative_out.wait());
+    assert(30 == ledger.balance(1000));
+  }
+
+  {
+    AccountColumns columns;
+    columns.add(*account1);
+    TransactionBatch batch;
+    batch.add(account1->account_number, BATCH_WITHDRAW, 50);
+    batch.add(account1->account_number, BATCH_WITHDRAW, 50);
+    batch.add(account1->account_number, BATCH_DEPOSIT, 10);
+    batch.add(12345, BATCH_DEPOSIT, 10);
+    batch.add(account1->account_number, BATCH_DEPOSIT, -10);
+    vector<uint64_t> rejects;
+    apply_batch(columns, batch, rejects);
+    // 90 - 50, the second withdrawal would overdraw
+    assert(50 == columns.balance[account1->account_number]);
+    assert(!rejected(rejects, 0) && rejected(rejects, 1) && !rejected(rejects, 2));
+    assert(rejected(rejects, 3) && rejected(rejects, 4));
+  }
+
+  {
+    // nothing open, everything lands on the sentinel and is rejected
+    AccountColumns columns;
+    TransactionBatch batch;
+    batch.add(0, BATCH_DEPOSIT, 10);
+    batch.add(1, BATCH_DEPOSIT, 10);
+    batch.add(-1, BATCH_WITHDRAW, 10);
+    vector<uint64_t> rejects;
+    apply_batch(columns, batch, rejects);
+    assert(rejected(rejects, 0) && rejected(rejects, 1) && rejected(rejects, 2));
+    assert(0 == columns.balance[0]);
+
+    // and account 0 can't be opened over it
+    Account zero = *account1;
+    zero.account_number = 0;
+    assert(!columns.add(zero));
+    apply_batch(columns, batch, rejects);
+    assert(rejected(rejects, 0) && 0 == columns.balance[0]);
+  }
+
+  // ./a.out bench [transactions [shards [producers]]]
+  // ./a.out batch [transactions]
+  if (argc > 1 && string(argv[1]) == "bench") {
+    bench_ledger(argc > 2 ? stoul(argv[2]) : 4000000, argc > 3 ? stoul(argv[3]) : 4, argc > 4 ? stoul(argv[4]) : 2);
+  }
+  if (argc > 1 && string(argv[1]) == "batch") {
+    bench_batch(argc > 2 ? stoul(argv[2]) : 10000000);
+  }
+
 
 
   return 0;
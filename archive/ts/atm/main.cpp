@@ -1,5 +1,21 @@
 #include <unordered_map>
 #include <memory>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+#include <random>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "../../common/bench.h"
 
 using namespace std;
 
@@ -8,6 +24,209 @@ enum class AccountType : int {
   saving = 2
 };
 
+/*
+ * write ahead log of balance changes. every transaction appends one
+ * record with the resulting balance of each account it touched, as
+ * [uint32 length][uint32 fnv1a checksum][uint64 seq][{uint32 id,
+ * uint32 balance}...]. records are buffered and a group of them goes
+ * out with one write + fdatasync, so a crash loses at most the last
+ * uncommitted group and one transaction is never split across groups.
+ *
+ * checkpoint() writes all balances with the last seq (tmp + rename)
+ * and truncates the log. on start up the checkpoint is loaded and log
+ * records after its seq are replayed, last balance wins, and accounts
+ * get their balance back when attach()ed
+ */
+template <class ConcreteAccount> struct Account;
+
+class BalanceLog {
+public:
+  struct Entry {
+    uint32_t id;
+    uint32_t balance;
+  };
+
+  BalanceLog(const string & dir, size_t group_size = 64)
+    :dir_(dir)
+    ,checkpoint_path_(dir + "/balances.checkpoint")
+    ,log_path_(dir + "/balances.log")
+    ,group_size_(group_size) {
+    ::mkdir(dir.c_str(), 0755);
+    recover();
+    fd_ = ::open(log_path_.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0) throw runtime_error("can't open " + log_path_);
+  }
+
+  // callers commit() first to see errors, this only catches stragglers
+  ~BalanceLog() {
+    close();
+  }
+
+  BalanceLog(const BalanceLog &) = delete;
+  BalanceLog & operator=(const BalanceLog &) = delete;
+
+  // logs account's changes under id from now on, and restores the
+  // balance it had if the id was recovered
+  template <class A>
+  void attach(uint32_t id, Account<A> & account) {
+    account.log_ = this;
+    account.id_ = id;
+    auto p = balances_.find(id);
+    if (p != end(balances_)) {
+      account.balance_ = p->second;
+    } else {
+      Entry entry = {id, account.balance_};
+      append(&entry, 1);
+    }
+  }
+
+  // true when this append completed a group and committed it
+  bool append(const Entry * entries, size_t n) {
+    uint32_t size = sizeof(uint64_t) + n * sizeof(Entry);
+    size_t start = buf_.size();
+    buf_.resize(start + 2 * sizeof(uint32_t) + size);
+    char * p = &buf_[start];
+    uint64_t seq = ++seq_;
+    memcpy(p, &size, sizeof(size));
+    memcpy(p + 2 * sizeof(uint32_t), &seq, sizeof(seq));
+    memcpy(p + 2 * sizeof(uint32_t) + sizeof(seq), entries, n * sizeof(Entry));
+    uint32_t sum = fnv1a(p + 2 * sizeof(uint32_t), size);
+    memcpy(p + sizeof(uint32_t), &sum, sizeof(sum));
+    for (size_t i = 0; i < n; i++) balances_[entries[i].id] = entries[i].balance;
+    if (++uncommitted_ < group_size_) return false;
+    commit();
+    return true;
+  }
+
+  void commit() {
+    if (buf_.empty()) return;
+    if (::write(fd_, buf_.data(), buf_.size()) != ssize_t(buf_.size()) || ::fdatasync(fd_) != 0) {
+      throw runtime_error("can't write " + log_path_);
+    }
+    buf_.clear();
+    uncommitted_ = 0;
+  }
+
+  // commits what is left and closes the log. a failed commit is
+  // reported on stderr rather than thrown, so it is safe at shutdown
+  bool close() noexcept {
+    if (fd_ < 0) return true;
+    bool ok = true;
+    try {
+      commit();
+    } catch (const exception & e) {
+      cerr << e.what() << endl;
+      ok = false;
+    }
+    ::close(fd_);
+    fd_ = -1;
+    return ok;
+  }
+
+  void checkpoint() {
+    commit();
+    string buf;
+    buf.append(reinterpret_cast<const char *>(&seq_), sizeof(seq_));
+    for (auto & b : balances_) {
+      Entry e = {b.first, b.second};
+      buf.append(reinterpret_cast<const char *>(&e), sizeof(e));
+    }
+    string tmp = checkpoint_path_ + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) throw runtime_error("can't open " + tmp);
+    bool written = ::write(fd, buf.data(), buf.size()) == ssize_t(buf.size()) && ::fsync(fd) == 0;
+    ::close(fd);
+    if (!written) throw runtime_error("can't write " + tmp);
+    if (::rename(tmp.c_str(), checkpoint_path_.c_str()) != 0) throw runtime_error("can't rename " + tmp);
+    // the rename must be durable before the truncate is, or a crash
+    // can lose both. a crash before this leaves records the checkpoint
+    // already has, replay skips them by seq
+    int dir = ::open(dir_.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir < 0) throw runtime_error("can't open " + dir_);
+    bool synced = ::fsync(dir) == 0;
+    ::close(dir);
+    if (!synced) throw runtime_error("can't sync " + dir_);
+    if (::ftruncate(fd_, 0) != 0) throw runtime_error("can't truncate " + log_path_);
+  }
+
+  // balance as of the last append, recovered or logged
+  uint32_t balance(uint32_t id) const {
+    auto p = balances_.find(id);
+    return p == end(balances_) ? 0 : p->second;
+  }
+
+  uint64_t seq() const {
+    return seq_;
+  }
+
+  // appended but not yet committed
+  size_t uncommitted() const {
+    return uncommitted_;
+  }
+
+private:
+  static uint32_t fnv1a(const char * p, size_t n) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; i++) {
+      h ^= uint8_t(p[i]);
+      h *= 16777619u;
+    }
+    return h;
+  }
+
+  static bool read_file(const string & path, string & buf) {
+    ifstream ifs(path, ios::binary);
+    if (!ifs) return false;
+    buf.assign(istreambuf_iterator<char>(ifs), istreambuf_iterator<char>());
+    return true;
+  }
+
+  // stops at the first torn or corrupt record, the tail of a crash
+  void recover() {
+    string buf;
+    if (read_file(checkpoint_path_, buf) && buf.size() >= sizeof(seq_)) {
+      memcpy(&seq_, buf.data(), sizeof(seq_));
+      for (size_t off = sizeof(seq_); off + sizeof(Entry) <= buf.size(); off += sizeof(Entry)) {
+        Entry e;
+        memcpy(&e, buf.data() + off, sizeof(e));
+        balances_[e.id] = e.balance;
+      }
+    }
+    if (!read_file(log_path_, buf)) return;
+    size_t off = 0;
+    while (off + 2 * sizeof(uint32_t) <= buf.size()) {
+      uint32_t size, sum;
+      memcpy(&size, buf.data() + off, sizeof(size));
+      memcpy(&sum, buf.data() + off + sizeof(size), sizeof(sum));
+      const char * payload = buf.data() + off + 2 * sizeof(uint32_t);
+      if (size < sizeof(uint64_t) || (size - sizeof(uint64_t)) % sizeof(Entry)
+          || off + 2 * sizeof(uint32_t) + size > buf.size() || fnv1a(payload, size) != sum) {
+        break;
+      }
+      uint64_t seq;
+      memcpy(&seq, payload, sizeof(seq));
+      if (seq > seq_) {
+        for (size_t e_off = sizeof(seq); e_off < size; e_off += sizeof(Entry)) {
+          Entry e;
+          memcpy(&e, payload + e_off, sizeof(e));
+          balances_[e.id] = e.balance;
+        }
+        seq_ = seq;
+      }
+      off += 2 * sizeof(uint32_t) + size;
+    }
+  }
+
+  string dir_, checkpoint_path_, log_path_;
+  size_t group_size_;
+  int fd_ = -1;
+  string buf_;
+  size_t uncommitted_ = 0;
+  uint64_t seq_ = 0;
+  unordered_map<uint32_t, uint32_t> balances_;
+};
+
+
 template < class ConcreteAccount >
 struct Account {
 
@@ -18,6 +237,7 @@ struct Account {
 
   uint32_t deposit(uint32_t amount) {
     this->balance_ += amount;
+    this->log_balance();
     return this->balance_;
   }
 
@@ -25,6 +245,7 @@ struct Account {
   uint32_t withdraw(uint32_t amount) {
     check_balance(amount);
     balance_ -= amount;
+    this->log_balance();
     return this->balance_;
   }
 
@@ -34,14 +255,38 @@ struct Account {
   }
 
 
-  uint32_t transfer_to(Account & rhs, uint32_t amount) {
-    this->withdraw(amount);
-    rhs.deposit(amount);
+  // logged as one record when both accounts share a log
+  template <class Other>
+  uint32_t transfer_to(Account<Other> & rhs, uint32_t amount) {
+    check_balance(amount);
+    balance_ -= amount;
+    rhs.balance_ += amount;
+    if (this->log_ && this->log_ == rhs.log_) {
+      BalanceLog::Entry entries[] = {{this->id_, this->balance_}, {rhs.id_, rhs.balance_}};
+      this->log_->append(entries, 2);
+    } else {
+      this->log_balance();
+      rhs.log_balance();
+    }
+    return this->balance_;
   }
 
 protected:
   uint32_t balance_ = 0;
 private:
+  template <class> friend struct Account;
+  friend class BalanceLog;
+
+  void log_balance() {
+    if (this->log_) {
+      BalanceLog::Entry entry = {this->id_, this->balance_};
+      this->log_->append(&entry, 1);
+    }
+  }
+
+  BalanceLog * log_ = nullptr;
+  uint32_t id_ = 0;
+
   void check_balance(uint32_t amount) {
     if (amount > balance_) {
       throw std::runtime_error("overdraft");
@@ -52,14 +297,14 @@ private:
 
 
 class CheckingAccount: public Account<CheckingAccount> {
-
+public:
   static const AccountType type = AccountType::checking;
 
 };
 
 
 class SavingAccount: public Account<SavingAccount> {
-
+public:
   static const AccountType type = AccountType::saving;
 
 };
@@ -75,19 +320,9 @@ struct User {
      name(name)
   {}
 
-  void add_account(unique_ptr<Account<typename T>> account) {
-    if (!this->accounts_.count(account->type())) {
-       this->accounts_[account->type()] = account;
-    }
-  }
-
-
-  Account * get_account(AccountType & type) {
-    this->accounts_[type].get();
-  }
-
-private:
-  unordered_map<AccountType, unique_ptr<Account<typename T>>> accounts_;
+  // the account types don't share a base, so one of each by value
+  CheckingAccount checking;
+  SavingAccount saving;
 };
 
 
@@ -99,9 +334,10 @@ struct ATM {
     :curr_user_(nullptr)
     ,logged_(false)
     ,db_(db)
+  {}
 
   void login(int user_id) {
-    if (db_.count(user_id)) curr_user_ = &db_[user_id];
+    if (db_.count(user_id)) curr_user_ = &db_.at(user_id);
     logged_ = curr_user_ != nullptr;
   }
 
@@ -122,8 +358,8 @@ struct ATM {
 
 
 private:
-     Account * get_account() {
-       return curr_user_->get_account(AccountType::checking).get();
+     CheckingAccount * get_account() {
+       return &curr_user_->checking;
      }
 
      User * curr_user_;
@@ -132,6 +368,77 @@ private:
 };
 
 
+/*
+ * n random deposits, withdrawals and transfers over 1000 accounts at
+ * group sizes 1 (an fdatasync per transaction, the baseline), 16, 64
+ * and 256. a transaction's commit latency runs from its append to the
+ * fdatasync of its group. every run is then recovered from disk and
+ * compared
+ */
+void bench_log(size_t n) {
+  const string dir = "./bench_log";
+  const uint32_t accounts = 1000;
+  for (size_t group : {1, 16, 64, 256}) {
+    std::remove((dir + "/balances.checkpoint").c_str());
+    std::remove((dir + "/balances.log").c_str());
+    vector<CheckingAccount> books(accounts);
+    vector<double> latencies;
+    latencies.reserve(n);
+    double elapsed;
+    {
+      BalanceLog log(dir, group);
+      for (uint32_t a = 0; a < accounts; a++) {
+        books[a].deposit(1000);
+        log.attach(a, books[a]);
+      }
+      log.commit();
+      mt19937 rng(42);
+      vector<uint64_t> pending;
+      double rate = bench::Tsc::ns_per_tick();
+      elapsed = bench::seconds([&]() {
+        for (size_t i = 0; i < n; i++) {
+          auto & from = books[rng() % accounts];
+          auto & to = books[rng() % accounts];
+          uint32_t amount = rng() % 100;
+          pending.push_back(bench::Tsc::now());
+          switch (rng() % 3) {
+            case 0: from.deposit(amount); break;
+            case 1: if (from.balance() >= amount) from.withdraw(amount); else from.deposit(amount); break;
+            default: if (from.balance() >= amount) from.transfer_to(to, amount); else from.deposit(amount); break;
+          }
+          if (!log.uncommitted()) {
+            auto now = bench::Tsc::now();
+            for (auto t : pending) latencies.push_back((now - t) * rate);
+            pending.clear();
+          }
+        }
+        log.commit();
+      });
+    }
+
+    vector<CheckingAccount> recovered(accounts);
+    double recover_s = bench::seconds([&]() {
+      BalanceLog log(dir, group);
+      for (uint32_t a = 0; a < accounts; a++) log.attach(a, recovered[a]);
+      log.commit();
+    });
+    bool match = true;
+    for (uint32_t a = 0; a < accounts; a++) match &= books[a].balance() == recovered[a].balance();
+
+    auto latency = bench::Stats::of(move(latencies));
+    auto key = "group_" + to_string(group);
+    cout << key << "_tx_per_sec," << uint64_t(n / elapsed) << endl
+         << key << "_commit_latency_mean_us," << latency.mean / 1e3 << endl
+         << key << "_commit_latency_p99_us," << latency.p99 / 1e3 << endl
+         << key << "_recover_s," << recover_s << endl
+         << key << "_recovered_matches," << match << endl;
+  }
+  std::remove((dir + "/balances.checkpoint").c_str());
+  std::remove((dir + "/balances.log").c_str());
+  ::rmdir(dir.c_str());
+}
+
+
 int main(int argc, char *argv[])
 {
   DB user_db;
@@ -149,6 +456,44 @@ int main(int argc, char *argv[])
 
   atm.deposit(100);
 
+  {
+    const string dir = "./test_log";
+    std::remove((dir + "/balances.checkpoint").c_str());
+    std::remove((dir + "/balances.log").c_str());
+    {
+      BalanceLog log(dir, 4);
+      CheckingAccount checking;
+      SavingAccount saving;
+      log.attach(1, checking);
+      log.attach(2, saving);
+      checking.deposit(100);
+      checking.transfer_to(saving, 30);
+      log.checkpoint();
+      saving.withdraw(10);
+      try {
+        checking.withdraw(1000);
+        assert(false);
+      } catch (const runtime_error &) {
+      }
+      log.commit();
+    }
+    // checkpoint plus log
+    CheckingAccount checking;
+    SavingAccount saving;
+    BalanceLog log(dir, 4);
+    log.attach(1, checking);
+    log.attach(2, saving);
+    assert(70 == checking.balance());
+    assert(20 == saving.balance());
+    std::remove((dir + "/balances.checkpoint").c_str());
+    std::remove((dir + "/balances.log").c_str());
+    ::rmdir(dir.c_str());
+  }
+
+  // ./main bench [transactions]
+  if (argc > 1 && string(argv[1]) == "bench") {
+    bench_log(argc > 2 ? stoul(argv[2]) : 100000);
+  }
 
   return 0;
 }